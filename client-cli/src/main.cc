@@ -1,36 +1,97 @@
-#include <thread>
-#include <signal.h>
+#include <string.h>
+#include <boost/asio/io_context.hpp>
 #include <libtun/logger.h>
+#include <libtun/BufferPool.h>
+#include <libtun/IoEngine.h>
 #include <libtun/Tunnel.h>
-// #include "./parser/ParseConfig.h"
+#include <libtun/protocol/offload.h>
+#ifdef LIBTUN_IO_URING
+  #include <libtun/IoUringEngine.h>
+#endif
 
-// #define DEFAULT_INI "src/config/Autoconfig.ini"
+// dumps every packet of the tunnel, `--io-uring` reads all queues through the io_uring engine,
+// `--offload` opens the tunnel with offloads and dumps superpackets segment by segment
 
-void _sigHandler(int signum) {
-  libtun::closeDumps();
-  exit(1);
+static const char* DUMP_PATH = "/tmp/zntunnel/IP.dump";
+
+void _dumpPacket(libtun::BinLogger& dump, const libtun::Buffer& buf) {
+  dump.dump(buf.data(), buf.size());
+  dump.dump("IP_PACKET_END", 13);
 }
 
 int main(int argc, char **argv) {
-  // pcx::ParseConfig config;
-  // config.ReadConfig(DEFAULT_INI);
-  // libtun::enableFileLog(config.ReadString("LoggerStart", "dir", "/Users/edison/Desktop/zntun%N.log").c_str());
-  // libtun::enableConsoleLog();
-  // signal(SIGINT, _sigHandler);
-
-  libtun::enableFileLog("/Users/xzhao048/Desktop/zntunnel%N.log");
   libtun::enableConsoleLog();
-  libtun::Tunnel client;
-  libtun::Tunnel server;
-  if (!client.open() || !server.open()) {
-    exit(1);
+
+  auto engine = libtun::IoEngine::ASIO;
+  bool offload = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--io-uring") == 0) {
+      engine = libtun::IoEngine::IO_URING;
+    } else if (strcmp(argv[i], "--offload") == 0) {
+      offload = true;
+    }
   }
-  // std::string dir = config.ReadString("LoggerPackage", "dir", "/Users/edison/Desktop/ip");
-  while (1) {
-    auto buffer = client.read();
 
-    libtun::dumpBuffer(buffer.data, buffer.len, "/Users/xzhao048/Desktop/IP.dump");
-    libtun::dumpBuffer((uint8_t*)"IP_PACKET_END", 13, "/Users/xzhao048/Desktop/IP.dump");
+  if (offload && engine == libtun::IoEngine::IO_URING) {
+    LOG_FATAL << "--offload is not supported with the io_uring engine";
+    return 1;
+  }
+
+  // one offload buffer is all the read loop needs
+  libtun::BufferPoolOptions offloadOptions;
+  offloadOptions.buffersPerChunk = 1;
+  libtun::SizedBufferPool pools(libtun::BufferPoolOptions(), libtun::BufferPoolOptions(), offloadOptions);
+  auto& pool = pools.mtu();
+  libtun::BinLogger dump(DUMP_PATH, "client");
+  libtun::Tunnel tunnel;
+  if (!tunnel.open(1, offload)) {
+    return 1;
+  }
+
+  if (engine == libtun::IoEngine::IO_URING) {
+#ifdef LIBTUN_IO_URING
+    boost::asio::io_context context;
+    libtun::IoUringEngine uring(&context, &pool);
+    for (auto fd : tunnel.fds()) {
+      uring.read(fd, [&dump](libtun::Buffer buf) {
+        _dumpPacket(dump, buf);
+      });
+    }
+    context.run();
+#else
+    LOG_FATAL << "io_uring engine is not compiled in";
+    return 1;
+#endif
+  }
+
+  if (offload) {
+    auto buf = pools.alloc(libtun::SizedBufferPool::OFFLOAD_SIZE);
+    auto segment = pool.alloc();
+    while (1) {
+      libtun::protocol::Offload info;
+      auto packet = tunnel.read(buf, 0, &info);
+      if (packet.size() == 0) {
+        continue;
+      }
+      if (info.type == libtun::protocol::Offload::TCP4) {
+        libtun::protocol::segmentTcp4(
+          packet.data(), packet.size(), info.segmentSize,
+          [&segment]() { return segment; },
+          [&dump](libtun::Buffer seg) { _dumpPacket(dump, seg); }
+        );
+      } else {
+        libtun::protocol::completeChecksum(packet.data(), packet.size(), info);
+        _dumpPacket(dump, packet);
+      }
+    }
+  }
+
+  auto buf = pool.alloc();
+  while (1) {
+    auto packet = tunnel.read(buf);
+    if (packet.size() > 0) {
+      _dumpPacket(dump, packet);
+    }
   }
 
   return 0;
@@ -0,0 +1,196 @@
+#ifndef LIBTUN_ALLOCATION_TRIPWIRE_INCLUDED
+#define LIBTUN_ALLOCATION_TRIPWIRE_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
+#include <atomic>
+
+namespace libtun {
+
+  /* ALLOCATION TRIPWIRE
+  counts (or traps) the heap allocations made inside a datapath scope once
+  it is armed, the packet path is expected to run on pools and the handler
+  arena alone after warm-up. the scopes are compiled in with
+  LIBTUN_ALLOCATION_TRIPWIRE (`make ALLOCATION_TRIPWIRE=1`), and exactly one
+  translation unit of the program defines LIBTUN_ALLOCATION_TRIPWIRE_HOOKS
+  before its first libtun include to replace operator new and (glibc)
+  malloc, calloc and realloc with counting ones. without the flag a scope is
+  nothing.
+  */
+
+  class AllocationTripwire {
+  public:
+    enum Mode: uint8_t {
+      OFF,
+      // counted, see `allocations()`
+      COUNT,
+      // counted, then the process aborts with the size on stderr
+      TRAP,
+    };
+
+    // after warm-up, restarts the count
+    static void arm(Mode mode) {
+      _count().store(0, std::memory_order_relaxed);
+      _mode().store(mode, std::memory_order_relaxed);
+    }
+
+    static Mode mode() {
+      return (Mode)_mode().load(std::memory_order_relaxed);
+    }
+
+    // made inside datapath scopes since armed, all threads
+    static uint64_t allocations() {
+      return _count().load(std::memory_order_relaxed);
+    }
+
+    static bool inDatapath() {
+      return _depth() > 0;
+    }
+
+    static void enter() {
+      _depth()++;
+    }
+
+    static void leave() {
+      _depth()--;
+    }
+
+    // from the hooks, must not allocate
+    static void onAllocation(size_t size) {
+      if (_depth() == 0) {
+        return;
+      }
+      auto mode = _mode().load(std::memory_order_relaxed);
+      if (mode == OFF) {
+        return;
+      }
+      _count().fetch_add(1, std::memory_order_relaxed);
+      if (mode == TRAP) {
+        _depth() = 0;
+        char message[96];
+        int len = snprintf(message, sizeof(message), "allocation tripwire: %zu bytes allocated on the datapath\n", size);
+        if (len > 0 && write(STDERR_FILENO, message, len)) {}
+        abort();
+      }
+    }
+
+  private:
+    // all constant initialized, usable from the hooks before main
+    static uint32_t& _depth() {
+      static thread_local uint32_t depth;
+      return depth;
+    }
+
+    static std::atomic<uint8_t>& _mode() {
+      static std::atomic<uint8_t> mode{OFF};
+      return mode;
+    }
+
+    static std::atomic<uint64_t>& _count() {
+      static std::atomic<uint64_t> count{0};
+      return count;
+    }
+  };
+
+  // marks the calling thread as on the datapath while alive
+  class DatapathScope {
+  public:
+    DatapathScope() {
+      AllocationTripwire::enter();
+    }
+
+    ~DatapathScope() {
+      AllocationTripwire::leave();
+    }
+
+    DatapathScope(const DatapathScope&) = delete;
+  };
+
+} // namespace libtun
+
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+  #define LIBTUN_DATAPATH_SCOPE libtun::DatapathScope _datapathScope
+#else
+  #define LIBTUN_DATAPATH_SCOPE do {} while (0)
+#endif
+
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE_HOOKS
+
+#ifdef __GLIBC__
+  extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* pointer, size_t size);
+    void __libc_free(void* pointer);
+
+    void* malloc(size_t size) {
+      libtun::AllocationTripwire::onAllocation(size);
+      return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) {
+      libtun::AllocationTripwire::onAllocation(count * size);
+      return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* pointer, size_t size) {
+      libtun::AllocationTripwire::onAllocation(size);
+      return __libc_realloc(pointer, size);
+    }
+  }
+
+  // operator new counts once, not again through malloc
+  #define LIBTUN_TRIPWIRE_MALLOC __libc_malloc
+  #define LIBTUN_TRIPWIRE_FREE __libc_free
+#else
+  #define LIBTUN_TRIPWIRE_MALLOC ::malloc
+  #define LIBTUN_TRIPWIRE_FREE ::free
+#endif
+
+void* operator new(size_t size) {
+  libtun::AllocationTripwire::onAllocation(size);
+  auto pointer = LIBTUN_TRIPWIRE_MALLOC(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  return ::operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  libtun::AllocationTripwire::onAllocation(size);
+  return LIBTUN_TRIPWIRE_MALLOC(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nothrow) noexcept {
+  return ::operator new(size, nothrow);
+}
+
+void operator delete(void* pointer) noexcept {
+  LIBTUN_TRIPWIRE_FREE(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  LIBTUN_TRIPWIRE_FREE(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+  LIBTUN_TRIPWIRE_FREE(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+  LIBTUN_TRIPWIRE_FREE(pointer);
+}
+
+#undef LIBTUN_TRIPWIRE_MALLOC
+#undef LIBTUN_TRIPWIRE_FREE
+
+#endif // LIBTUN_ALLOCATION_TRIPWIRE_HOOKS
+
+#endif
@@ -0,0 +1,551 @@
+#ifndef LIBTUN_BATCHED_UDP_SOCKET_INCLUDED
+#define LIBTUN_BATCHED_UDP_SOCKET_INCLUDED
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <fmt/core.h>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+#include "./logger.h"
+#include "./BufferPool.h"
+#include "./BufferChain.h"
+#include "./FunctionRef.h"
+#include "./HandlerAllocator.h"
+
+namespace libtun {
+
+  using boost::asio::ip::udp;
+  using boost::system::error_code;
+
+  // Moves datagrams of a udp socket in batches: every readiness event drains
+  // up to `receiveDepth` batches of `batchSize` datagrams, one recvmmsg each,
+  // before going back to the reactor. every slot of a batch owns its buffer
+  // and endpoint until the handler returns. datagrams queued by
+  // `send` within the same event loop turn go out with one sendmmsg. every
+  // message carries its own endpoint, so one call covers all the sessions.
+  // on systems without recvmmsg/sendmmsg it falls back to a non-blocking loop.
+  //
+  // with `enableOffload` (linux only) the socket also receives UDP_GRO
+  // aggregates, which are split back into datagrams before the handler, and
+  // queued datagrams of the same endpoint and size are sent as one UDP_SEGMENT
+  // message gathered from their buffers.
+  //
+  // a datagram sent as a DatagramChain goes out gathered from its header and
+  // segments, nothing is copied into the payload buffer.
+  //
+  // with `receiveOnDemand` the batch takes its buffers from the pool only for
+  // the duration of a readiness event, an idle socket holds none. when the
+  // pool has none to give, the waiting datagrams are dropped and counted.
+  //
+  // NOT THREAD SAFE, must be used inside the socket's io_context.
+  class BatchedUdpSocket {
+  public:
+
+    // the buffer is only valid during the call, the handler is not copied and
+    // has to outlive the socket, e.g. `ReceiveHandler::bind<Server, &Server::onReceive>(this)`
+    typedef FunctionRef<void(const udp::endpoint&, Buffer)> ReceiveHandler;
+
+    struct Stats {
+      uint64_t receivedDatagrams = 0;
+      uint64_t receiveCalls = 0;
+      uint64_t receiveWakeups = 0;
+      uint64_t receivedAggregates = 0;
+      uint64_t sentDatagrams = 0;
+      uint64_t sendCalls = 0;
+      uint64_t sentAggregates = 0;
+      uint64_t sendDrops = 0;
+      uint64_t receiveDrops = 0;
+    };
+
+    // the kernel refuses more segments per UDP_SEGMENT message
+    static const uint32_t GSO_MAX_SEGMENTS = 64;
+    // stays below the 64KB length limit of a single udp datagram
+    static const uint32_t GSO_MAX_BYTES = 65000;
+    // a segment must fit the path MTU unfragmented (1500 - ip - udp headers),
+    // bigger datagrams are sent on their own and left to ip fragmentation
+    static const uint32_t GSO_MAX_SEGMENT_SIZE = 1472;
+
+    BatchedUdpSocket(udp::socket* socket, BufferPool<1600>* pool, uint32_t batchSize = 32, uint32_t headroom = 50):
+      _socket(socket),
+      _bufferPool(pool),
+      _batchSize(batchSize > 0 ? batchSize : 1),
+      _headroom(headroom) {
+      _txQueue.reserve(_batchSize);
+    }
+
+    BatchedUdpSocket(const BatchedUdpSocket&) = delete;
+
+    const Stats& stats() const {
+      return _stats;
+    }
+
+    uint32_t pendingCount() const {
+      return _txQueue.size();
+    }
+
+    uint32_t receiveDepth() const {
+      return _receiveDepth;
+    }
+    // more batches per wakeup save reactor round trips at high pps,
+    // the cap keeps one busy socket from starving the rest of the loop
+    void receiveDepth(uint32_t depth) {
+      _receiveDepth = depth > 0 ? depth : 1;
+    }
+
+    // must be called before `startReceive`, for the many mostly idle sockets
+    void receiveOnDemand() {
+      _onDemand = true;
+    }
+
+    bool offloadEnabled() const {
+      return _offloadPool != nullptr;
+    }
+
+    // opt-in UDP_GRO / UDP_SEGMENT, must be called before `startReceive`.
+    // returns false and keeps the plain batching when the system lacks them.
+    bool enableOffload(OffloadBufferPool* offloadPool) {
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+      if (!_rxBuffers.empty()) {
+        return false;
+      }
+
+      int enabled = 1, noDefaultSize = 0;
+      int fd = _socket->native_handle();
+      if (
+        setsockopt(fd, SOL_UDP, UDP_SEGMENT, &noDefaultSize, sizeof(noDefaultSize)) == -1 ||
+        setsockopt(fd, SOL_UDP, UDP_GRO, &enabled, sizeof(enabled)) == -1
+      ) {
+        LOG_WARNING << fmt::format("batched socket cannot enable UDP GSO/GRO: {}", strerror(errno));
+        return false;
+      }
+
+      _offloadPool = offloadPool;
+      _maxSegments = GSO_MAX_SEGMENTS;
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    void startReceive(ReceiveHandler onReceive) {
+      _onReceive = onReceive;
+
+      if (_rxBuffers.empty()) {
+        _rxBuffers.resize(_batchSize);
+        _rxEndpoints.resize(_batchSize);
+        _rxIovecs.resize(_batchSize);
+#ifdef __linux__
+        _rxMessages.resize(_batchSize);
+        _rxControls.resize(_batchSize * CMSG_SPACE(sizeof(int)));
+#endif
+        if (!_onDemand && !_acquireReceiveBuffers()) {
+          throw std::bad_alloc();
+        }
+      }
+      _waitReadable();
+    }
+
+    // takes the ownership of buf, it is returned to its pool once sent or dropped
+    void send(const udp::endpoint& to, PooledBuffer buf) {
+      DatagramChain chain;
+      chain.append(*buf);
+      send(to, chain, std::move(buf));
+    }
+
+    // `owner` keeps the payload of the chain until it is sent or dropped
+    void send(const udp::endpoint& to, const DatagramChain& chain, PooledBuffer owner) {
+      _txQueue.push_back({ to, chain, std::move(owner) });
+
+      if (_txQueue.size() >= _batchSize * _maxSegments && !_waitingWritable) {
+        flush();
+      } else if (!_flushPosted && !_waitingWritable) {
+        _flushPosted = true;
+        boost::asio::post(_socket->get_executor(), recycled([this]() {
+          _flushPosted = false;
+          flush();
+        }));
+      }
+    }
+
+    void flush() {
+      while (!_txQueue.empty() && !_waitingWritable) {
+        uint32_t count = _groupBatch();
+        int sent = _sendBatch();
+
+        if (sent < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            _waitWritable();
+            return;
+          }
+          // the head message is broken (no route, too big...), skip it only
+          LOG_DEBUG << fmt::format("batched socket drops a datagram to {}: {}", _txQueue[0].endpoint.address().to_string(), strerror(errno));
+          _stats.sendDrops += _txGroups[0].segments;
+          sent = 1;
+        } else {
+          for (int g = 0; g < sent; g++) {
+            _stats.sentDatagrams += _txGroups[g].segments;
+            _stats.sentAggregates += _txGroups[g].segments > 1 ? 1 : 0;
+          }
+        }
+
+        _release(count, sent);
+      }
+    }
+
+  private:
+    struct Datagram {
+      udp::endpoint endpoint;
+      DatagramChain chain;
+      PooledBuffer buffer;
+    };
+
+    // queued datagrams going out in one message, one datagram unless GSO is on
+    struct Group {
+      uint32_t first;
+      uint32_t segmentSize;
+      uint32_t segments;
+      uint32_t bytes;
+      uint32_t iovOffset;
+      uint32_t iovecs;
+      bool closed;
+    };
+
+    udp::socket* _socket;
+    BufferPool<1600>* _bufferPool;
+    OffloadBufferPool* _offloadPool = nullptr;
+    uint32_t _batchSize;
+    uint32_t _headroom;
+    uint32_t _maxSegments = 1;
+    uint32_t _receiveDepth = 1;
+    bool _onDemand = false;
+    ReceiveHandler _onReceive;
+    Stats _stats;
+
+    std::vector<PooledBuffer> _rxBuffers;
+    std::vector<udp::endpoint> _rxEndpoints;
+    std::vector<iovec> _rxIovecs;
+    std::vector<Datagram> _txQueue;
+    std::vector<Group> _txGroups;
+    std::vector<uint32_t> _txGroupOf;
+    std::vector<iovec> _txIovecs;
+#ifdef __linux__
+    std::vector<mmsghdr> _rxMessages;
+    std::vector<char> _rxControls;
+    std::vector<mmsghdr> _txMessages;
+    std::vector<char> _txControls;
+#endif
+    bool _flushPosted = false;
+    bool _waitingWritable = false;
+
+    void _waitReadable() {
+      _socket->async_wait(udp::socket::wait_read, recycled([this](const error_code& err) {
+        if (err.failed()) {
+          if (err != boost::asio::error::operation_aborted) {
+            LOG_ERROR << fmt::format("batched socket stops receiving: {}", err.message());
+          }
+          return;
+        }
+        _onReadable();
+        _waitReadable();
+      }));
+    }
+
+    void _waitWritable() {
+      _waitingWritable = true;
+      _socket->async_wait(udp::socket::wait_write, recycled([this](const error_code& err) {
+        _waitingWritable = false;
+        if (err != boost::asio::error::operation_aborted) {
+          flush();
+        }
+      }));
+    }
+
+    void _onReadable() {
+      _stats.receiveWakeups++;
+      if (_onDemand && !_acquireReceiveBuffers()) {
+        _discardReadable();
+        return;
+      }
+      for (uint32_t depth = 0; depth < _receiveDepth; depth++) {
+        // a short batch means the socket is drained
+        if (_receiveOnce() < (int)_batchSize) {
+          break;
+        }
+      }
+      if (_onDemand) {
+        for (auto& buf : _rxBuffers) {
+          buf.reset();
+        }
+      }
+    }
+
+    // all or nothing
+    bool _acquireReceiveBuffers() {
+      for (auto& buf : _rxBuffers) {
+        buf = _offloadPool ? _offloadPool->acquire() : _bufferPool->acquire();
+        if (!buf) {
+          for (auto& acquired : _rxBuffers) {
+            acquired.reset();
+          }
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // what one wakeup would have received, so the readiness is consumed
+    void _discardReadable() {
+      char scratch;
+      for (uint32_t i = 0; i < _batchSize * _receiveDepth; i++) {
+        if (recv(_socket->native_handle(), &scratch, sizeof(scratch), MSG_DONTWAIT) < 0) {
+          return;
+        }
+        _stats.receiveDrops++;
+      }
+    }
+
+    int _receiveOnce() {
+      for (uint32_t i = 0; i < _batchSize; i++) {
+        Buffer& buf = *_rxBuffers[i];
+        buf = Buffer(buf.internal(), buf.internalSize());
+        buf.moveFrontBoundary(_headroom);
+        _rxIovecs[i].iov_base = buf.data();
+        _rxIovecs[i].iov_len = buf.size();
+      }
+
+      int received = _receiveBatch();
+      if (received <= 0) {
+        return received;
+      }
+      _stats.receiveCalls++;
+
+      for (int i = 0; i < received; i++) {
+        uint32_t segmentSize = _receivedSegmentSize(i);
+        Buffer& buf = *_rxBuffers[i];
+
+        if (segmentSize == 0 || buf.size() <= segmentSize) {
+          _stats.receivedDatagrams++;
+          _onReceive(_rxEndpoints[i], buf);
+          continue;
+        }
+
+        // a GRO aggregate, every segment is a datagram as the peer sent it
+        _stats.receivedAggregates++;
+        for (uint32_t offset = 0; offset < buf.size(); offset += segmentSize) {
+          _stats.receivedDatagrams++;
+          _onReceive(_rxEndpoints[i], Buffer(buf.data() + offset, std::min(segmentSize, buf.size() - offset)));
+        }
+      }
+      return received;
+    }
+
+    // assigns the head of the queue to messages, returns how many datagrams are assigned
+    uint32_t _groupBatch() {
+      uint32_t count = std::min<uint32_t>(_txQueue.size(), _batchSize * _maxSegments);
+      _txGroups.clear();
+      _txGroupOf.resize(count);
+
+      for (uint32_t i = 0; i < count; i++) {
+        auto& datagram = _txQueue[i];
+        uint32_t size = datagram.chain.size();
+        uint32_t g = 0;
+
+        // an endpoint has at most one open group, its latest. a datagram that
+        // does not fit closes it, a later one joining an earlier group would
+        // overtake the datagrams in between
+        for (; g < _txGroups.size(); g++) {
+          auto& group = _txGroups[g];
+          if (group.closed || _txQueue[group.first].endpoint != datagram.endpoint) {
+            continue;
+          }
+          if (
+            size <= GSO_MAX_SEGMENT_SIZE &&
+            group.segments < _maxSegments &&
+            size <= group.segmentSize &&
+            group.bytes + size <= GSO_MAX_BYTES
+          ) {
+            break;
+          }
+          group.closed = true;
+        }
+
+        if (g == _txGroups.size()) {
+          if (_txGroups.size() == _batchSize) {
+            // no room for another message, the rest waits for the next round
+            count = i;
+            break;
+          }
+          _txGroups.push_back({ i, size, 0, 0, 0, 0, size > GSO_MAX_SEGMENT_SIZE });
+        }
+
+        auto& group = _txGroups[g];
+        group.segments++;
+        group.bytes += size;
+        group.iovecs += datagram.chain.count();
+        // only the last segment may be shorter
+        group.closed = group.closed || size < group.segmentSize;
+        _txGroupOf[i] = g;
+      }
+
+      // lay the iovecs of every message out next to each other
+      uint32_t offset = 0;
+      for (auto& group : _txGroups) {
+        group.iovOffset = offset;
+        offset += group.iovecs;
+        group.iovecs = 0;
+      }
+      _txIovecs.resize(offset);
+      for (uint32_t i = 0; i < count; i++) {
+        auto& group = _txGroups[_txGroupOf[i]];
+        group.iovecs += _txQueue[i].chain.toIovecs(&_txIovecs[group.iovOffset + group.iovecs]);
+      }
+      return count;
+    }
+
+    // drops the datagrams of the first `sentGroups` messages from the queue
+    void _release(uint32_t count, int sentGroups) {
+      uint32_t kept = 0;
+      for (uint32_t i = 0; i < _txQueue.size(); i++) {
+        if (i < count && _txGroupOf[i] < (uint32_t)sentGroups) {
+          _txQueue[i].buffer.reset();
+        } else {
+          _txQueue[kept++] = std::move(_txQueue[i]);
+        }
+      }
+      _txQueue.resize(kept);
+    }
+
+#ifdef __linux__
+    int _receiveBatch() {
+      for (uint32_t i = 0; i < _batchSize; i++) {
+        msghdr& hdr = _rxMessages[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = _rxEndpoints[i].data();
+        hdr.msg_namelen = _rxEndpoints[i].capacity();
+        hdr.msg_iov = &_rxIovecs[i];
+        hdr.msg_iovlen = 1;
+        if (_offloadPool) {
+          hdr.msg_control = _rxControls.data() + i * CMSG_SPACE(sizeof(int));
+          hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+        }
+      }
+
+      int received = recvmmsg(_socket->native_handle(), _rxMessages.data(), _batchSize, MSG_DONTWAIT, NULL);
+      for (int i = 0; i < received; i++) {
+        _rxEndpoints[i].resize(_rxMessages[i].msg_hdr.msg_namelen);
+        _rxBuffers[i]->size(_rxMessages[i].msg_len);
+      }
+      return received;
+    }
+
+    uint32_t _receivedSegmentSize(int index) {
+#ifdef UDP_GRO
+      if (!_offloadPool) return 0;
+
+      msghdr& hdr = _rxMessages[index].msg_hdr;
+      for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          return *(int*)CMSG_DATA(cmsg);
+        }
+      }
+#endif
+      return 0;
+    }
+
+    int _sendBatch() {
+      _txMessages.resize(_txGroups.size());
+      _txControls.resize(_txGroups.size() * CMSG_SPACE(sizeof(uint16_t)));
+
+      for (uint32_t g = 0; g < _txGroups.size(); g++) {
+        auto& group = _txGroups[g];
+        auto& endpoint = _txQueue[group.first].endpoint;
+
+        msghdr& hdr = _txMessages[g].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = (void*)endpoint.data();
+        hdr.msg_namelen = endpoint.size();
+        hdr.msg_iov = &_txIovecs[group.iovOffset];
+        hdr.msg_iovlen = group.iovecs;
+
+#ifdef UDP_SEGMENT
+        if (group.segments > 1) {
+          hdr.msg_control = _txControls.data() + g * CMSG_SPACE(sizeof(uint16_t));
+          hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+          auto cmsg = CMSG_FIRSTHDR(&hdr);
+          cmsg->cmsg_level = SOL_UDP;
+          cmsg->cmsg_type = UDP_SEGMENT;
+          cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          *(uint16_t*)CMSG_DATA(cmsg) = group.segmentSize;
+        }
+#endif
+      }
+
+      _stats.sendCalls++;
+      return sendmmsg(_socket->native_handle(), _txMessages.data(), _txGroups.size(), MSG_DONTWAIT);
+    }
+#else
+    int _receiveBatch() {
+      int received = 0;
+      while (received < (int)_batchSize) {
+        socklen_t namelen = _rxEndpoints[received].capacity();
+        auto len = recvfrom(
+          _socket->native_handle(),
+          _rxIovecs[received].iov_base,
+          _rxIovecs[received].iov_len,
+          MSG_DONTWAIT,
+          _rxEndpoints[received].data(),
+          &namelen
+        );
+        if (len < 0) {
+          break;
+        }
+        _rxEndpoints[received].resize(namelen);
+        _rxBuffers[received]->size(len);
+        received++;
+      }
+      return received > 0 ? received : -1;
+    }
+
+    uint32_t _receivedSegmentSize(int index) {
+      return 0;
+    }
+
+    int _sendBatch() {
+      int sent = 0;
+
+      _stats.sendCalls++;
+      while (sent < (int)_txGroups.size()) {
+        auto& group = _txGroups[sent];
+        auto& datagram = _txQueue[group.first];
+        msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = (void*)datagram.endpoint.data();
+        hdr.msg_namelen = datagram.endpoint.size();
+        hdr.msg_iov = &_txIovecs[group.iovOffset];
+        hdr.msg_iovlen = group.iovecs;
+        if (sendmsg(_socket->native_handle(), &hdr, MSG_DONTWAIT) < 0) {
+          break;
+        }
+        sent++;
+      }
+      return sent > 0 ? sent : -1;
+    }
+#endif
+
+  };
+
+} // namespace libtun
+
+#endif
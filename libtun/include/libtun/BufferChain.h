@@ -0,0 +1,142 @@
+#ifndef LIBTUN_BUFFER_CHAIN_INCLUDED
+#define LIBTUN_BUFFER_CHAIN_INCLUDED
+
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <boost/asio/buffer.hpp>
+#include <fmt/core.h>
+#include "./Exception.h"
+#include "./BufferPool.h"
+
+namespace libtun {
+
+  using boost::asio::mutable_buffer;
+
+  /* BUFFER CHAIN
+  -----------------------------------------------------------
+  | header room <- prepend |  segment  |  segment  |  ...
+  -----------------------------------------------------------
+  a datagram gathered from pieces, it goes out with one sendmsg. headers are
+  prepended back to front into the room the chain carries itself, so the
+  segments (payload buffers) need no headroom and are never copied. the room
+  is declared at compile time by every pipeline, a chain converts into one
+  with at least its room and segments. the segments are not owned.
+
+  the chain is a buffer sequence of boost::asio, e.g. for `async_send_to`.
+  */
+
+  template <uint32_t headroom, uint32_t maxSegments = 1>
+  class BufferChain {
+  public:
+    static const uint32_t HEADROOM = headroom;
+    static const uint32_t MAX_SEGMENTS = maxSegments;
+
+    typedef mutable_buffer value_type;
+    typedef const mutable_buffer* const_iterator;
+
+    BufferChain() {}
+
+    BufferChain(const BufferChain& other) {
+      _assign(other);
+    }
+
+    template <uint32_t otherHeadroom, uint32_t otherSegments>
+    BufferChain(const BufferChain<otherHeadroom, otherSegments>& other) {
+      static_assert(otherHeadroom <= headroom, "the header room does not fit");
+      static_assert(otherSegments <= maxSegments, "the segments do not fit");
+      _assign(other);
+    }
+
+    BufferChain& operator = (const BufferChain& other) {
+      _assign(other);
+      return *this;
+    }
+
+    // room for `len` more header bytes in front, written by the caller
+    uint8_t* prepend(uint32_t len) {
+      if (len > headroom - _headerSize) {
+        throw Exception(fmt::format("buffer chain header room of {} bytes is exceeded by {}", headroom, len));
+      }
+      _headerSize += len;
+      _segments[0] = mutable_buffer(_header + headroom - _headerSize, _headerSize);
+      return _header + headroom - _headerSize;
+    }
+
+    void append(void* data, uint32_t len) {
+      if (_count == maxSegments) {
+        throw Exception(fmt::format("buffer chain has no room for more than {} segments", maxSegments));
+      }
+      _segments[1 + _count++] = mutable_buffer(data, len);
+    }
+    void append(const Buffer& buf) {
+      append(buf.data(), buf.size());
+    }
+
+    void clear() {
+      _headerSize = 0;
+      _count = 0;
+    }
+
+    uint8_t* header() { return _header + headroom - _headerSize; }
+    uint32_t headerSize() const { return _headerSize; }
+
+    // total bytes, header included
+    uint32_t size() const {
+      uint32_t size = _headerSize;
+      for (uint32_t i = 1; i <= _count; i++) {
+        size += _segments[i].size();
+      }
+      return size;
+    }
+
+    // iovecs the chain takes, an empty header takes none
+    uint32_t count() const {
+      return end() - begin();
+    }
+
+    const_iterator begin() const {
+      return _segments + (_headerSize > 0 ? 0 : 1);
+    }
+    const_iterator end() const {
+      return _segments + 1 + _count;
+    }
+
+    // fills `count()` iovecs
+    uint32_t toIovecs(iovec* iovecs) const {
+      uint32_t n = 0;
+      for (auto it = begin(); it != end(); ++it, ++n) {
+        iovecs[n].iov_base = it->data();
+        iovecs[n].iov_len = it->size();
+      }
+      return n;
+    }
+
+  private:
+    template <uint32_t, uint32_t> friend class BufferChain;
+
+    uint8_t _header[headroom > 0 ? headroom : 1];
+    uint32_t _headerSize = 0;
+    // the first one is the header
+    mutable_buffer _segments[1 + maxSegments];
+    uint32_t _count = 0;
+
+    template <uint32_t otherHeadroom, uint32_t otherSegments>
+    void _assign(const BufferChain<otherHeadroom, otherSegments>& other) {
+      _headerSize = other._headerSize;
+      memcpy(_header + headroom - _headerSize, other._header + otherHeadroom - _headerSize, _headerSize);
+      _segments[0] = mutable_buffer(_header + headroom - _headerSize, _headerSize);
+      _count = other._count;
+      for (uint32_t i = 1; i <= _count; i++) {
+        _segments[i] = other._segments[i];
+      }
+    }
+  };
+
+  // what the sockets take, room for every header stack of the library
+  typedef BufferChain<16, 1> DatagramChain;
+
+} // namespace libtun
+
+#endif
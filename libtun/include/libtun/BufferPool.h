@@ -2,11 +2,15 @@
 #define LIBTUN_BUFFER_POOL_INCLUDED
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <new>
 #include <list>
-#include <stack>
-#include <mutex>
+#include <atomic>
 #include <boost/asio/buffer.hpp>
 #include <boost/endian/conversion.hpp>
+#include <fmt/core.h>
+#include "./Exception.h"
+#include "./impl/BufferPool/MagazineDepot.h"
 
 namespace libtun {
 
@@ -22,6 +26,7 @@ namespace libtun {
     Buffer(const Buffer& other):
       _data(other._data), _size(other._size),
       _internal(other._internal), _internalSize(other._internalSize) {}
+    Buffer& operator = (const Buffer&) = default;
 
     // getters
     uint8_t* data() const { return _data; }
@@ -129,58 +134,377 @@ namespace libtun {
   };
 
 
+  // the buffers one consumer (e.g. a session) holds in flight, charged by
+  // `PooledBuffer::charge()` and released with the handle. `limit` 0 is unbounded.
+  // refusals, and the allocation failures reported with `refuse()`, are counted
+  class BufferQuota {
+  public:
+    BufferQuota(uint32_t limit = 0): _limit(limit) {}
+
+    BufferQuota(const BufferQuota&) = delete;
+
+    void limit(uint32_t limit) { _limit.store(limit, std::memory_order_relaxed); }
+    uint32_t limit() const { return _limit.load(std::memory_order_relaxed); }
+    uint32_t inFlight() const { return _inFlight.load(std::memory_order_relaxed); }
+    uint64_t refused() const { return _refused.load(std::memory_order_relaxed); }
+
+    // false (and counted) once the quota is used up, to shed work before any buffer is taken
+    bool admits() {
+      uint32_t limit = _limit.load(std::memory_order_relaxed);
+      if (limit > 0 && _inFlight.load(std::memory_order_relaxed) >= limit) {
+        refuse();
+        return false;
+      }
+      return true;
+    }
+
+    bool charge() {
+      if (!admits()) {
+        return false;
+      }
+      _inFlight.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    void release() {
+      _inFlight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void refuse() {
+      _refused.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // for a new owner of the quota, buffers still in flight stay charged
+    void resetRefused() {
+      _refused.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint32_t> _limit;
+    std::atomic<uint32_t> _inFlight{0};
+    std::atomic<uint64_t> _refused{0};
+  };
+
+
+  /* POOLED BUFFER
+  -----------------------------------------------------
+  | prefix | data ... | suffix | (reference count) |
+  -----------------------------------------------------
+  owns a buffer of a pool, move only. the buffer goes back to the pool it
+  came from when the owner is destroyed or reset, whichever path that is.
+  `share()` keeps an atomic reference count in the last bytes of the buffer,
+  which leave the view, then every `ref()` is one more owner of the memory
+  (with a view of its own) and the last owner returns it. a handle charged
+  to a BufferQuota releases it when it lets go, the refs are not charged.
+  */
+
+  class PooledBuffer {
+  public:
+    PooledBuffer() {}
+    PooledBuffer(impl::MagazineDepot* depot, const Buffer& buffer):
+      _depot(depot), _buffer(buffer) {}
+
+    PooledBuffer(PooledBuffer&& other) noexcept:
+      _depot(other._depot), _buffer(other._buffer), _refs(other._refs), _quota(other._quota) {
+      other._depot = nullptr;
+      other._refs = nullptr;
+      other._quota = nullptr;
+    }
+
+    PooledBuffer& operator = (PooledBuffer&& other) noexcept {
+      if (this != &other) {
+        reset();
+        _depot = other._depot;
+        _buffer = other._buffer;
+        _refs = other._refs;
+        _quota = other._quota;
+        other._depot = nullptr;
+        other._refs = nullptr;
+        other._quota = nullptr;
+      }
+      return *this;
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator = (const PooledBuffer&) = delete;
+
+    ~PooledBuffer() {
+      reset();
+    }
+
+    explicit operator bool() const { return _depot != nullptr; }
+    Buffer& operator * () { return _buffer; }
+    const Buffer& operator * () const { return _buffer; }
+    Buffer* operator -> () { return &_buffer; }
+    const Buffer* operator -> () const { return &_buffer; }
+
+    void reset() {
+      if (!_depot) {
+        return;
+      }
+      if (!_refs || _refs->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        _depot->free(_buffer.internal());
+      }
+      if (_quota) {
+        _quota->release();
+      }
+      _depot = nullptr;
+      _refs = nullptr;
+      _quota = nullptr;
+    }
+
+    // counts the buffer in flight for `quota` until the handle lets go, false
+    // when the quota is used up (the buffer is kept, it is up to the caller)
+    bool charge(BufferQuota* quota) {
+      if (!_depot || _quota || !quota->charge()) {
+        return false;
+      }
+      _quota = quota;
+      return true;
+    }
+
+    // false when there is no buffer or the data reaches into the last bytes
+    bool share() {
+      if (!_depot || _refs) {
+        return _refs != nullptr;
+      }
+      auto internal = _buffer.internal();
+      auto slot = (uintptr_t)(internal + _buffer.internalSize() - sizeof(RefCount)) & ~(uintptr_t)(alignof(RefCount) - 1);
+      if (slot < (uintptr_t)(_buffer.data() + _buffer.size())) {
+        return false;
+      }
+
+      Buffer view(internal, slot - (uintptr_t)internal);
+      view.moveFrontBoundary(_buffer.prefixSpace());
+      view.size(_buffer.size());
+      _buffer = view;
+      _refs = new ((void*)slot) RefCount(1);
+      return true;
+    }
+
+    // another owner of a shared buffer, an empty one if it is not shared
+    PooledBuffer ref() const {
+      PooledBuffer other;
+      if (_refs) {
+        _refs->fetch_add(1, std::memory_order_relaxed);
+        other._depot = _depot;
+        other._buffer = _buffer;
+        other._refs = _refs;
+      }
+      return other;
+    }
+
+    uint32_t refCount() const {
+      return _refs ? _refs->load(std::memory_order_relaxed) : (_depot ? 1 : 0);
+    }
+
+  private:
+    typedef std::atomic<uint32_t> RefCount;
+
+    impl::MagazineDepot* _depot = nullptr;
+    Buffer _buffer;
+    RefCount* _refs = nullptr;
+    BufferQuota* _quota = nullptr;
+  };
+
+
+  /* BUFFER POOL
+  fixed size buffers carved out of page aligned chunks, idle chunks are only
+  released by `trim()` or with the pool. alloc / free run on per-thread magazines and take
+  no lock unless the pool grows (impl/BufferPool/MagazineDepot.h), a buffer
+  may be freed on another thread than it was allocated on. BufferPoolOptions
+  moves the chunks to huge pages / a NUMA node and faults them in up front
+  (impl/BufferPool/ChunkMemory.h).
+  */
+
   template<uint32_t bufferSize = 2000>
   class BufferPool {
   public:
     BufferPool(uint32_t buffersPerChunk = 32):
-      _buffersPerChunk(buffersPerChunk) {}
+      _depot(bufferSize, _chunks(buffersPerChunk)) {}
+
+    explicit BufferPool(const BufferPoolOptions& options):
+      _depot(bufferSize, options) {
+      reserve(options.initialChunks * _depot.chunkSize() / bufferSize);
+    }
 
+    BufferPool(const BufferPool&) = delete;
+
+    typedef impl::MagazineDepot::Stats Stats;
+
+    // throws std::bad_alloc at the hard limit
     Buffer alloc() {
-      std::lock_guard<std::mutex> guard(_locker);
-      if (_available.empty()) {
-        _allocChunk();
+      auto data = _depot.alloc();
+      if (!data) {
+        throw std::bad_alloc();
       }
-      auto data = _available.top();
-      _available.pop();
       return Buffer(data, bufferSize);
     }
 
+    // an owning handle, nothing to free by hand. empty at the hard limit
+    PooledBuffer acquire() {
+      auto data = _depot.alloc();
+      return data ? PooledBuffer(&_depot, Buffer(data, bufferSize)) : PooledBuffer();
+    }
+
+    // false at the hard limit, the refusal is counted in `stats().exhausted`
+    bool tryAlloc(Buffer& buffer) {
+      auto data = _depot.alloc();
+      if (!data) {
+        return false;
+      }
+      buffer = Buffer(data, bufferSize);
+      return true;
+    }
+
     void free(const Buffer& buffer) {
-      std::lock_guard<std::mutex> guard(_locker);
-      _available.push(buffer.internal());
+      _depot.free(buffer.internal());
+    }
+
+    // gives the buffers cached by the calling thread back to the shared depot
+    void flush() {
+      _depot.flush();
     }
 
-    uint32_t availableCount() {
-      return _available.size();
+    uint32_t availableCount() const {
+      return _depot.availableCount();
     }
-    uint32_t allCount() {
-      return _memoryChunks.size() * _buffersPerChunk;
+    uint32_t allCount() const {
+      return _depot.allCount();
     }
-    uint32_t consumedCount() {
-      return allCount() - availableCount();
+    uint32_t consumedCount() const {
+      return _depot.consumedCount();
     }
 
-    ~BufferPool() {
-      std::lock_guard<std::mutex> guard(_locker);
-      for (auto buffer : _memoryChunks) {
-        delete[] buffer;
-      }
+    // the soft limit is reached, producers should stop taking buffers
+    bool pressured() const {
+      return _depot.pressured();
+    }
+
+    Stats stats() const {
+      return _depot.stats();
+    }
+
+    // allocates chunks up front until at least `count` buffers exist or the hard limit
+    void reserve(uint32_t count) {
+      _depot.reserve(count);
+    }
+
+    // releases idle chunks, to be called periodically (BufferPoolOptions::releaseIdle)
+    uint32_t trim() {
+      return _depot.trim();
+    }
+
+    // chunk memory, for registering it with the kernel (io_uring fixed buffers)
+    std::list<uint8_t*> chunks() {
+      return _depot.chunks();
+    }
+    uint32_t chunkSize() const {
+      return _depot.chunkSize();
     }
 
   private:
-    uint32_t _buffersPerChunk;
-    std::mutex _locker;
-    std::list<uint8_t*> _memoryChunks;
-    std::stack<uint8_t*> _available;
+    impl::MagazineDepot _depot;
 
-    uint8_t* _allocChunk() {
-      auto data = new uint8_t[bufferSize * _buffersPerChunk];
-      _memoryChunks.push_back(data);
-      for (int i = 0; i < _buffersPerChunk; i++) {
-        _available.push(data + i * bufferSize);
+    static BufferPoolOptions _chunks(uint32_t buffersPerChunk) {
+      BufferPoolOptions options;
+      options.buffersPerChunk = buffersPerChunk;
+      return options;
+    }
+  };
+
+  // buffers large enough to hold a whole GRO / GSO / TSO aggregate
+  typedef BufferPool<65536> OffloadBufferPool;
+
+
+  /* SIZE CLASSED BUFFER POOLS
+  -------------------------------------------
+  |  SMALL 256  |  MTU 1600  |  OFFLOAD 64K  |
+  -------------------------------------------
+  one pool per size class behind one interface, a request is served by the
+  smallest class it fits. control messages take SMALL buffers instead of
+  pinning MTU ones, aggregates take OFFLOAD ones. components bound to one
+  size take the pool of its class (`mtu()`, `offload()`). every class has
+  its own options, limits and stats.
+  */
+
+  class SizedBufferPool {
+  public:
+    enum Class: uint8_t {
+      SMALL,
+      MTU,
+      OFFLOAD,
+      CLASS_COUNT,
+    };
+
+    static const uint32_t SMALL_SIZE = 256;
+    static const uint32_t MTU_SIZE = 1600;
+    static const uint32_t OFFLOAD_SIZE = 65536;
+
+    SizedBufferPool() {}
+    SizedBufferPool(const BufferPoolOptions& small, const BufferPoolOptions& mtu, const BufferPoolOptions& offload):
+      _small(small), _mtu(mtu), _offload(offload) {}
+
+    SizedBufferPool(const SizedBufferPool&) = delete;
+
+    // CLASS_COUNT when no class holds `size` bytes
+    static Class classOf(uint32_t size) {
+      if (size <= SMALL_SIZE) return SMALL;
+      if (size <= MTU_SIZE) return MTU;
+      if (size <= OFFLOAD_SIZE) return OFFLOAD;
+      return CLASS_COUNT;
+    }
+
+    // an owning handle of the smallest class holding `size` bytes, empty at its hard limit
+    PooledBuffer acquire(uint32_t size) {
+      switch (classOf(size)) {
+        case SMALL: return _small.acquire();
+        case MTU: return _mtu.acquire();
+        case OFFLOAD: return _offload.acquire();
+        default: throw Exception(fmt::format("no buffer class holds {} bytes", size));
+      }
+    }
+
+    // throws std::bad_alloc at the hard limit of the class
+    Buffer alloc(uint32_t size) {
+      switch (classOf(size)) {
+        case SMALL: return _small.alloc();
+        case MTU: return _mtu.alloc();
+        case OFFLOAD: return _offload.alloc();
+        default: throw Exception(fmt::format("no buffer class holds {} bytes", size));
+      }
+    }
+
+    // the class is told by the size of the whole buffer
+    void free(const Buffer& buffer) {
+      switch (classOf(buffer.internalSize())) {
+        case SMALL: return _small.free(buffer);
+        case MTU: return _mtu.free(buffer);
+        default: return _offload.free(buffer);
+      }
+    }
+
+    BufferPool<SMALL_SIZE>& small() { return _small; }
+    BufferPool<MTU_SIZE>& mtu() { return _mtu; }
+    OffloadBufferPool& offload() { return _offload; }
+
+    impl::MagazineDepot::Stats stats(Class sizeClass) const {
+      switch (sizeClass) {
+        case SMALL: return _small.stats();
+        case MTU: return _mtu.stats();
+        default: return _offload.stats();
       }
-      return data;
     }
+
+    // trims every class, returns the released chunks
+    uint32_t trim() {
+      return _small.trim() + _mtu.trim() + _offload.trim();
+    }
+
+  private:
+    BufferPool<SMALL_SIZE> _small;
+    BufferPool<MTU_SIZE> _mtu;
+    OffloadBufferPool _offload;
   };
 
 } // namespace libtun
@@ -0,0 +1,67 @@
+#ifndef LIBTUN_FUNCTION_REF_INCLUDED
+#define LIBTUN_FUNCTION_REF_INCLUDED
+
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+namespace libtun {
+
+  /* FUNCTION REF
+  a non-owning reference to a callable for the per-packet callbacks: two
+  pointers and one call through a function pointer, nothing is allocated or
+  copied. the callable has to outlive the reference, so only lvalues are
+  taken. `bind<T, &T::method>(object)` refers to a member function of a long
+  lived object instead.
+  */
+
+  template <typename Signature>
+  class FunctionRef;
+
+  template <typename R, typename... Args>
+  class FunctionRef<R(Args...)> {
+  public:
+    FunctionRef() {}
+
+    template <
+      typename F,
+      typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, FunctionRef>::value>::type
+    >
+    FunctionRef(F& callable):
+      _object((void*)std::addressof(callable)),
+      _call(&FunctionRef::_invoke<F>) {}
+
+    template <typename T, R (T::*method)(Args...)>
+    static FunctionRef bind(T* object) {
+      FunctionRef ref;
+      ref._object = object;
+      ref._call = &FunctionRef::_invokeMethod<T, method>;
+      return ref;
+    }
+
+    explicit operator bool() const {
+      return _call != nullptr;
+    }
+
+    R operator () (Args... args) const {
+      return _call(_object, std::forward<Args>(args)...);
+    }
+
+  private:
+    void* _object = nullptr;
+    R (*_call)(void*, Args...) = nullptr;
+
+    template <typename F>
+    static R _invoke(void* object, Args... args) {
+      return (*(F*)object)(std::forward<Args>(args)...);
+    }
+
+    template <typename T, R (T::*method)(Args...)>
+    static R _invokeMethod(void* object, Args... args) {
+      return (((T*)object)->*method)(std::forward<Args>(args)...);
+    }
+  };
+
+} // namespace libtun
+
+#endif
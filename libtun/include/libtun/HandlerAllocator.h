@@ -0,0 +1,175 @@
+#ifndef LIBTUN_HANDLER_ALLOCATOR_INCLUDED
+#define LIBTUN_HANDLER_ALLOCATOR_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "./MemoryAccounting.h"
+
+namespace libtun {
+namespace impl {
+
+  /* HANDLER ARENA
+  -------------------------------------------------
+  | 64B free list | 128B free list | ... | 1KB    |
+  -------------------------------------------------
+  per-thread free lists of the blocks asio allocates its operations (and the
+  handlers in them) from. a block goes back to the list of the thread that
+  frees it, asio frees an operation right before its handler runs, so the
+  next operation of that handler reuses it. larger blocks and lists beyond
+  MAX_CACHED go straight to the heap. the lists are plain thread local data
+  that outlives every other thread local object, a block freed after the
+  thread's cleanup ran goes to the heap. the cached blocks count as in use
+  in the HANDLERS memory account.
+  */
+
+  class HandlerArena {
+  public:
+    static const size_t GRANULE = 64;
+    static const size_t CLASSES = 16;
+    static const uint32_t MAX_CACHED = 256;
+
+    // of the calling thread
+    struct Stats {
+      uint64_t heapAllocations;
+      uint64_t recycled;
+    };
+
+    static void* allocate(size_t size) {
+      size_t sizeClass = (size + GRANULE - 1) / GRANULE - 1;
+      auto& state = _state();
+      if (sizeClass >= CLASSES) {
+        state.stats.heapAllocations++;
+        MemoryAccounting::account(MemoryAccounting::HANDLERS).allocated(size);
+        return ::operator new(size);
+      }
+      auto block = state.free[sizeClass];
+      if (block) {
+        state.free[sizeClass] = block->next;
+        state.count[sizeClass]--;
+        state.stats.recycled++;
+        return block;
+      }
+      state.stats.heapAllocations++;
+      MemoryAccounting::account(MemoryAccounting::HANDLERS).allocated((sizeClass + 1) * GRANULE);
+      return ::operator new((sizeClass + 1) * GRANULE);
+    }
+
+    static void deallocate(void* pointer, size_t size) {
+      size_t sizeClass = (size + GRANULE - 1) / GRANULE - 1;
+      auto& state = _state();
+      if (sizeClass >= CLASSES || state.closed || state.count[sizeClass] >= MAX_CACHED) {
+        MemoryAccounting::account(MemoryAccounting::HANDLERS).released(sizeClass >= CLASSES ? size : (sizeClass + 1) * GRANULE);
+        ::operator delete(pointer);
+        return;
+      }
+      if (!state.registered) {
+        state.registered = true;
+        static thread_local Cleanup cleanup;
+        (void)cleanup;
+      }
+      auto block = (Block*)pointer;
+      block->next = state.free[sizeClass];
+      state.free[sizeClass] = block;
+      state.count[sizeClass]++;
+    }
+
+    static Stats stats() {
+      return _state().stats;
+    }
+
+  private:
+    struct Block {
+      Block* next;
+    };
+
+    // trivially destructible, valid for the whole life of the thread
+    struct State {
+      Block* free[CLASSES];
+      uint32_t count[CLASSES];
+      Stats stats;
+      bool registered;
+      bool closed;
+    };
+
+    struct Cleanup {
+      ~Cleanup() {
+        auto& state = _state();
+        for (size_t i = 0; i < CLASSES; i++) {
+          while (state.free[i]) {
+            auto next = state.free[i]->next;
+            MemoryAccounting::account(MemoryAccounting::HANDLERS).released((i + 1) * GRANULE);
+            ::operator delete(state.free[i]);
+            state.free[i] = next;
+          }
+          state.count[i] = 0;
+        }
+        state.closed = true;
+      }
+    };
+
+    static State& _state() {
+      static thread_local State state;
+      return state;
+    }
+  };
+
+} // namespace impl
+
+  // an allocator on the HandlerArena of the calling thread
+  template <typename T>
+  class HandlerAllocator {
+  public:
+    typedef T value_type;
+
+    HandlerAllocator() noexcept {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+      return (T*)impl::HandlerArena::allocate(n * sizeof(T));
+    }
+    void deallocate(T* pointer, size_t n) {
+      impl::HandlerArena::deallocate(pointer, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator == (const HandlerAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator != (const HandlerAllocator<U>&) const noexcept { return false; }
+  };
+
+  // a completion handler whose asio operation comes from the HandlerArena
+  template <typename Handler>
+  class RecyclingHandler {
+  public:
+    typedef HandlerAllocator<void> allocator_type;
+
+    explicit RecyclingHandler(Handler handler):
+      _handler(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept {
+      return allocator_type();
+    }
+
+    template <typename... Args>
+    void operator () (Args&&... args) {
+      _handler(std::forward<Args>(args)...);
+    }
+
+  private:
+    Handler _handler;
+  };
+
+  // wraps the handler of a datapath async operation, e.g.
+  // `socket.async_wait(udp::socket::wait_read, recycled([this](const error_code& err) { ... }))`
+  template <typename Handler>
+  RecyclingHandler<typename std::decay<Handler>::type> recycled(Handler&& handler) {
+    return RecyclingHandler<typename std::decay<Handler>::type>(std::forward<Handler>(handler));
+  }
+
+} // namespace libtun
+
+#endif
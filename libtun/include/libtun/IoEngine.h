@@ -0,0 +1,24 @@
+#ifndef LIBTUN_IO_ENGINE_INCLUDED
+#define LIBTUN_IO_ENGINE_INCLUDED
+
+#include <stdint.h>
+
+namespace libtun {
+
+  // selected at startup, IO_URING requires a build with LIBTUN_IO_URING (linux + liburing)
+  enum IoEngine: uint8_t {
+    ASIO,
+    IO_URING,
+  };
+
+  inline bool ioUringCompiled() {
+#ifdef LIBTUN_IO_URING
+    return true;
+#else
+    return false;
+#endif
+  }
+
+} // namespace libtun
+
+#endif
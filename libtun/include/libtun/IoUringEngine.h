@@ -0,0 +1,480 @@
+#ifndef LIBTUN_IO_URING_ENGINE_INCLUDED
+#define LIBTUN_IO_URING_ENGINE_INCLUDED
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <liburing.h>
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <fmt/core.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/pool/object_pool.hpp>
+#include <boost/system/error_code.hpp>
+#include "./logger.h"
+#include "./Exception.h"
+#include "./BufferPool.h"
+#include "./BufferChain.h"
+#include "./FunctionRef.h"
+#include "./HandlerAllocator.h"
+#include "./IoEngine.h"
+
+namespace libtun {
+
+  using boost::asio::io_context;
+  using boost::asio::ip::udp;
+  using boost::asio::posix::stream_descriptor;
+  using boost::object_pool;
+  using boost::system::error_code;
+
+  /* io_uring I/O ENGINE
+  ---------------------------------------------------------------------------
+  | io_context | -- eventfd readable --> | reap CQEs -> handlers | -> submit |
+  ---------------------------------------------------------------------------
+  every receive (multishot recvmsg on udp sockets, read on tun queues) picks
+  its buffer from a provided-buffer ring filled with BufferPool buffers, the
+  buffer goes back to the ring right after the handler returns. the chunks
+  of the pool are registered as fixed buffers, writes of pool buffers use
+  them. readiness of other fds (the raw socket ring) is a multishot poll, so
+  everything is driven by the io_context thread and no reader thread exists.
+
+  NOT THREAD SAFE, must be used inside the io_context.
+  */
+
+  class IoUringEngine {
+  public:
+
+    // buffers are only valid during the call. datagrams are the per-packet
+    // path, their handler is a reference to a callable outliving the engine
+    typedef FunctionRef<void(const udp::endpoint&, Buffer)> DatagramHandler;
+    typedef std::function<void(Buffer)> PacketHandler;
+    typedef std::function<void()> ReadableHandler;
+
+    struct Stats {
+      uint64_t submitCalls = 0;
+      uint64_t completions = 0;
+      uint64_t received = 0;
+      uint64_t sent = 0;
+      uint64_t sendErrors = 0;
+      uint64_t noBuffers = 0;
+    };
+
+    static const uint16_t BUFFER_GROUP = 1;
+
+    IoUringEngine(
+      io_context* context,
+      BufferPool<1600>* pool,
+      uint32_t entries = 1024,
+      uint32_t providedCount = 512,
+      uint32_t headroom = 50
+    ):
+      _context(context),
+      _bufferPool(pool),
+      _eventDescriptor(*context),
+      _headroom(headroom) {
+
+      int ret = io_uring_queue_init(entries, &_ring, 0);
+      if (ret < 0) {
+        throw Exception(fmt::format("io_uring init failed: {}", strerror(-ret)));
+      }
+
+      int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (efd == -1 || io_uring_register_eventfd(&_ring, efd) < 0) {
+        io_uring_queue_exit(&_ring);
+        throw Exception(fmt::format("io_uring eventfd failed: {}", strerror(errno)));
+      }
+      _eventDescriptor.assign(efd);
+
+      // the ring size has to be a power of 2
+      _providedCount = 1;
+      while (_providedCount < providedCount) {
+        _providedCount <<= 1;
+      }
+      _bufferPool->reserve(_bufferPool->consumedCount() + _providedCount * 2);
+      _registerPoolBuffers();
+
+      _bufRing = io_uring_setup_buf_ring(&_ring, _providedCount, BUFFER_GROUP, 0, &ret);
+      if (!_bufRing) {
+        io_uring_queue_exit(&_ring);
+        throw Exception(fmt::format("io_uring provided buffer ring failed: {}", strerror(-ret)));
+      }
+      _provided.resize(_providedCount);
+      for (uint32_t i = 0; i < _providedCount; i++) {
+        _provided[i] = _bufferPool->alloc();
+        io_uring_buf_ring_add(
+          _bufRing,
+          _provided[i].internal() + _headroom,
+          _provided[i].internalSize() - _headroom,
+          i,
+          io_uring_buf_ring_mask(_providedCount),
+          i
+        );
+      }
+      io_uring_buf_ring_advance(_bufRing, _providedCount);
+
+      _waitCompletions();
+    }
+
+    IoUringEngine(const IoUringEngine&) = delete;
+
+    ~IoUringEngine() {
+      _eventDescriptor.close();
+      io_uring_free_buf_ring(&_ring, _bufRing, _providedCount, BUFFER_GROUP);
+      io_uring_queue_exit(&_ring);
+
+      for (auto& buf : _provided) {
+        _bufferPool->free(buf);
+      }
+    }
+
+    const Stats& stats() const {
+      return _stats;
+    }
+
+    // multishot recvmsg, keeps receiving until the fd is closed
+    void receiveFrom(int fd, DatagramHandler handler) {
+      auto op = _newOperation(Operation::RECVMSG, fd);
+      op->handler = _datagramHandlers.size();
+      _datagramHandlers.push_back(handler);
+
+      memset(&op->msg, 0, sizeof(op->msg));
+      op->msg.msg_namelen = sizeof(sockaddr_in6);
+      _armReceive(op);
+    }
+
+    // keeps `outstanding` reads in flight on the fd (a tun queue)
+    void read(int fd, PacketHandler handler, uint16_t outstanding = 8) {
+      // io_uring fails reads of O_NONBLOCK files with EAGAIN instead of waiting,
+      // so the fd is switched to blocking and belongs to the engine from now on
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+      uint32_t index = _packetHandlers.size();
+      _packetHandlers.push_back(handler);
+
+      for (uint16_t i = 0; i < outstanding; i++) {
+        auto op = _newOperation(Operation::READ, fd);
+        op->handler = index;
+        _armRead(op);
+      }
+    }
+
+    // multishot poll, the handler has to consume everything readable
+    void pollReadable(int fd, ReadableHandler handler) {
+      auto op = _newOperation(Operation::POLL, fd);
+      op->handler = _readableHandlers.size();
+      _readableHandlers.push_back(handler);
+      _armPoll(op);
+    }
+
+    // takes the ownership of buf, it is returned to its pool on completion
+    void sendTo(int fd, const udp::endpoint& to, PooledBuffer buf) {
+      DatagramChain chain;
+      chain.append(*buf);
+      sendTo(fd, to, chain, std::move(buf));
+    }
+
+    // gathered from the chain, `owner` keeps its payload until the completion
+    void sendTo(int fd, const udp::endpoint& to, const DatagramChain& chain, PooledBuffer owner) {
+      auto op = _newOperation(Operation::SENDMSG, fd);
+      op->buffer = std::move(owner);
+      op->endpoint = to;
+      op->chain = chain;
+      memset(&op->msg, 0, sizeof(op->msg));
+      op->msg.msg_name = op->endpoint.data();
+      op->msg.msg_namelen = op->endpoint.size();
+      op->msg.msg_iov = op->iov;
+      op->msg.msg_iovlen = op->chain.toIovecs(op->iov);
+
+      io_uring_prep_sendmsg(_sqe(op), fd, &op->msg, 0);
+      _postSubmit();
+    }
+
+    // takes the ownership of buf, it is returned to its pool on completion
+    void write(int fd, PooledBuffer buf) {
+      auto op = _newOperation(Operation::WRITE, fd);
+      op->buffer = std::move(buf);
+
+      const Buffer& data = *op->buffer;
+      int fixedIndex = _fixedIndex(data.internal());
+      auto sqe = _sqe(op);
+      if (fixedIndex >= 0) {
+        io_uring_prep_write_fixed(sqe, fd, data.data(), data.size(), (uint64_t)-1, fixedIndex);
+      } else {
+        io_uring_prep_write(sqe, fd, data.data(), data.size(), (uint64_t)-1);
+      }
+      _postSubmit();
+    }
+
+  private:
+    struct Operation {
+      enum Type: uint8_t { RECVMSG, READ, POLL, SENDMSG, WRITE };
+
+      Type type;
+      int fd;
+      uint32_t handler;
+      PooledBuffer buffer;
+      udp::endpoint endpoint;
+      DatagramChain chain;
+      iovec iov[1 + DatagramChain::MAX_SEGMENTS];
+      msghdr msg;
+    };
+
+    io_context* _context;
+    BufferPool<1600>* _bufferPool;
+    io_uring _ring;
+    stream_descriptor _eventDescriptor;
+    uint64_t _eventCount;
+    uint32_t _headroom;
+    Stats _stats;
+
+    io_uring_buf_ring* _bufRing = nullptr;
+    uint32_t _providedCount;
+    std::vector<Buffer> _provided;
+    std::map<uint8_t*, int> _fixedChunks;
+    uint32_t _chunkSize = 0;
+
+    // operations still in flight are destroyed with the pool, their buffers go back
+    object_pool<Operation> _ops;
+    std::vector<DatagramHandler> _datagramHandlers;
+    std::vector<PacketHandler> _packetHandlers;
+    std::vector<ReadableHandler> _readableHandlers;
+    bool _reaping = false;
+    bool _submitPosted = false;
+
+    Operation* _newOperation(Operation::Type type, int fd) {
+      auto op = _ops.construct();
+      op->type = type;
+      op->fd = fd;
+      op->handler = 0;
+      return op;
+    }
+
+    void _registerPoolBuffers() {
+      std::vector<iovec> iovecs;
+      int index = 0;
+      for (auto chunk : _bufferPool->chunks()) {
+        iovecs.push_back({ .iov_base = chunk, .iov_len = _bufferPool->chunkSize() });
+        _fixedChunks[chunk] = index++;
+      }
+      _chunkSize = _bufferPool->chunkSize();
+
+      int ret = io_uring_register_buffers(&_ring, iovecs.data(), iovecs.size());
+      if (ret < 0) {
+        LOG_WARNING << fmt::format("io_uring cannot register pool buffers: {}", strerror(-ret));
+        _fixedChunks.clear();
+      }
+    }
+
+    // index of the registered chunk holding the buffer, -1 if the pool grew past them
+    int _fixedIndex(uint8_t* internal) {
+      auto it = _fixedChunks.upper_bound(internal);
+      if (it == _fixedChunks.begin()) return -1;
+      --it;
+      return internal < it->first + _chunkSize ? it->second : -1;
+    }
+
+    io_uring_sqe* _sqe(Operation* op) {
+      auto sqe = io_uring_get_sqe(&_ring);
+      if (!sqe) {
+        // the submission queue is full
+        _submit();
+        sqe = io_uring_get_sqe(&_ring);
+      }
+      if (!sqe) {
+        throw Exception("io_uring submission queue is full");
+      }
+      io_uring_sqe_set_data(sqe, op);
+      return sqe;
+    }
+
+    void _armReceive(Operation* op) {
+      auto sqe = _sqe(op);
+      io_uring_prep_recvmsg_multishot(sqe, op->fd, &op->msg, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+      _postSubmit();
+    }
+
+    void _armRead(Operation* op) {
+      auto sqe = _sqe(op);
+      io_uring_prep_read(sqe, op->fd, NULL, _provided[0].internalSize() - _headroom, (uint64_t)-1);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+      _postSubmit();
+    }
+
+    void _armPoll(Operation* op) {
+      io_uring_prep_poll_multishot(_sqe(op), op->fd, POLLIN);
+      _postSubmit();
+    }
+
+    void _postSubmit() {
+      // completions submit once the whole batch is reaped
+      if (_reaping || _submitPosted) return;
+
+      _submitPosted = true;
+      boost::asio::post(*_context, recycled([this]() {
+        _submitPosted = false;
+        _submit();
+      }));
+    }
+
+    void _submit() {
+      _stats.submitCalls++;
+      int ret = io_uring_submit(&_ring);
+      if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+        LOG_ERROR << fmt::format("io_uring submit failed: {}", strerror(-ret));
+      }
+    }
+
+    void _waitCompletions() {
+      _eventDescriptor.async_read_some(
+        boost::asio::buffer(&_eventCount, sizeof(_eventCount)),
+        recycled([this](const error_code& err, std::size_t) {
+          if (err.failed() && err != boost::asio::error::would_block) {
+            if (err != boost::asio::error::operation_aborted) {
+              LOG_ERROR << fmt::format("io_uring eventfd failed: {}", err.message());
+            }
+            return;
+          }
+          _reap();
+          _waitCompletions();
+        })
+      );
+    }
+
+    void _reap() {
+      io_uring_cqe* cqes[64];
+      unsigned count;
+
+      _reaping = true;
+      while ((count = io_uring_peek_batch_cqe(&_ring, cqes, 64)) > 0) {
+        for (unsigned i = 0; i < count; i++) {
+          _complete(cqes[i]);
+        }
+        io_uring_cq_advance(&_ring, count);
+        _stats.completions += count;
+      }
+      _reaping = false;
+      _submit();
+    }
+
+    void _complete(io_uring_cqe* cqe) {
+      auto op = (Operation*)io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+      bool hasBuffer = cqe->flags & IORING_CQE_F_BUFFER;
+      uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+      switch (op->type) {
+      case Operation::RECVMSG:
+        if (res >= 0 && hasBuffer) {
+          _onDatagram(op, bid, res);
+        }
+        if (!more && _rearmable(op, res)) {
+          _armReceive(op);
+        }
+        break;
+
+      case Operation::READ:
+        if (res > 0 && hasBuffer) {
+          _stats.received++;
+          Buffer buf = _provided[bid];
+          buf.moveFrontBoundary(_headroom);
+          buf.size(res);
+          _packetHandlers[op->handler](buf);
+        }
+        if (hasBuffer) {
+          _recycle(bid);
+        }
+        if (_rearmable(op, res)) {
+          _armRead(op);
+        }
+        break;
+
+      case Operation::POLL:
+        if (res >= 0) {
+          _readableHandlers[op->handler]();
+        }
+        if (!more && _rearmable(op, res)) {
+          _armPoll(op);
+        }
+        break;
+
+      case Operation::SENDMSG:
+      case Operation::WRITE:
+        if (res < 0) {
+          _stats.sendErrors++;
+          LOG_DEBUG << fmt::format("io_uring send on fd {} failed: {}", op->fd, strerror(-res));
+        } else {
+          _stats.sent++;
+        }
+        _ops.destroy(op);
+        break;
+      }
+    }
+
+    void _onDatagram(Operation* op, uint16_t bid, int len) {
+      Buffer buf = _provided[bid];
+      buf.moveFrontBoundary(_headroom);
+
+      auto out = io_uring_recvmsg_validate(buf.data(), len, &op->msg);
+      if (out && !(out->flags & MSG_TRUNC) && out->namelen <= op->endpoint.capacity()) {
+        _stats.received++;
+        memcpy(op->endpoint.data(), io_uring_recvmsg_name(out), out->namelen);
+        op->endpoint.resize(out->namelen);
+
+        auto payload = (uint8_t*)io_uring_recvmsg_payload(out, &op->msg);
+        buf.moveFrontBoundary(payload - buf.data());
+        buf.size(io_uring_recvmsg_payload_length(out, len, &op->msg));
+        _datagramHandlers[op->handler](op->endpoint, buf);
+      }
+      _recycle(bid);
+    }
+
+    void _recycle(uint16_t bid) {
+      io_uring_buf_ring_add(
+        _bufRing,
+        _provided[bid].internal() + _headroom,
+        _provided[bid].internalSize() - _headroom,
+        bid,
+        io_uring_buf_ring_mask(_providedCount),
+        0
+      );
+      io_uring_buf_ring_advance(_bufRing, 1);
+    }
+
+    // receives stop for good once their fd is gone
+    bool _rearmable(Operation* op, int res) {
+      if (res == -ENOBUFS) {
+        _stats.noBuffers++;
+        return true;
+      }
+      if (res == -ECANCELED || res == -EBADF || res == -ENOTSOCK) {
+        _ops.destroy(op);
+        return false;
+      }
+      if (res < 0) {
+        LOG_WARNING << fmt::format("io_uring operation on fd {} failed: {}", op->fd, strerror(-res));
+      }
+      return true;
+    }
+
+  };
+
+} // namespace libtun
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef LIBTUN_KERNEL_NAT_INCLUDED
+#define LIBTUN_KERNEL_NAT_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <boost/asio/ip/network_v4.hpp>
+#include <fmt/core.h>
+#include "./logger.h"
+#include "./Exception.h"
+#ifdef __linux__
+  #include "./impl/KernelNat/Nftables.h"
+#endif
+
+namespace libtun {
+
+  using boost::asio::ip::network_v4;
+
+  /* KERNEL NAT EGRESS
+  ---------------------------------------------------------------------------
+  | session -> inner address | tun | kernel routing | masquerade | uplink |
+  ---------------------------------------------------------------------------
+  every session owns an address of `network`, its packets are written into a
+  tun device and the kernel forwards and source NATs them like any routed
+  host, replies come back through the tun. `install` turns on IP4 forwarding
+  and adds the masquerade rule in its own nftables table, `remove` deletes
+  that table again and puts ip_forward back to what it was. a crashed server
+  leaves both behind, `nft delete table ip zntunnel` and
+  `sysctl net.ipv4.ip_forward=0` undo them. linux only, needs CAP_NET_ADMIN.
+  */
+
+  class KernelNat {
+  public:
+    static constexpr const char* TABLE = "zntunnel";
+
+    KernelNat() {}
+    KernelNat(const KernelNat&) = delete;
+
+    ~KernelNat() {
+      remove();
+    }
+
+    // `ifName` is the tun device, traffic routed back into it is not masqueraded
+    void install(const network_v4& network, const std::string& ifName) {
+#ifdef __linux__
+      std::ifstream previous(IP_FORWARD);
+      std::getline(previous, _previousForward);
+      if (!_writeForward("1")) {
+        throw Exception("kernel nat enable ip forwarding failed");
+      }
+
+      try {
+        _nftables.reset(new impl::Nftables());
+        _nftables->addMasquerade(TABLE, network.network().to_uint(), network.prefix_length(), ifName);
+      } catch (...) {
+        _nftables.reset();
+        _restoreForward();
+        throw;
+      }
+      LOG_INFO << fmt::format("kernel nat masquerades {} leaving through any device but {}", network.to_string(), ifName);
+#else
+      throw Exception("kernel nat is only supported on linux");
+#endif
+    }
+
+    void remove() {
+#ifdef __linux__
+      if (!_nftables) {
+        return;
+      }
+      try {
+        _nftables->deleteTable(TABLE);
+      } catch (const std::exception& err) {
+        LOG_ERROR << err.what();
+      }
+      _nftables.reset();
+      _restoreForward();
+#endif
+    }
+
+    bool installed() const {
+#ifdef __linux__
+      return _nftables != nullptr;
+#else
+      return false;
+#endif
+    }
+
+  private:
+#ifdef __linux__
+    static constexpr const char* IP_FORWARD = "/proc/sys/net/ipv4/ip_forward";
+
+    std::unique_ptr<impl::Nftables> _nftables;
+    // ip_forward before `install`, empty when it could not be read
+    std::string _previousForward;
+
+    bool _writeForward(const std::string& value) {
+      std::ofstream forward(IP_FORWARD);
+      return (bool)(forward << value << std::flush);
+    }
+
+    // only what `install` turned on is turned off again
+    void _restoreForward() {
+      if (_previousForward.empty() || _previousForward == "1") {
+        return;
+      }
+      if (!_writeForward(_previousForward)) {
+        LOG_ERROR << fmt::format("kernel nat cannot restore ip_forward to {}", _previousForward);
+      }
+      _previousForward.clear();
+    }
+#endif
+  };
+
+} // namespace libtun
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef LIBTUN_MEMORY_ACCOUNTING_INCLUDED
+#define LIBTUN_MEMORY_ACCOUNTING_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <cstddef>
+#include <new>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <fmt/format.h>
+
+namespace libtun {
+
+  /* MEMORY ACCOUNTING
+  ---------------------------------------------
+  | BUFFERS | NAPT | RPC | SESSIONS | HANDLERS |
+  ---------------------------------------------
+  process wide byte counters per subsystem, with the high water mark of each.
+  the subsystems charge what they take from the heap (or mmap): buffer pool
+  chunks, the NAPT tables, rpc control blocks, the session table and the
+  handler arena. containers take an `AccountedAllocator`, boost pools an
+  `AccountedUserAllocator`. the counters are relaxed atomics, cheap enough
+  for every allocation but only a consistent picture when the process is
+  quiet.
+  */
+
+  class MemoryAccount {
+  public:
+    struct Usage {
+      uint64_t bytes;
+      uint64_t highWater;
+      uint64_t allocations;
+    };
+
+    void allocated(size_t size) {
+      uint64_t bytes = _bytes.fetch_add(size, std::memory_order_relaxed) + size;
+      _allocations.fetch_add(1, std::memory_order_relaxed);
+      uint64_t highWater = _highWater.load(std::memory_order_relaxed);
+      while (bytes > highWater && !_highWater.compare_exchange_weak(highWater, bytes, std::memory_order_relaxed)) {}
+    }
+
+    void released(size_t size) {
+      _bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    Usage usage() const {
+      return {
+        _bytes.load(std::memory_order_relaxed),
+        _highWater.load(std::memory_order_relaxed),
+        _allocations.load(std::memory_order_relaxed),
+      };
+    }
+
+  private:
+    std::atomic<uint64_t> _bytes{0};
+    std::atomic<uint64_t> _highWater{0};
+    std::atomic<uint64_t> _allocations{0};
+  };
+
+  class MemoryAccounting {
+  public:
+    enum Tag: uint8_t {
+      BUFFERS,
+      NAPT_TABLES,
+      RPC,
+      SESSIONS,
+      HANDLERS,
+      TAGS,
+    };
+
+    static MemoryAccount& account(Tag tag) {
+      static MemoryAccount accounts[TAGS];
+      return accounts[tag];
+    }
+
+    static MemoryAccount::Usage usage(Tag tag) {
+      return account(tag).usage();
+    }
+
+    static const char* name(Tag tag) {
+      static const char* names[TAGS] = {"buffers", "napt", "rpc", "sessions", "handlers"};
+      return names[tag];
+    }
+
+    // one line per subsystem and the total, for the logs
+    static std::string report() {
+      std::string out;
+      uint64_t bytes = 0;
+      uint64_t highWater = 0;
+      for (uint8_t i = 0; i < TAGS; i++) {
+        auto usage = account((Tag)i).usage();
+        out += fmt::format(
+          "{:<9} {:>12} bytes, high water {:>12} bytes, {} allocations\n",
+          name((Tag)i), usage.bytes, usage.highWater, usage.allocations
+        );
+        bytes += usage.bytes;
+        highWater += usage.highWater;
+      }
+      out += fmt::format("{:<9} {:>12} bytes, high water {:>12} bytes (sum)", "total", bytes, highWater);
+      return out;
+    }
+  };
+
+  // a std::allocator charging the account of `tag`
+  template <typename T, MemoryAccounting::Tag tag>
+  class AccountedAllocator {
+  public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+      typedef AccountedAllocator<U, tag> other;
+    };
+
+    AccountedAllocator() noexcept {}
+    template <typename U>
+    AccountedAllocator(const AccountedAllocator<U, tag>&) noexcept {}
+
+    T* allocate(size_t n) {
+      auto pointer = std::allocator<T>().allocate(n);
+      MemoryAccounting::account(tag).allocated(n * sizeof(T));
+      return pointer;
+    }
+
+    void deallocate(T* pointer, size_t n) {
+      MemoryAccounting::account(tag).released(n * sizeof(T));
+      std::allocator<T>().deallocate(pointer, n);
+    }
+
+    template <typename U>
+    bool operator == (const AccountedAllocator<U, tag>&) const noexcept { return true; }
+    template <typename U>
+    bool operator != (const AccountedAllocator<U, tag>&) const noexcept { return false; }
+  };
+
+  // the UserAllocator of boost::pool and boost::object_pool charging the
+  // account of `tag`. boost frees without a size, so every block carries it
+  // in a header
+  template <MemoryAccounting::Tag tag>
+  struct AccountedUserAllocator {
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    static char* malloc(const size_type size) {
+      auto block = (char*)::malloc(size + HEADER);
+      if (!block) {
+        return nullptr;
+      }
+      *(size_type*)block = size;
+      MemoryAccounting::account(tag).allocated(size);
+      return block + HEADER;
+    }
+
+    static void free(char* const pointer) {
+      auto block = pointer - HEADER;
+      MemoryAccounting::account(tag).released(*(size_type*)block);
+      ::free(block);
+    }
+
+  private:
+    // keeps the blocks aligned as malloc's own
+    static const size_t HEADER = alignof(std::max_align_t);
+  };
+
+} // namespace libtun
+
+#endif
@@ -1,71 +1,270 @@
 #ifndef LIBTUN_RAW_SOCKET_INCLUDED
 #define LIBTUN_RAW_SOCKET_INCLUDED
 
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+  #include <sys/eventfd.h>
+#endif
+
 #include <string>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/system/error_code.hpp>
+#include "./SpscRing.h"
+#include "./FunctionRef.h"
+#include "./HandlerAllocator.h"
 #ifdef __APPLE__
   #include "./impl/RawSocket/RawSocket_darwin.h"
+#elif defined(__linux__) && defined(LIBTUN_AF_XDP)
+  #include "./impl/RawSocket/RawSocket_xdp.h"
+#elif defined(__linux__)
+  #include "./impl/RawSocket/RawSocket_linux.h"
 #endif
 
 namespace libtun {
 
   using boost::asio::io_context;
   using boost::asio::ip::address_v4;
+  using boost::asio::posix::stream_descriptor;
+
+  /* READER THREAD HANDOFF
+  ------------------------------------------------------------------------------
+  | reader: read() -> hold() -> packet refs, batch end into the ring -> wake    |
+  | io_context: wakeup readable -> drain refs -> onPacket, batch end -> release |
+  ------------------------------------------------------------------------------
+  the ring carries pointers into the backend buffers (TPACKET blocks, UMEM
+  frames), a batch stays out of the kernel's hands until the loop reaches
+  its end and releases it. the reader keeps room in the ring for the ends of
+  every batch the backend can hold, packets that do not fit are dropped and
+  counted. the ring is only allocated by `start()`.
+
+  packets over the interface MTU (what GRO or LRO merged, the interface
+  offloads are never touched) are dropped and counted on either path, they
+  show up as `stats().oversize`.
+
+  `onPacket` refers to a member of a long lived owner, e.g.
+  `PacketHandler::bind<Server, &Server::onRaw>(this)`. `poll(handler)` takes
+  any callable instead and inlines it into the packet loop.
+  */
 
   class RawSocket {
   public:
 
+    static const uint32_t RING_SLOTS = 16384;
+
+    // a packet in a held backend batch, or (data == nullptr) the end of a
+    // batch of `size` backend units
+    struct PacketRef {
+      uint8_t* data;
+      uint32_t size;
+    };
+
+    typedef SpscRing<PacketRef>::Stats RingStats;
+    typedef FunctionRef<void(uint8_t*, uint32_t)> PacketHandler;
+
+    struct Stats {
+      RingStats ring;
+      // did not fit in the ring
+      uint64_t dropped;
+      // over the interface MTU
+      uint64_t oversize;
+    };
+
     std::string ifName;
     address_v4 ifAddress;
-    std::function<void(uint8_t*, uint32_t)> onPacket;
+    PacketHandler onPacket;
 
     void start(io_context* context, uint16_t portFrom, uint16_t portTo, const std::string& ifName = "") {
-      _context = context;
+      open(portFrom, portTo, ifName);
+      _ring.reset(RING_SLOTS);
+      _openWakeup(context);
+      _waitPackets();
+
+      _reading = true;
+      _thread = std::thread(std::bind(&RawSocket::_startRead, this));
+    }
+
+    // opens without the reader thread, the owner has to call `poll()`
+    // from its event loop whenever `fd()` is readable. only the ring backends
+    // (packet socket, AF_XDP) hand packets over without a blocking read().
+    void open(uint16_t portFrom, uint16_t portTo, const std::string& ifName = "") {
       _useInterface(ifName);
-      _impl.open(portFrom, portTo, this->ifName);
+      _impl.open(portFrom, portTo, this->ifName, ifAddress);
+      _mtu = impl::interfaceMtu(this->ifName);
 
       LOG_TRACE << fmt::format(
-        "raw socket open successfully on: {}, ip addres: {}",
-        this->ifName, ifAddress.to_string()
+        "raw socket open successfully on: {}, ip addres: {}, mtu: {}",
+        this->ifName, ifAddress.to_string(), _mtu
       );
+    }
 
-      _reading = true;
-      _thread = std::thread(std::bind(&RawSocket::_startRead, this));
+    int fd() {
+      return _impl.fd();
+    }
+
+    // consumes everything readable without blocking
+    void poll() {
+      poll(onPacket);
+    }
+    template <typename Handler>
+    void poll(Handler&& handler) {
+      auto filtered = [this, &handler](uint8_t* data, uint32_t size) {
+        if (!_oversized(size)) {
+          handler(data, size);
+        }
+      };
+      while (_impl.consumable()) {
+        _impl.consume(filtered);
+      }
     }
 
     void stop() {
       _reading = false;
+      if (_thread.joinable()) {
+        _thread.join();
+      }
+      if (_wakeup) {
+        _wakeup->close();
+      }
+      if (_wakeupWriteFd != -1 && _wakeupWriteFd != _wakeupReadFd) {
+        ::close(_wakeupWriteFd);
+      }
+      _wakeupWriteFd = _wakeupReadFd = -1;
       _impl.close();
     }
 
+    // the ring has no slots without the reader thread
+    Stats stats() const {
+      return {
+        .ring = _ring.stats(),
+        .dropped = _dropped.load(std::memory_order_relaxed),
+        .oversize = _oversize.load(std::memory_order_relaxed),
+      };
+    }
+
     int write(uint8_t* data, uint32_t size) {
       return _impl.write(data, size);
     }
 
+    // egress reads the gateway MAC and the routes once at open, the owner
+    // calls this every few seconds from its loop (outside any datapath
+    // scope, it reads /proc) so they follow ARP and route changes
+    void refreshNextHop() {
+      _impl.refreshNextHop(ifName);
+    }
+
   private:
     impl::RawSocketImpl _impl;
-    io_context* _context;
-    bool _reading = false;
+    std::atomic<bool> _reading{false};
     std::thread _thread;
-    std::mutex _mutex;
-    std::condition_variable _cv;
+    SpscRing<PacketRef> _ring;
+    uint32_t _mtu = 0;
+    std::atomic<uint64_t> _dropped{0};
+    std::atomic<uint64_t> _oversize{0};
+    std::unique_ptr<stream_descriptor> _wakeup;
+    int _wakeupReadFd = -1;
+    int _wakeupWriteFd = -1;
+    // a pipe may hold several wakeups, they are all drained at once
+    uint8_t _wakeupBuf[64];
 
     void _startRead() {
+      // the ends of the held batches always find a slot
+      const uint32_t reserved = impl::RawSocketImpl::HELD_BATCHES;
+      auto push = [this, reserved](uint8_t* data, uint32_t size) {
+        if (_oversized(size)) return;
+        if (_ring.size() + reserved >= _ring.capacity()) {
+          _dropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+
+        auto slot = _ring.producerSlot();
+        slot->data = data;
+        slot->size = size;
+        _ring.publish();
+      };
+
       while (_reading) {
-        std::unique_lock<std::mutex> locker(_mutex);
-        _impl.read();
-        if (!_reading) return;
+        if (_impl.read() <= 0) continue;
+
+        // one wakeup per backend batch, not per packet
+        bool held = false;
+        while (_impl.consumable()) {
+          uint32_t units = _impl.hold(push);
+          if (units == 0) break;
 
-        boost::asio::post(*_context, [&]() {
-          std::unique_lock<std::mutex> locker(_mutex);
-          _impl.consume(onPacket);
-          _cv.notify_one();
-        });
+          auto slot = _ring.producerSlot();
+          slot->data = nullptr;
+          slot->size = units;
+          _ring.publish();
+          held = true;
+        }
+        if (held) {
+          _wake();
+        }
+      }
+    }
 
-        _cv.wait(locker, [&]() { return _impl.consumable(); });
+    bool _oversized(uint32_t size) {
+      if (_mtu == 0 || size <= _mtu) {
+        return false;
       }
+      _oversize.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    // eventfd on linux, a pipe elsewhere
+    void _openWakeup(io_context* context) {
+#ifdef __linux__
+      _wakeupReadFd = _wakeupWriteFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (_wakeupReadFd == -1) {
+        throw Exception(fmt::format("raw socket eventfd failed: {}", strerror(errno)));
+      }
+#else
+      int fds[2];
+      if (pipe(fds) == -1) {
+        throw Exception(fmt::format("raw socket pipe failed: {}", strerror(errno)));
+      }
+      _wakeupReadFd = fds[0];
+      _wakeupWriteFd = fds[1];
+#endif
+      _wakeup.reset(new stream_descriptor(*context, _wakeupReadFd));
+      _wakeup->non_blocking(true);
+    }
+
+    void _wake() {
+      uint64_t one = 1;
+      if (::write(_wakeupWriteFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_ERROR << fmt::format("raw socket wakeup failed: {}", strerror(errno));
+      }
+    }
+
+    void _waitPackets() {
+      _wakeup->async_read_some(
+        boost::asio::buffer(_wakeupBuf, sizeof(_wakeupBuf)),
+        recycled([this](const boost::system::error_code& err, std::size_t) {
+          if (err.failed() && err != boost::asio::error::would_block) {
+            return;
+          }
+
+          PacketRef* packet;
+          while ((packet = _ring.consumerSlot())) {
+            if (packet->data) {
+              onPacket(packet->data, packet->size);
+            } else {
+              _impl.release(packet->size);
+            }
+            _ring.release();
+          }
+          _waitPackets();
+        })
+      );
     }
 
     void _useInterface(const std::string& name) {
@@ -0,0 +1,144 @@
+#ifndef LIBTUN_SPSC_RING_INCLUDED
+#define LIBTUN_SPSC_RING_INCLUDED
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+namespace libtun {
+
+  /* SPSC RING
+  ------------------------------------------------------------
+  | released | ... consumer -> | readable ... | <- producer |
+  ------------------------------------------------------------
+  bounded single producer / single consumer ring, slots are written and read
+  in place: the producer fills `producerSlot()` then `publish()`es it, the
+  consumer reads `consumerSlot()` then `release()`s it. no locks, each index
+  is written by one side only. a full ring never blocks the producer, it gets
+  no slot and the miss is counted.
+  */
+
+  template<typename T>
+  class SpscRing {
+  public:
+
+    struct Stats {
+      uint32_t capacity;
+      uint32_t size;
+      uint32_t highWatermark;
+      uint64_t published;
+      uint64_t released;
+      uint64_t full;
+    };
+
+    // capacity is rounded up to a power of 2
+    explicit SpscRing(uint32_t capacity) {
+      reset(capacity);
+    }
+
+    // no slots until `reset()`
+    SpscRing() {}
+
+    SpscRing(const SpscRing&) = delete;
+
+    // empties the ring with new slots and zeroed stats, neither side may be
+    // running
+    void reset(uint32_t capacity) {
+      uint32_t rounded = 1;
+      while (rounded < capacity) {
+        rounded <<= 1;
+      }
+      std::vector<T>(rounded).swap(_slots);
+      _mask = rounded - 1;
+
+      _head.store(0, std::memory_order_relaxed);
+      _cachedTail = 0;
+      _highWatermark.store(0, std::memory_order_relaxed);
+      _published.store(0, std::memory_order_relaxed);
+      _full.store(0, std::memory_order_relaxed);
+      _tail.store(0, std::memory_order_relaxed);
+      _cachedHead = 0;
+      _released.store(0, std::memory_order_relaxed);
+    }
+
+    // producer side, nullptr when the ring is full
+    T* producerSlot() {
+      uint32_t head = _head.load(std::memory_order_relaxed);
+      if (head - _cachedTail > _mask) {
+        _cachedTail = _tail.load(std::memory_order_acquire);
+        if (head - _cachedTail > _mask) {
+          _full.fetch_add(1, std::memory_order_relaxed);
+          return nullptr;
+        }
+      }
+      return &_slots[head & _mask];
+    }
+
+    void publish() {
+      uint32_t head = _head.load(std::memory_order_relaxed) + 1;
+      _head.store(head, std::memory_order_release);
+      _published.fetch_add(1, std::memory_order_relaxed);
+
+      uint32_t size = head - _tail.load(std::memory_order_relaxed);
+      if (size > _highWatermark.load(std::memory_order_relaxed)) {
+        _highWatermark.store(size, std::memory_order_relaxed);
+      }
+    }
+
+    // consumer side, nullptr when the ring is empty
+    T* consumerSlot() {
+      uint32_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _cachedHead) {
+        _cachedHead = _head.load(std::memory_order_acquire);
+        if (tail == _cachedHead) {
+          return nullptr;
+        }
+      }
+      return &_slots[tail & _mask];
+    }
+
+    void release() {
+      _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      _released.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint32_t capacity() const {
+      return _slots.size();
+    }
+
+    // exact only from the producer or the consumer thread
+    uint32_t size() const {
+      return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+    }
+
+    Stats stats() const {
+      return {
+        .capacity = capacity(),
+        .size = size(),
+        .highWatermark = _highWatermark.load(std::memory_order_relaxed),
+        .published = _published.load(std::memory_order_relaxed),
+        .released = _released.load(std::memory_order_relaxed),
+        .full = _full.load(std::memory_order_relaxed),
+      };
+    }
+
+  private:
+    std::vector<T> _slots;
+    uint32_t _mask = 0;
+
+    // written by the producer
+    alignas(64) std::atomic<uint32_t> _head{0};
+    uint32_t _cachedTail = 0;
+    std::atomic<uint32_t> _highWatermark{0};
+    std::atomic<uint64_t> _published{0};
+    std::atomic<uint64_t> _full{0};
+
+    // written by the consumer
+    alignas(64) std::atomic<uint32_t> _tail{0};
+    uint32_t _cachedHead = 0;
+    std::atomic<uint64_t> _released{0};
+  };
+
+} // namespace libtun
+
+#endif
@@ -0,0 +1,670 @@
+#ifndef LIBTUN_TCP_RELAY_INCLUDED
+#define LIBTUN_TCP_RELAY_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/container_hash/hash.hpp>
+#include "./FunctionRef.h"
+#include "./HandlerAllocator.h"
+#include "./protocol/ip4.h"
+#include "./protocol/tcp.h"
+
+namespace libtun {
+
+  using boost::asio::io_context;
+  using boost::asio::steady_timer;
+  using boost::asio::ip::address_v4;
+  using boost::system::error_code;
+
+  /* TCP RELAY
+  -----------------------------------------------------------------------------
+  | client | tunnel | relay: terminated TCP | kernel TCP socket | destination |
+  -----------------------------------------------------------------------------
+  inner TCP flows end at a small userspace TCP endpoint, the payload goes on
+  over an ordinary connected socket, so the egress leg gets the kernel's
+  congestion control, TSO and large writes. the endpoint only does what the
+  tunnel leg needs:
+  - the client's SYN is answered after the upstream connect succeeds, a
+    failed connect resets the client and so does one still pending after
+    the retransmit timer gave up. a client opens at most `maxFlowsPerClient`
+    flows and the relay `maxFlows` in all, SYNs beyond are reset
+  - in order data only, anything else is answered with a duplicate ACK, the
+    advertised window shrinks with the bytes not written upstream yet
+  - data toward the client respects its window (with window scaling), unacked
+    data is resent go back N on a doubling timeout, a zero window is probed
+  - a FIN is passed on as shutdown(send) either way, the flow is gone once
+    both sides are closed and our FIN is acked, RST tears it down at once
+  `onPacket` gets every IP4 packet toward the client, valid during the call,
+  it refers to a member of the owner, e.g.
+  `PacketHandler::bind<Server, &Server::toClient>(this)`.
+  NOT THREAD SAFE, everything runs on the io_context.
+  */
+
+  class TcpRelay {
+  public:
+    static const uint16_t RECEIVE_WINDOW = 65535;
+    static const uint32_t SEND_BUFFER = 256 * 1024;
+    static const uint32_t READ_CHUNK = 64 * 1024;
+    static const uint16_t DEFAULT_MSS = 536;
+    static const uint16_t MAX_MSS = 1460;
+    static const uint32_t MAX_RETRIES = 8;
+    static const uint32_t RETRANSMIT_MS = 500;
+
+    struct Stats {
+      uint64_t flows;
+      uint64_t upstreamBytes;
+      uint64_t downstreamBytes;
+      uint64_t retransmits;
+      uint64_t resets;
+      // over the caps
+      uint64_t refusedFlows;
+    };
+
+    // FUNCTION: (clientId, packet, size) => void
+    typedef FunctionRef<void(uint16_t, uint8_t*, uint32_t)> PacketHandler;
+    PacketHandler onPacket;
+
+    TcpRelay(io_context* context, uint32_t maxFlowsPerClient = 256, uint32_t maxFlows = 16384):
+      _context(context),
+      _maxFlowsPerClient(maxFlowsPerClient),
+      _maxFlows(maxFlows),
+      _random(std::random_device()()) {}
+
+    TcpRelay(const TcpRelay&) = delete;
+
+    ~TcpRelay() {
+      while (!_flows.empty()) {
+        _close(_flows.begin()->second);
+      }
+    }
+
+    // a decrypted IP4/TCP packet from the client
+    void input(uint16_t clientId, uint8_t* data, uint32_t size) {
+      protocol::Ip4 ip(data, size);
+      if (size < 40 || ip.version() != 4 || ip.protocol() != protocol::Ip4::Protocol::TCP) {
+        return;
+      }
+      uint32_t ipHeaderLen = ip.headerLen() * 4;
+      if (ip.totalLen() > size || ipHeaderLen + 20 > ip.totalLen()) {
+        return;
+      }
+
+      protocol::Tcp tcp(ip);
+      uint32_t headerLen = tcp.headerLen() * 4;
+      if (headerLen < 20 || ipHeaderLen + headerLen > ip.totalLen()) {
+        return;
+      }
+      Segment segment = {
+        .flags = tcp.flags(),
+        .sequence = tcp.sequence(),
+        .acknowledgment = tcp.acknowledgment(),
+        .window = tcp.window(),
+        .options = data + ipHeaderLen + 20,
+        .optionsLen = headerLen - 20,
+        .payload = data + ipHeaderLen + headerLen,
+        .payloadLen = ip.totalLen() - ipHeaderLen - headerLen,
+      };
+
+      FlowKey key = {
+        .clientId = clientId,
+        .clientIP = ip.sourceIP().to_uint(),
+        .clientPort = tcp.sourcePort(),
+        .destIP = ip.destIP().to_uint(),
+        .destPort = tcp.destPort(),
+      };
+
+      auto it = _flows.find(key);
+      if (it == _flows.end()) {
+        if (segment.flags & RST) {
+          return;
+        }
+        if ((segment.flags & (SYN | ACK)) != SYN) {
+          return _resetUnknown(key, segment);
+        }
+        return _open(key, segment);
+      }
+
+      auto flow = it->second;
+      if (segment.flags & RST) {
+        return _close(flow);
+      }
+      if (segment.flags & SYN) {
+        // a retransmitted SYN, our SYN-ACK got lost
+        if (flow->state == Flow::SYN_RECEIVED) {
+          _sendSynAck(flow);
+        }
+        return;
+      }
+      if (flow->state == Flow::CONNECTING) {
+        return;
+      }
+
+      if (segment.flags & ACK) {
+        _onAck(flow, segment);
+      }
+      if (flow->state == Flow::ESTABLISHED) {
+        _onData(flow, segment);
+      }
+    }
+
+    // closes every flow of a client, e.g. when its session ends
+    void removeClient(uint16_t clientId) {
+      std::vector<std::shared_ptr<Flow>> flows;
+      for (auto& entry : _flows) {
+        if (entry.first.clientId == clientId) {
+          flows.push_back(entry.second);
+        }
+      }
+      for (auto& flow : flows) {
+        _close(flow, true);
+      }
+    }
+
+    size_t flowCount() const {
+      return _flows.size();
+    }
+
+    const Stats& stats() const {
+      return _stats;
+    }
+
+  private:
+    static const uint8_t FIN = 0b00000001;
+    static const uint8_t SYN = 0b00000010;
+    static const uint8_t RST = 0b00000100;
+    static const uint8_t PSH = 0b00001000;
+    static const uint8_t ACK = 0b00010000;
+
+    struct Segment {
+      uint8_t flags;
+      uint32_t sequence;
+      uint32_t acknowledgment;
+      uint16_t window;
+      uint8_t* options;
+      uint32_t optionsLen;
+      uint8_t* payload;
+      uint32_t payloadLen;
+    };
+
+    struct FlowKey {
+      uint16_t clientId;
+      uint32_t clientIP;
+      uint16_t clientPort;
+      uint32_t destIP;
+      uint16_t destPort;
+      bool operator == (const FlowKey& k) const {
+        return clientId == k.clientId && clientIP == k.clientIP && clientPort == k.clientPort &&
+          destIP == k.destIP && destPort == k.destPort;
+      }
+    };
+    struct FlowKeyHash {
+      size_t operator() (const FlowKey& k) const {
+        size_t seed = 0;
+        boost::hash_combine(seed, k.clientId);
+        boost::hash_combine(seed, k.clientIP);
+        boost::hash_combine(seed, k.clientPort);
+        boost::hash_combine(seed, k.destIP);
+        boost::hash_combine(seed, k.destPort);
+        return seed;
+      }
+    };
+
+    struct Flow {
+      enum State: uint8_t {
+        CONNECTING,
+        SYN_RECEIVED,
+        ESTABLISHED,
+        CLOSED,
+      };
+
+      FlowKey key;
+      boost::asio::ip::tcp::socket socket;
+      steady_timer timer;
+      State state = CONNECTING;
+      uint16_t mss = DEFAULT_MSS;
+      bool windowScaling = false;
+      uint8_t windowScale = 0;
+
+      // client -> upstream
+      uint32_t receiveNext = 0;
+      std::string pendingWrite;
+      std::string writing;
+      uint16_t advertisedWindow = RECEIVE_WINDOW;
+      bool clientFin = false;
+      bool upstreamShutdown = false;
+
+      // upstream -> client, sendBuffer[sendHead] is the byte at sendUnacked
+      uint32_t initialSequence = 0;
+      uint32_t sendUnacked = 0;
+      uint32_t sendNext = 0;
+      uint32_t clientWindow = 0;
+      std::string sendBuffer;
+      uint32_t sendHead = 0;
+      std::vector<uint8_t> readBuffer;
+      bool reading = false;
+      bool upstreamEof = false;
+      bool finSent = false;
+      uint32_t finSequence = 0;
+      bool timerArmed = false;
+      uint32_t retries = 0;
+
+      Flow(io_context& context): socket(context), timer(context) {}
+
+      uint32_t sendBuffered() const {
+        return sendBuffer.size() - sendHead;
+      }
+      uint32_t dataEnd() const {
+        return sendUnacked + sendBuffered();
+      }
+      bool finAcked() const {
+        return finSent && sendUnacked == finSequence + 1;
+      }
+    };
+
+    io_context* _context;
+    uint32_t _maxFlowsPerClient;
+    uint32_t _maxFlows;
+    std::mt19937 _random;
+    std::unordered_map<FlowKey, std::shared_ptr<Flow>, FlowKeyHash> _flows;
+    // flows per client id
+    std::unordered_map<uint16_t, uint32_t> _clientFlows;
+    std::array<uint8_t, 1600> _packet;
+    uint16_t _ipId = 0;
+    Stats _stats = {};
+
+    // a - b > 0 in sequence space
+    static bool _after(uint32_t a, uint32_t b) {
+      return (int32_t)(a - b) > 0;
+    }
+
+    void _open(const FlowKey& key, const Segment& segment) {
+      auto counted = _clientFlows.find(key.clientId);
+      uint32_t clientFlows = counted == _clientFlows.end() ? 0 : counted->second;
+      if (clientFlows >= _maxFlowsPerClient || _flows.size() >= _maxFlows) {
+        _stats.refusedFlows++;
+        return _resetUnknown(key, segment);
+      }
+
+      auto flow = std::make_shared<Flow>(*_context);
+      flow->key = key;
+      flow->receiveNext = segment.sequence + 1;
+      flow->clientWindow = segment.window;
+      flow->initialSequence = _random();
+      _parseOptions(flow.get(), segment);
+      _flows[key] = flow;
+      _clientFlows[key.clientId]++;
+      _stats.flows++;
+
+      boost::asio::ip::tcp::endpoint to(address_v4(key.destIP), key.destPort);
+      flow->socket.async_connect(to, [this, flow](const error_code& err) {
+        if (flow->state == Flow::CLOSED) {
+          return;
+        }
+        if (err) {
+          return _close(flow, true);
+        }
+        flow->state = Flow::SYN_RECEIVED;
+        flow->sendUnacked = flow->initialSequence;
+        flow->sendNext = flow->initialSequence + 1;
+        flow->retries = 0;
+        _cancelTimer(flow);
+        _sendSynAck(flow);
+        _armTimer(flow);
+      });
+      // bounds the connect, the kernel alone would try for minutes
+      _armTimer(flow);
+    }
+
+    void _parseOptions(Flow* flow, const Segment& segment) {
+      auto options = segment.options;
+      for (uint32_t i = 0; i < segment.optionsLen;) {
+        uint8_t kind = options[i];
+        if (kind == 0) break;
+        if (kind == 1) {
+          i++;
+          continue;
+        }
+        if (i + 1 >= segment.optionsLen || options[i + 1] < 2) break;
+        uint8_t len = options[i + 1];
+        if (i + len > segment.optionsLen) break;
+
+        if (kind == 2 && len == 4) {
+          uint16_t mss = (options[i + 2] << 8) | options[i + 3];
+          flow->mss = std::max<uint16_t>(std::min<uint16_t>(mss, uint16_t(MAX_MSS)), 64);
+        } else if (kind == 3 && len == 3) {
+          flow->windowScaling = true;
+          flow->windowScale = std::min<uint8_t>(options[i + 2], 14);
+        }
+        i += len;
+      }
+    }
+
+    void _onAck(const std::shared_ptr<Flow>& flow, const Segment& segment) {
+      uint32_t ack = segment.acknowledgment;
+
+      if (flow->state == Flow::SYN_RECEIVED) {
+        if (ack != flow->initialSequence + 1) {
+          return;
+        }
+        flow->state = Flow::ESTABLISHED;
+        flow->sendUnacked = flow->sendNext = ack;
+        flow->retries = 0;
+        _cancelTimer(flow);
+        flow->readBuffer.resize(READ_CHUNK);
+        _read(flow);
+      }
+
+      // the window of a SYN is never scaled, later ones are when both sides agreed
+      flow->clientWindow = (uint32_t)segment.window << flow->windowScale;
+
+      if (_after(ack, flow->sendUnacked) && !_after(ack, flow->sendNext)) {
+        uint32_t acked = ack - flow->sendUnacked;
+        flow->sendHead += std::min(acked, flow->sendBuffered());
+        flow->sendUnacked = ack;
+        flow->retries = 0;
+        _cancelTimer(flow);
+
+        if (flow->sendBuffered() == 0 || flow->sendHead > SEND_BUFFER / 2) {
+          flow->sendBuffer.erase(0, flow->sendHead);
+          flow->sendHead = 0;
+        }
+      }
+
+      if (_finished(flow)) {
+        return _close(flow);
+      }
+      _read(flow);
+      _pump(flow, false);
+    }
+
+    void _onData(const std::shared_ptr<Flow>& flow, const Segment& segment) {
+      bool fin = segment.flags & FIN;
+      uint32_t sequence = segment.sequence;
+      uint8_t* payload = segment.payload;
+      uint32_t len = segment.payloadLen;
+      if (len == 0 && !fin) {
+        return;
+      }
+
+      // trim what was received before, anything out of order is dropped
+      if (sequence != flow->receiveNext) {
+        uint32_t skip = flow->receiveNext - sequence;
+        if (!_after(flow->receiveNext, sequence) || skip > len || (skip == len && !fin)) {
+          return _sendFlags(flow, ACK);
+        }
+        payload += skip;
+        len -= skip;
+      }
+      if (flow->clientFin) {
+        return _sendFlags(flow, ACK);
+      }
+
+      uint32_t accepted = std::min<uint32_t>(len, _receiveWindow(flow.get()));
+      flow->pendingWrite.append((char*)payload, accepted);
+      flow->receiveNext += accepted;
+      _stats.upstreamBytes += accepted;
+      if (fin && accepted == len) {
+        flow->receiveNext++;
+        flow->clientFin = true;
+      }
+
+      _write(flow);
+      _sendFlags(flow, ACK);
+      if (_finished(flow)) {
+        _close(flow);
+      }
+    }
+
+    uint16_t _receiveWindow(const Flow* flow) const {
+      uint32_t queued = flow->pendingWrite.size() + flow->writing.size();
+      return queued >= RECEIVE_WINDOW ? 0 : RECEIVE_WINDOW - queued;
+    }
+
+    bool _finished(const std::shared_ptr<Flow>& flow) const {
+      return flow->clientFin && flow->upstreamShutdown && flow->finAcked();
+    }
+
+    // client -> upstream, one write in flight, everything queued meanwhile goes in the next
+    void _write(const std::shared_ptr<Flow>& flow) {
+      if (!flow->writing.empty() || flow->state == Flow::CLOSED) {
+        return;
+      }
+      if (flow->pendingWrite.empty()) {
+        if (flow->clientFin && !flow->upstreamShutdown) {
+          error_code ignored;
+          flow->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+          flow->upstreamShutdown = true;
+        }
+        return;
+      }
+
+      flow->writing.swap(flow->pendingWrite);
+      boost::asio::async_write(flow->socket, boost::asio::buffer(flow->writing), recycled([this, flow](const error_code& err, size_t) {
+        if (flow->state == Flow::CLOSED) {
+          return;
+        }
+        if (err) {
+          return _close(flow, true);
+        }
+        flow->writing.clear();
+
+        // the window opened up again, tell the client instead of waiting for its probe
+        if (flow->advertisedWindow < RECEIVE_WINDOW / 2) {
+          _sendFlags(flow, ACK);
+        }
+        _write(flow);
+        if (_finished(flow)) {
+          _close(flow);
+        }
+      }));
+    }
+
+    // upstream -> client, stops reading while the send buffer is full
+    void _read(const std::shared_ptr<Flow>& flow) {
+      if (
+        flow->reading || flow->upstreamEof || flow->state != Flow::ESTABLISHED ||
+        flow->sendBuffered() >= SEND_BUFFER
+      ) {
+        return;
+      }
+
+      flow->reading = true;
+      uint32_t len = std::min<uint32_t>(uint32_t(READ_CHUNK), SEND_BUFFER - flow->sendBuffered());
+      flow->socket.async_read_some(boost::asio::buffer(flow->readBuffer.data(), len), recycled([this, flow](const error_code& err, size_t len) {
+        flow->reading = false;
+        if (flow->state == Flow::CLOSED) {
+          return;
+        }
+        if (err == boost::asio::error::eof) {
+          flow->upstreamEof = true;
+        } else if (err) {
+          return _close(flow, true);
+        } else {
+          flow->sendBuffer.append((char*)flow->readBuffer.data(), len);
+          _stats.downstreamBytes += len;
+        }
+
+        _pump(flow, false);
+        _read(flow);
+      }));
+    }
+
+    // sends whatever the client window allows from sendNext on, then the FIN.
+    // `probe` pushes 1 byte into a zero window
+    void _pump(const std::shared_ptr<Flow>& flow, bool probe) {
+      if (flow->state != Flow::ESTABLISHED) {
+        return;
+      }
+
+      uint32_t dataEnd = flow->dataEnd();
+      uint32_t window = flow->clientWindow == 0 && probe ? 1 : flow->clientWindow;
+
+      while (_after(dataEnd, flow->sendNext)) {
+        uint32_t inFlight = flow->sendNext - flow->sendUnacked;
+        if (inFlight >= window) {
+          break;
+        }
+        uint32_t len = std::min<uint32_t>({ (uint32_t)flow->mss, dataEnd - flow->sendNext, window - inFlight });
+        uint8_t* data = (uint8_t*)&flow->sendBuffer[flow->sendHead + inFlight];
+        bool last = flow->sendNext + len == dataEnd;
+
+        _send(flow, ACK | (last ? PSH : 0), flow->sendNext, data, len);
+        flow->sendNext += len;
+      }
+
+      if (flow->upstreamEof && flow->sendNext == dataEnd && !flow->finAcked()) {
+        _send(flow, FIN | ACK, dataEnd, nullptr, 0);
+        flow->finSent = true;
+        flow->finSequence = dataEnd;
+        flow->sendNext = dataEnd + 1;
+      }
+
+      if (flow->sendNext != flow->sendUnacked || (flow->clientWindow == 0 && flow->sendBuffered() > 0)) {
+        _armTimer(flow);
+      }
+    }
+
+    void _armTimer(const std::shared_ptr<Flow>& flow) {
+      if (flow->timerArmed) {
+        return;
+      }
+      flow->timerArmed = true;
+      flow->timer.expires_after(std::chrono::milliseconds(RETRANSMIT_MS << std::min<uint32_t>(flow->retries, 6)));
+      flow->timer.async_wait(recycled([this, flow](const error_code& err) {
+        if (err || flow->state == Flow::CLOSED) {
+          return;
+        }
+        flow->timerArmed = false;
+
+        if (++flow->retries > MAX_RETRIES) {
+          return _close(flow, true);
+        }
+        if (flow->state == Flow::CONNECTING) {
+          return _armTimer(flow);
+        }
+        _stats.retransmits++;
+
+        if (flow->state == Flow::SYN_RECEIVED) {
+          _sendSynAck(flow);
+          return _armTimer(flow);
+        }
+        flow->sendNext = flow->sendUnacked;
+        _pump(flow, true);
+      }));
+    }
+
+    void _cancelTimer(const std::shared_ptr<Flow>& flow) {
+      if (flow->timerArmed) {
+        flow->timer.cancel();
+        flow->timerArmed = false;
+      }
+    }
+
+    // `reset` tells the client with a RST
+    void _close(const std::shared_ptr<Flow>& flow, bool reset = false) {
+      if (flow->state == Flow::CLOSED) {
+        return;
+      }
+      if (reset) {
+        _send(flow, RST | ACK, flow->sendNext, nullptr, 0);
+        _stats.resets++;
+      }
+
+      flow->state = Flow::CLOSED;
+      error_code ignored;
+      flow->socket.close(ignored);
+      flow->timer.cancel();
+      _flows.erase(flow->key);
+      auto clientFlows = _clientFlows.find(flow->key.clientId);
+      if (clientFlows != _clientFlows.end() && --clientFlows->second == 0) {
+        _clientFlows.erase(clientFlows);
+      }
+    }
+
+    void _sendSynAck(const std::shared_ptr<Flow>& flow) {
+      _send(flow, SYN | ACK, flow->initialSequence, nullptr, 0);
+    }
+
+    void _sendFlags(const std::shared_ptr<Flow>& flow, uint8_t flags) {
+      _send(flow, flags, flow->sendNext, nullptr, 0);
+    }
+
+    void _send(const std::shared_ptr<Flow>& flow, uint8_t flags, uint32_t sequence, const uint8_t* payload, uint32_t len) {
+      // a SYN-ACK carries our MSS and, when the client offered it, a window scale of 0:
+      // the client's windows are then scaled, ours stay within 16 bits
+      uint8_t options[8] = { 2, 4, (uint8_t)(MAX_MSS >> 8), (uint8_t)(MAX_MSS & 0xff), 1, 3, 3, 0 };
+      uint32_t optionsLen = (flags & SYN) ? (flow->windowScaling ? 8 : 4) : 0;
+
+      if (flow->state != Flow::CLOSED) {
+        flow->advertisedWindow = _receiveWindow(flow.get());
+      }
+      _emit(flow->key, flags, sequence, flow->receiveNext, flow->advertisedWindow, options, optionsLen, payload, len);
+    }
+
+    // answers a segment of no known flow, see RFC 793 "reset generation"
+    void _resetUnknown(const FlowKey& key, const Segment& segment) {
+      _stats.resets++;
+      if (segment.flags & ACK) {
+        return _emit(key, RST, segment.acknowledgment, 0, 0, nullptr, 0, nullptr, 0);
+      }
+      uint32_t ack = segment.sequence + segment.payloadLen + ((segment.flags & FIN) ? 1 : 0);
+      _emit(key, RST | ACK, 0, ack, 0, nullptr, 0, nullptr, 0);
+    }
+
+    void _emit(
+      const FlowKey& key, uint8_t flags, uint32_t sequence, uint32_t ack, uint16_t window,
+      const uint8_t* options, uint32_t optionsLen, const uint8_t* payload, uint32_t len
+    ) {
+      uint32_t headerLen = 20 + optionsLen;
+      uint32_t size = 20 + headerLen + len;
+      if (!onPacket || size > _packet.size()) {
+        return;
+      }
+
+      uint8_t* data = _packet.data();
+      memset(data, 0, 20 + headerLen);
+      data[0] = 0x45;
+      data[6] = 0x40;   // don't fragment
+      data[8] = 64;     // ttl
+      data[9] = protocol::Ip4::Protocol::TCP;
+
+      protocol::Ip4 ip(data, size);
+      ip.totalLen(size);
+      ip.id(_ipId++);
+      ip.sourceIP(address_v4(key.destIP));
+      ip.destIP(address_v4(key.clientIP));
+
+      protocol::Tcp tcp(ip);
+      tcp.sourcePort(key.destPort);
+      tcp.destPort(key.clientPort);
+      tcp.sequence(sequence);
+      tcp.acknowledgment(ack);
+      tcp.headerLen(headerLen / 4);
+      tcp.flags(flags);
+      tcp.window(window);
+      if (optionsLen > 0) {
+        memcpy(data + 40, options, optionsLen);
+      }
+      if (len > 0) {
+        memcpy(data + 20 + headerLen, payload, len);
+      }
+
+      tcp.calculateChecksumInplace();
+      ip.calculateChecksumInplace();
+      onPacket(key.clientId, data, size);
+    }
+
+  };
+
+} // namespace libtun
+
+#endif
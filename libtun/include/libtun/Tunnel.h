@@ -3,36 +3,88 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <fmt/core.h>
+#include <boost/asio/ip/address_v4.hpp>
 #include "./logger.h"
 #include "./BufferPool.h"
 
 #ifdef __APPLE__
   #include "./impl/Tunnel/Tunnel_darwin.h"
+#elif defined(__linux__)
+  #include "./impl/Tunnel/Tunnel_linux.h"
 #endif
 
 namespace libtun {
 
   class Tunnel {
   public:
-    bool open() {
+    // offload (linux): TCP superpackets and deferred checksums, see TunnelImpl
+    bool open(uint16_t queueCount = 1, bool offload = false) {
       try {
-        _impl.openTunnel();
+        _impl.openTunnel(queueCount, offload);
       } catch (const std::exception& err) {
         LOG_FATAL << err.what();
         _impl.close();
         return false;
       }
-      LOG_INFO << fmt::format("tunnel [{}] is opened.", _impl.ifName);
+      LOG_INFO << fmt::format(
+        "tunnel [{}] is opened with {} queue(s){}.",
+        _impl.ifName, _impl.queueCount(), offload ? " and offloads" : ""
+      );
       return true;
     }
 
-    Buffer read(const Buffer& buf) {
-      return _impl.read(buf);
+    void close() {
+      _impl.close();
     }
 
-    int write(const Buffer& buf) {
-      return _impl.write(buf);
+    // linux only, assigns the device address and brings it up
+    bool setAddress(const boost::asio::ip::address_v4& address, uint8_t prefixLen) {
+      try {
+        _impl.setAddress(address.to_uint(), prefixLen);
+      } catch (const std::exception& err) {
+        LOG_FATAL << err.what();
+        return false;
+      }
+      LOG_INFO << fmt::format("tunnel [{}] address is {}/{}.", _impl.ifName, address.to_string(), prefixLen);
+      return true;
+    }
+
+    const std::string& ifName() const {
+      return _impl.ifName;
+    }
+
+    // fds of all queues, each one can be polled by its own thread
+    const std::vector<int>& fds() const {
+      return _impl.fds;
+    }
+
+    uint16_t queueCount() const {
+      return _impl.queueCount();
+    }
+
+    bool offload() const {
+      return _impl.offload;
+    }
+
+    Buffer read(const Buffer& buf, uint16_t queue = 0, protocol::Offload* offloads = nullptr) {
+      return _impl.read(buf, queue, offloads);
+    }
+
+    int write(const Buffer& buf, uint16_t queue = 0) {
+      return _impl.write(buf, queue);
+    }
+
+    uint32_t readBatch(
+      Buffer* bufs, uint32_t count, uint16_t queue = 0,
+      protocol::Offload* offloads = nullptr, bool wait = true
+    ) {
+      return _impl.readBatch(bufs, count, queue, offloads, wait);
+    }
+
+    uint32_t writeBatch(const Buffer* bufs, uint32_t count, uint16_t queue = 0) {
+      return _impl.writeBatch(bufs, count, queue);
     }
 
   private:
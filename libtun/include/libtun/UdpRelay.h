@@ -0,0 +1,321 @@
+#ifndef LIBTUN_UDP_RELAY_INCLUDED
+#define LIBTUN_UDP_RELAY_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/container_hash/hash.hpp>
+#include <fmt/core.h>
+#include "./logger.h"
+#include "./BufferPool.h"
+#include "./BatchedUdpSocket.h"
+#include "./FunctionRef.h"
+#include "./HandlerAllocator.h"
+#include "./protocol/ip4.h"
+#include "./protocol/udp.h"
+
+namespace libtun {
+
+  using boost::asio::io_context;
+  using boost::asio::steady_timer;
+  using boost::asio::ip::udp;
+  using boost::asio::ip::address_v4;
+  using boost::system::error_code;
+
+  /* UDP RELAY
+  ---------------------------------------------------------------------------
+  | client | tunnel | relay: flow -> connected UDP socket | destination     |
+  ---------------------------------------------------------------------------
+  every inner UDP flow gets its own socket connect()ed to the destination,
+  the kernel picks the source port and owns the checksums on the way out.
+  replies are received in recvmmsg batches (BatchedUdpSocket) into buffers
+  with IP4 + UDP header room in front, the header toward the client is then
+  written in place. the buffers are taken per readiness event, an idle flow
+  holds a socket and nothing else. flows are dropped after `idleTimeout`
+  without traffic, a client opens at most `maxFlowsPerClient` of them and the
+  relay `maxFlows` in all, datagrams of flows beyond are dropped.
+  `onPacket` gets every IP4 packet toward the client, valid during the call,
+  it refers to a member of the owner, e.g.
+  `PacketHandler::bind<Server, &Server::toClient>(this)`.
+  NOT THREAD SAFE, everything runs on the io_context.
+  */
+
+  class UdpRelay {
+  public:
+    static const uint32_t HEADER_ROOM = 28;
+    static const uint32_t RECEIVE_BATCH = 8;
+
+    struct Stats {
+      uint64_t flows;
+      uint64_t expired;
+      // over the caps
+      uint64_t refusedFlows;
+      // no socket or no buffers for the batch
+      uint64_t openFailures;
+      uint64_t sentDatagrams;
+      uint64_t sendDrops;
+      uint64_t receivedDatagrams;
+    };
+
+    // FUNCTION: (clientId, packet, size) => void
+    typedef FunctionRef<void(uint16_t, uint8_t*, uint32_t)> PacketHandler;
+    PacketHandler onPacket;
+
+    UdpRelay(
+      io_context* context,
+      BufferPool<1600>* pool,
+      std::chrono::seconds idleTimeout = std::chrono::seconds(60),
+      uint32_t maxFlowsPerClient = 256,
+      uint32_t maxFlows = 16384
+    ):
+      _context(context),
+      _bufferPool(pool),
+      _idleTimeout(idleTimeout),
+      _maxFlowsPerClient(maxFlowsPerClient),
+      _maxFlows(maxFlows),
+      _sweepTimer(*context) {}
+
+    UdpRelay(const UdpRelay&) = delete;
+
+    // a decrypted IP4/UDP packet from the client
+    void input(uint16_t clientId, uint8_t* data, uint32_t size) {
+      protocol::Ip4 ip(data, size);
+      if (size < 28 || ip.version() != 4 || ip.protocol() != protocol::Ip4::Protocol::UDP) {
+        return;
+      }
+      uint32_t ipHeaderLen = ip.headerLen() * 4;
+      if (ip.totalLen() > size || ipHeaderLen + 8 > ip.totalLen() || ip.offset() != 0 || (ip.flag() & protocol::Ip4::MORE_FRAGMENT)) {
+        return;
+      }
+
+      protocol::Udp udp(ip);
+      FlowKey key = {
+        .clientId = clientId,
+        .clientIP = ip.sourceIP().to_uint(),
+        .clientPort = udp.sourcePort(),
+        .destIP = ip.destIP().to_uint(),
+        .destPort = udp.destPort(),
+      };
+
+      auto it = _flows.find(key);
+      Flow* flow = it == _flows.end() ? _open(key) : it->second.get();
+      if (!flow) {
+        return;
+      }
+
+      flow->lastActive = std::chrono::steady_clock::now();
+      error_code err;
+      flow->socket.send(boost::asio::buffer(data + ipHeaderLen + 8, ip.totalLen() - ipHeaderLen - 8), 0, err);
+      if (err) {
+        _stats.sendDrops++;
+      } else {
+        _stats.sentDatagrams++;
+      }
+    }
+
+    // drops every flow of a client, e.g. when its session ends
+    void removeClient(uint16_t clientId) {
+      for (auto it = _flows.begin(); it != _flows.end();) {
+        if (it->first.clientId == clientId) {
+          it = _erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    size_t flowCount() const {
+      return _flows.size();
+    }
+
+    const Stats& stats() const {
+      return _stats;
+    }
+
+  private:
+    struct FlowKey {
+      uint16_t clientId;
+      uint32_t clientIP;
+      uint16_t clientPort;
+      uint32_t destIP;
+      uint16_t destPort;
+      bool operator == (const FlowKey& k) const {
+        return clientId == k.clientId && clientIP == k.clientIP && clientPort == k.clientPort &&
+          destIP == k.destIP && destPort == k.destPort;
+      }
+    };
+    struct FlowKeyHash {
+      size_t operator() (const FlowKey& k) const {
+        size_t seed = 0;
+        boost::hash_combine(seed, k.clientId);
+        boost::hash_combine(seed, k.clientIP);
+        boost::hash_combine(seed, k.clientPort);
+        boost::hash_combine(seed, k.destIP);
+        boost::hash_combine(seed, k.destPort);
+        return seed;
+      }
+    };
+
+    // the batched socket goes before the socket it waits on
+    struct Flow {
+      UdpRelay* relay;
+      FlowKey key;
+      udp::socket socket;
+      std::unique_ptr<BatchedUdpSocket> batch;
+      std::chrono::steady_clock::time_point lastActive;
+
+      Flow(UdpRelay* relay, io_context& context): relay(relay), socket(context) {}
+
+      void onReceive(const udp::endpoint&, Buffer buf) {
+        relay->_onReceive(this, buf);
+      }
+    };
+
+    io_context* _context;
+    BufferPool<1600>* _bufferPool;
+    std::chrono::seconds _idleTimeout;
+    uint32_t _maxFlowsPerClient;
+    uint32_t _maxFlows;
+    steady_timer _sweepTimer;
+    bool _sweeping = false;
+    std::unordered_map<FlowKey, std::shared_ptr<Flow>, FlowKeyHash> _flows;
+    std::unordered_map<uint16_t, uint32_t> _clientFlows;
+    std::vector<std::shared_ptr<Flow>> _released;
+    uint16_t _ipId = 0;
+    Stats _stats = {};
+
+    Flow* _open(const FlowKey& key) {
+      auto counted = _clientFlows.find(key.clientId);
+      uint32_t clientFlows = counted == _clientFlows.end() ? 0 : counted->second;
+      if (clientFlows >= _maxFlowsPerClient || _flows.size() >= _maxFlows) {
+        _stats.refusedFlows++;
+        return nullptr;
+      }
+
+      auto flow = std::make_shared<Flow>(this, *_context);
+      flow->key = key;
+
+      error_code err;
+      flow->socket.open(udp::v4(), err);
+      if (!err) flow->socket.non_blocking(true, err);
+      if (!err) flow->socket.connect(udp::endpoint(address_v4(key.destIP), key.destPort), err);
+      if (err) {
+        LOG_DEBUG << fmt::format("udp relay can not reach {}:{}: {}", address_v4(key.destIP).to_string(), key.destPort, err.message());
+        _stats.openFailures++;
+        return nullptr;
+      }
+
+      auto raw = flow.get();
+      try {
+        flow->batch.reset(new BatchedUdpSocket(&flow->socket, _bufferPool, RECEIVE_BATCH, HEADER_ROOM));
+        flow->batch->receiveOnDemand();
+        flow->batch->startReceive(BatchedUdpSocket::ReceiveHandler::bind<Flow, &Flow::onReceive>(raw));
+      } catch (std::bad_alloc&) {
+        _stats.openFailures++;
+        return nullptr;
+      }
+
+      _flows[key] = flow;
+      _clientFlows[key.clientId]++;
+      _stats.flows++;
+      _sweep();
+      return raw;
+    }
+
+    // the reply is framed in the room in front of it
+    void _onReceive(Flow* flow, Buffer buf) {
+      if (!onPacket || buf.prefixSpace() < HEADER_ROOM || buf.size() > 0xffff - HEADER_ROOM) {
+        return;
+      }
+      flow->lastActive = std::chrono::steady_clock::now();
+      _stats.receivedDatagrams++;
+
+      buf.moveFrontBoundary(-(int)HEADER_ROOM);
+      uint8_t* data = buf.data();
+      memset(data, 0, HEADER_ROOM);
+      data[0] = 0x45;
+      data[8] = 64;   // ttl
+      data[9] = protocol::Ip4::Protocol::UDP;
+
+      protocol::Ip4 ip(data, buf.size());
+      ip.totalLen(buf.size());
+      ip.id(_ipId++);
+      ip.sourceIP(address_v4(flow->key.destIP));
+      ip.destIP(address_v4(flow->key.clientIP));
+      ip.calculateChecksumInplace();
+
+      protocol::Udp udp(ip);
+      udp.sourcePort(flow->key.destPort);
+      udp.destPort(flow->key.clientPort);
+      udp.totalLen(buf.size() - 20);
+      udp.calculateChecksumInplace();
+
+      onPacket(flow->key.clientId, data, buf.size());
+    }
+
+    typedef std::unordered_map<FlowKey, std::shared_ptr<Flow>, FlowKeyHash>::iterator FlowIterator;
+
+    FlowIterator _erase(FlowIterator it) {
+      auto clientFlows = _clientFlows.find(it->first.clientId);
+      if (clientFlows != _clientFlows.end() && --clientFlows->second == 0) {
+        _clientFlows.erase(clientFlows);
+      }
+      _release(it->second);
+      return _flows.erase(it);
+    }
+
+    // a readiness event of the flow may already be queued behind the current
+    // handler, the flow lives on until it ran, its wait is cancelled meanwhile
+    void _release(const std::shared_ptr<Flow>& flow) {
+      error_code ignored;
+      flow->socket.cancel(ignored);
+      _released.push_back(flow);
+
+      Flow* raw = flow.get();
+      boost::asio::post(*_context, recycled([this, raw]() {
+        for (auto it = _released.begin(); it != _released.end(); ++it) {
+          if (it->get() == raw) {
+            _released.erase(it);
+            return;
+          }
+        }
+      }));
+    }
+
+    // one timer for all flows, it stops when there is none left
+    void _sweep() {
+      if (_sweeping) {
+        return;
+      }
+      _sweeping = true;
+      _sweepTimer.expires_after(std::max<std::chrono::seconds>(_idleTimeout / 4, std::chrono::seconds(1)));
+      _sweepTimer.async_wait(recycled([this](const error_code& err) {
+        _sweeping = false;
+        if (err) {
+          return;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() - _idleTimeout;
+        for (auto it = _flows.begin(); it != _flows.end();) {
+          if (it->second->lastActive < deadline) {
+            it = _erase(it);
+            _stats.expired++;
+          } else {
+            ++it;
+          }
+        }
+        if (!_flows.empty()) {
+          _sweep();
+        }
+      }));
+    }
+
+  };
+
+} // namespace libtun
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef LIBTUN_IMPL_BUFFER_POOL_CHUNK_MEMORY_INCLUDED
+#define LIBTUN_IMPL_BUFFER_POOL_CHUNK_MEMORY_INCLUDED
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <linux/mempolicy.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#include <chrono>
+#include <fmt/core.h>
+#include "../../logger.h"
+#include "../../Exception.h"
+#include "../../MemoryAccounting.h"
+
+namespace libtun {
+
+  // how a BufferPool gets its chunks, the defaults are plain page aligned heap memory
+  struct BufferPoolOptions {
+    uint32_t buffersPerChunk = 32;
+    // chunks allocated up front by the constructor
+    uint32_t initialChunks = 0;
+    // mmap'ed with MAP_HUGETLB, transparent huge pages when none are reserved.
+    // buffersPerChunk is raised to fill whole huge pages
+    bool hugePages = false;
+    // binds the chunks to a NUMA node (linux), -1 lets the kernel place them
+    int numaNode = -1;
+    // faults every page in when the chunk is allocated
+    bool prefault = false;
+    // keeps the chunks in RAM, needs RLIMIT_MEMLOCK or CAP_IPC_LOCK
+    bool lock = false;
+    // hard limit, 0 is unbounded. the pool does not grow past it (whole chunks,
+    // at least one), allocations beyond fail and are counted
+    uint32_t maxBuffers = 0;
+    // soft limit, the pool is `pressured()` with this many buffers in use and
+    // producers are expected to back off, 0 is never
+    uint32_t softBuffers = 0;
+    // `trim()` releases idle chunks after this long, 0 keeps all of them.
+    // not for pools whose chunks are registered with the kernel (io_uring
+    // fixed buffers, AF_XDP UMEM)
+    std::chrono::milliseconds releaseIdle{0};
+
+    bool mapped() const {
+      return hugePages || numaNode >= 0 || prefault || lock;
+    }
+  };
+
+namespace impl {
+
+  /* CHUNK MEMORY
+  plain chunks come from posix_memalign. mapped chunks are placed with mbind
+  before the first touch, so prefaulting them (or the mlock) already lands
+  on the right node. huge page chunks are 2MB aligned so THP can back them
+  when MAP_HUGETLB finds no reserved pages.
+  */
+
+  class ChunkMemory {
+  public:
+    static const size_t ALIGNMENT = 4096;
+    static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+    // the chunk length a pool ends up with
+    static size_t chunkLength(size_t length, const BufferPoolOptions& options) {
+      if (options.hugePages) {
+        return (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      }
+      return length;
+    }
+
+    static uint8_t* allocate(size_t length, const BufferPoolOptions& options) {
+      if (!options.mapped()) {
+        void* memory;
+        if (posix_memalign(&memory, ALIGNMENT, length) != 0) {
+          throw std::bad_alloc();
+        }
+        MemoryAccounting::account(MemoryAccounting::BUFFERS).allocated(length);
+        return (uint8_t*)memory;
+      }
+
+      auto memory = options.hugePages ? _mapHuge(length) : _map(length);
+      try {
+        _bind(memory, length, options.numaNode);
+        if (options.lock && mlock(memory, length) == -1) {
+          throw Exception(fmt::format("buffer pool mlock of {} bytes failed: {}", length, strerror(errno)));
+        }
+        if (options.prefault) {
+          _prefault(memory, length);
+        }
+      } catch (...) {
+        munmap(memory, length);
+        throw;
+      }
+      MemoryAccounting::account(MemoryAccounting::BUFFERS).allocated(length);
+      return memory;
+    }
+
+    static void release(uint8_t* memory, size_t length, const BufferPoolOptions& options) {
+      MemoryAccounting::account(MemoryAccounting::BUFFERS).released(length);
+      if (options.mapped()) {
+        munmap(memory, length);
+      } else {
+        ::free(memory);
+      }
+    }
+
+  private:
+    static uint8_t* _map(size_t length) {
+      auto memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      return (uint8_t*)memory;
+    }
+
+    static uint8_t* _mapHuge(size_t length) {
+#ifdef MAP_HUGETLB
+      auto memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (memory != MAP_FAILED) {
+        return (uint8_t*)memory;
+      }
+      LOG_DEBUG << fmt::format("buffer pool has no reserved huge pages ({}), falls back to THP", strerror(errno));
+#endif
+      // over map and trim to a huge page boundary
+      auto mapped = _map(length + HUGE_PAGE_SIZE);
+      auto aligned = (uint8_t*)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+      if (aligned > mapped) {
+        munmap(mapped, aligned - mapped);
+      }
+      munmap(aligned + length, mapped + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+      madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+      return aligned;
+    }
+
+    static void _bind(uint8_t* memory, size_t length, int node) {
+      if (node < 0) {
+        return;
+      }
+#ifdef __linux__
+      const size_t bits = sizeof(unsigned long) * 8;
+      std::vector<unsigned long> mask(node / bits + 1, 0);
+      mask[node / bits] = 1UL << (node % bits);
+      if (syscall(SYS_mbind, memory, length, MPOL_BIND, mask.data(), mask.size() * bits + 1, 0) == -1) {
+        throw Exception(fmt::format("buffer pool can not bind to NUMA node {}: {}", node, strerror(errno)));
+      }
+#else
+      throw Exception("buffer pool NUMA binding is only supported on linux");
+#endif
+    }
+
+    static void _prefault(uint8_t* memory, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+      if (madvise(memory, length, MADV_POPULATE_WRITE) == 0) {
+        return;
+      }
+#endif
+      size_t page = sysconf(_SC_PAGESIZE);
+      for (size_t offset = 0; offset < length; offset += page) {
+        ((volatile uint8_t*)memory)[offset] = 0;
+      }
+    }
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
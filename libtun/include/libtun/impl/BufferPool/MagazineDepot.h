@@ -0,0 +1,535 @@
+#ifndef LIBTUN_IMPL_BUFFER_POOL_MAGAZINE_DEPOT_INCLUDED
+#define LIBTUN_IMPL_BUFFER_POOL_MAGAZINE_DEPOT_INCLUDED
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+#include <initializer_list>
+#include <unordered_set>
+#include "./ChunkMemory.h"
+
+namespace libtun {
+namespace impl {
+
+  /* MAGAZINE DEPOT
+  ---------------------------------------------------------------------------
+  | thread: loaded + previous magazine | <- whole magazines -> | depot     |
+  ---------------------------------------------------------------------------
+  a magazine is a stack of up to MAGAZINE_SIZE free buffers. every thread
+  keeps two of them per depot and allocates / frees from them without any
+  shared write. only an empty (alloc) or full (free) pair goes to the depot,
+  which is two lock free stacks of magazines: non empty ones and empty ones.
+  the mutex is left for growing (chunks, magazines) and thread attach.
+
+  magazines live in a segmented table and are never freed before the depot,
+  the stacks link them by index so the head fits a 32 bit ABA tag next to it.
+  every thread cache counts its own consumed buffers, the counts are summed
+  on read. a thread that exits gives its magazines back to the depot and
+  leaves its cache to the next thread that attaches.
+  */
+
+  class MagazineDepot;
+
+  struct Magazine {
+    std::atomic<uint32_t> next;
+    uint32_t count = 0;
+    uint8_t* buffers[32];
+  };
+
+  struct ThreadCache {
+    uint32_t loaded;
+    uint32_t previous;
+    // written by the owning thread only
+    std::atomic<int64_t> consumed{0};
+    std::atomic<bool> owned{true};
+    ThreadCache* next = nullptr;
+  };
+
+  // the caches of the current thread, handed back when it exits
+  struct LocalCaches {
+    struct Entry {
+      uint64_t depotId;
+      MagazineDepot* depot;
+      ThreadCache* cache;
+    };
+
+    uint64_t lastId = 0;
+    ThreadCache* last = nullptr;
+    std::vector<Entry> entries;
+
+    ~LocalCaches();
+  };
+
+  inline LocalCaches& localCaches() {
+    static thread_local LocalCaches caches;
+    return caches;
+  }
+
+  // ids of the living depots, a thread exit only touches those
+  struct DepotRegistry {
+    std::mutex locker;
+    std::unordered_set<uint64_t> live;
+    uint64_t nextId = 1;
+  };
+
+  inline DepotRegistry& depotRegistry() {
+    static DepotRegistry registry;
+    return registry;
+  }
+
+  class MagazineDepot {
+  public:
+    static const uint32_t MAGAZINE_SIZE = sizeof(Magazine::buffers) / sizeof(uint8_t*);
+
+    struct Stats {
+      uint32_t chunks;
+      uint32_t buffers;
+      uint32_t consumed;
+      // allocations refused at the hard limit
+      uint64_t exhausted;
+      uint64_t releasedChunks;
+    };
+
+    MagazineDepot(uint32_t bufferSize, const BufferPoolOptions& options):
+      _bufferSize(bufferSize),
+      _options(options),
+      _chunkLength(ChunkMemory::chunkLength((size_t)bufferSize * options.buffersPerChunk, options)),
+      _buffersPerChunk(_chunkLength / bufferSize) {
+      auto& registry = depotRegistry();
+      std::lock_guard<std::mutex> guard(registry.locker);
+      _id = registry.nextId++;
+      registry.live.insert(_id);
+    }
+
+    MagazineDepot(const MagazineDepot&) = delete;
+
+    ~MagazineDepot() {
+      {
+        auto& registry = depotRegistry();
+        std::lock_guard<std::mutex> guard(registry.locker);
+        registry.live.erase(_id);
+      }
+      std::lock_guard<std::mutex> guard(_locker);
+      for (auto chunk : _chunks) {
+        ChunkMemory::release(chunk, _chunkLength, _options);
+      }
+      for (auto& segment : _segments) {
+        delete[] segment.load(std::memory_order_relaxed);
+      }
+      for (auto cache = _caches.load(std::memory_order_relaxed); cache;) {
+        auto next = cache->next;
+        delete cache;
+        cache = next;
+      }
+    }
+
+    // nullptr once the hard limit is reached and neither the thread nor the depot has a buffer
+    uint8_t* alloc() {
+      auto cache = _localCache();
+      auto loaded = &_at(cache->loaded);
+      if (loaded->count == 0) {
+        if (!_reload(cache)) {
+          return nullptr;
+        }
+        loaded = &_at(cache->loaded);
+      }
+      cache->consumed.store(cache->consumed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return loaded->buffers[--loaded->count];
+    }
+
+    void free(uint8_t* buffer) {
+      auto cache = _localCache();
+      auto loaded = &_at(cache->loaded);
+      if (loaded->count == MAGAZINE_SIZE) {
+        _unload(cache);
+        loaded = &_at(cache->loaded);
+      }
+      loaded->buffers[loaded->count++] = buffer;
+      cache->consumed.store(cache->consumed.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+    // hands the buffers cached by the calling thread to the depot
+    void flush() {
+      auto cache = _localCache();
+      std::lock_guard<std::mutex> guard(_locker);
+      _flush(cache);
+    }
+
+    // a snapshot, exact while no other thread allocates or frees
+    uint32_t consumedCount() const {
+      int64_t consumed = 0;
+      for (auto cache = _caches.load(std::memory_order_acquire); cache; cache = cache->next) {
+        consumed += cache->consumed.load(std::memory_order_relaxed);
+      }
+      int64_t all = allCount();
+      return consumed < 0 ? 0 : (consumed > all ? all : consumed);
+    }
+    uint32_t availableCount() const {
+      return allCount() - consumedCount();
+    }
+    uint32_t allCount() const {
+      return _chunkCount.load(std::memory_order_relaxed) * _buffersPerChunk;
+    }
+
+    bool pressured() const {
+      return _options.softBuffers > 0 && consumedCount() >= _options.softBuffers;
+    }
+
+    Stats stats() const {
+      uint32_t chunks = _chunkCount.load(std::memory_order_relaxed);
+      return {
+        chunks,
+        chunks * _buffersPerChunk,
+        consumedCount(),
+        _exhausted.load(std::memory_order_relaxed),
+        _released.load(std::memory_order_relaxed),
+      };
+    }
+
+    // stops at the hard limit
+    void reserve(uint32_t count) {
+      std::lock_guard<std::mutex> guard(_locker);
+      while (allCount() < count && _canGrow()) {
+        _allocChunk();
+      }
+    }
+
+    /* IDLE CHUNK RELEASE
+    called periodically, the use is sampled on every call and on every growth.
+    after `releaseIdle` the chunks the peak of that window did not need (one
+    spare, never below `initialChunks`) are released if all their buffers sit
+    in the depot, buffers cached by threads keep their chunk. returns how many
+    chunks were released.
+    */
+    uint32_t trim() {
+      if (_options.releaseIdle.count() <= 0) {
+        return 0;
+      }
+      auto now = std::chrono::steady_clock::now();
+      uint32_t consumed = consumedCount();
+
+      std::lock_guard<std::mutex> guard(_locker);
+      _windowPeak = std::max(_windowPeak, consumed);
+      if (_windowStart == std::chrono::steady_clock::time_point()) {
+        _windowStart = now;
+      }
+      if (now - _windowStart < _options.releaseIdle) {
+        return 0;
+      }
+
+      uint32_t keep = std::max(_options.initialChunks, (_windowPeak + _buffersPerChunk - 1) / _buffersPerChunk + 1);
+      _windowPeak = consumed;
+      _windowStart = now;
+      uint32_t chunks = _chunkCount.load(std::memory_order_relaxed);
+      return chunks > keep ? _releaseChunks(chunks - keep) : 0;
+    }
+
+    std::list<uint8_t*> chunks() {
+      std::lock_guard<std::mutex> guard(_locker);
+      return _chunks;
+    }
+    uint32_t chunkSize() const {
+      return _bufferSize * _buffersPerChunk;
+    }
+
+  private:
+    friend struct LocalCaches;
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    static const uint32_t NIL = 0xffffffff;
+    static const uint32_t FIRST_SEGMENT = 64;
+    static const uint32_t SEGMENTS = 24;
+
+    // a Treiber stack of magazine indices, the upper half of the head is a tag
+    struct Stack {
+      std::atomic<uint64_t> head{NIL};
+    };
+
+    uint64_t _id;
+    uint32_t _bufferSize;
+    BufferPoolOptions _options;
+    size_t _chunkLength;
+    uint32_t _buffersPerChunk;
+    std::atomic<uint32_t> _chunkCount{0};
+    std::atomic<uint64_t> _exhausted{0};
+    std::atomic<uint64_t> _released{0};
+    Stack _full;
+    Stack _empty;
+    std::atomic<ThreadCache*> _caches{nullptr};
+    std::atomic<Magazine*> _segments[SEGMENTS] = {};
+    // guards everything below
+    std::mutex _locker;
+    std::list<uint8_t*> _chunks;
+    uint32_t _magazineCount = 0;
+    uint32_t _windowPeak = 0;
+    TimePoint _windowStart;
+
+    // segment k holds FIRST_SEGMENT << k magazines
+    Magazine& _at(uint32_t index) {
+      uint32_t n = index + FIRST_SEGMENT;
+      uint32_t segment = 31 - __builtin_clz(n) - 6;
+      return _segments[segment].load(std::memory_order_acquire)[n - (FIRST_SEGMENT << segment)];
+    }
+
+    void _push(Stack& stack, uint32_t index) {
+      auto& magazine = _at(index);
+      uint64_t head = stack.head.load(std::memory_order_relaxed);
+      uint64_t next;
+      do {
+        magazine.next.store((uint32_t)head, std::memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | index;
+      } while (!stack.head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool _pop(Stack& stack, uint32_t& index) {
+      uint64_t head = stack.head.load(std::memory_order_acquire);
+      while ((uint32_t)head != NIL) {
+        uint64_t next = (((head >> 32) + 1) << 32) | _at((uint32_t)head).next.load(std::memory_order_relaxed);
+        if (stack.head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+          index = (uint32_t)head;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // with `_locker` held
+    uint32_t _newMagazine() {
+      uint32_t index = _magazineCount;
+      uint32_t n = index + FIRST_SEGMENT;
+      uint32_t segment = 31 - __builtin_clz(n) - 6;
+      if (segment >= SEGMENTS) {
+        throw std::bad_alloc();
+      }
+      if (!_segments[segment].load(std::memory_order_relaxed)) {
+        _segments[segment].store(new Magazine[FIRST_SEGMENT << segment], std::memory_order_release);
+      }
+      _magazineCount++;
+      return index;
+    }
+
+    // with `_locker` held
+    uint32_t _emptyMagazine() {
+      uint32_t index;
+      return _pop(_empty, index) ? index : _newMagazine();
+    }
+
+    // with `_locker` held, chunks are page aligned so they can be handed to
+    // the kernel as they are (AF_XDP UMEM)
+    void _allocChunk() {
+      _windowPeak = std::max(_windowPeak, allCount());
+      auto data = ChunkMemory::allocate(_chunkLength, _options);
+      _chunks.push_back(data);
+      for (uint32_t i = 0; i < _buffersPerChunk;) {
+        uint32_t index = _emptyMagazine();
+        auto& magazine = _at(index);
+        magazine.count = 0;
+        for (; i < _buffersPerChunk && magazine.count < MAGAZINE_SIZE; i++) {
+          magazine.buffers[magazine.count++] = data + i * _bufferSize;
+        }
+        _push(_full, index);
+      }
+      _chunkCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // with `_locker` held, the first chunk is always allowed
+    bool _canGrow() const {
+      uint32_t limit = std::max(_options.maxBuffers, _buffersPerChunk);
+      return _options.maxBuffers == 0 || allCount() + _buffersPerChunk <= limit;
+    }
+
+    // with `_locker` held, takes every magazine out of the depot so nothing
+    // else can hand out their buffers, frees the chunks that are all there
+    // and packs the remaining buffers into magazines again
+    uint32_t _releaseChunks(uint32_t most) {
+      std::vector<uint32_t> magazines;
+      uint32_t index;
+      while (_pop(_full, index)) {
+        magazines.push_back(index);
+      }
+
+      std::vector<uint8_t*> bases(_chunks.begin(), _chunks.end());
+      std::sort(bases.begin(), bases.end());
+      auto chunkOf = [&](uint8_t* buffer) {
+        return std::upper_bound(bases.begin(), bases.end(), buffer) - bases.begin() - 1;
+      };
+
+      std::vector<uint32_t> available(bases.size(), 0);
+      for (auto m : magazines) {
+        auto& magazine = _at(m);
+        for (uint32_t i = 0; i < magazine.count; i++) {
+          available[chunkOf(magazine.buffers[i])]++;
+        }
+      }
+      std::vector<bool> released(bases.size(), false);
+      uint32_t count = 0;
+      for (size_t c = 0; c < bases.size() && count < most; c++) {
+        if (available[c] == _buffersPerChunk) {
+          released[c] = true;
+          count++;
+        }
+      }
+
+      // refill the magazines in order, the ones left over are empty
+      std::vector<uint8_t*> kept;
+      for (auto m : magazines) {
+        auto& magazine = _at(m);
+        for (uint32_t i = 0; i < magazine.count; i++) {
+          if (!released[chunkOf(magazine.buffers[i])]) {
+            kept.push_back(magazine.buffers[i]);
+          }
+        }
+      }
+      size_t next = 0;
+      for (auto m : magazines) {
+        auto& magazine = _at(m);
+        magazine.count = 0;
+        while (next < kept.size() && magazine.count < MAGAZINE_SIZE) {
+          magazine.buffers[magazine.count++] = kept[next++];
+        }
+        _push(magazine.count > 0 ? _full : _empty, m);
+      }
+
+      for (size_t c = 0; c < bases.size(); c++) {
+        if (released[c]) {
+          _chunks.remove(bases[c]);
+          ChunkMemory::release(bases[c], _chunkLength, _options);
+        }
+      }
+      _chunkCount.fetch_sub(count, std::memory_order_relaxed);
+      _released.fetch_add(count, std::memory_order_relaxed);
+      return count;
+    }
+
+    // both magazines of the thread are empty
+    bool _reload(ThreadCache* cache) {
+      if (_at(cache->previous).count > 0) {
+        std::swap(cache->loaded, cache->previous);
+        return true;
+      }
+      uint32_t index;
+      if (!_pop(_full, index)) {
+        std::lock_guard<std::mutex> guard(_locker);
+        if (!_pop(_full, index)) {
+          if (!_canGrow()) {
+            _exhausted.fetch_add(1, std::memory_order_relaxed);
+            return false;
+          }
+          _allocChunk();
+          _pop(_full, index);
+        }
+      }
+      _push(_empty, cache->loaded);
+      cache->loaded = index;
+      return true;
+    }
+
+    // the loaded magazine is full
+    void _unload(ThreadCache* cache) {
+      if (_at(cache->previous).count == 0) {
+        std::swap(cache->loaded, cache->previous);
+        return;
+      }
+      uint32_t index;
+      if (!_pop(_empty, index)) {
+        std::lock_guard<std::mutex> guard(_locker);
+        index = _newMagazine();
+      }
+      _push(_full, cache->previous);
+      cache->previous = cache->loaded;
+      cache->loaded = index;
+    }
+
+    // with `_locker` held, leaves the thread two empty magazines
+    void _flush(ThreadCache* cache) {
+      for (auto slot : { &cache->loaded, &cache->previous }) {
+        if (_at(*slot).count > 0) {
+          _push(_full, *slot);
+          *slot = _emptyMagazine();
+        }
+      }
+    }
+
+    ThreadCache* _localCache() {
+      auto& local = localCaches();
+      if (local.lastId == _id) {
+        return local.last;
+      }
+      for (auto& entry : local.entries) {
+        if (entry.depotId == _id) {
+          local.lastId = _id;
+          local.last = entry.cache;
+          return entry.cache;
+        }
+      }
+      return _attach(local);
+    }
+
+    // first use on this thread: reuse a cache left by an exited thread or add one
+    ThreadCache* _attach(LocalCaches& local) {
+      _prune(local);
+
+      ThreadCache* cache = nullptr;
+      for (auto it = _caches.load(std::memory_order_acquire); it; it = it->next) {
+        bool owned = false;
+        if (!it->owned.load(std::memory_order_relaxed) && it->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+          cache = it;
+          break;
+        }
+      }
+      if (!cache) {
+        cache = new ThreadCache();
+        {
+          std::lock_guard<std::mutex> guard(_locker);
+          cache->loaded = _emptyMagazine();
+          cache->previous = _emptyMagazine();
+        }
+        cache->next = _caches.load(std::memory_order_relaxed);
+        while (!_caches.compare_exchange_weak(cache->next, cache, std::memory_order_release, std::memory_order_relaxed));
+      }
+
+      local.entries.push_back({ _id, this, cache });
+      local.lastId = _id;
+      local.last = cache;
+      return cache;
+    }
+
+    // forgets the entries of destroyed depots
+    static void _prune(LocalCaches& local) {
+      auto& registry = depotRegistry();
+      std::lock_guard<std::mutex> guard(registry.locker);
+      for (auto it = local.entries.begin(); it != local.entries.end();) {
+        it = registry.live.count(it->depotId) ? it + 1 : local.entries.erase(it);
+      }
+    }
+
+    void _detach(ThreadCache* cache) {
+      {
+        std::lock_guard<std::mutex> guard(_locker);
+        _flush(cache);
+      }
+      cache->owned.store(false, std::memory_order_release);
+    }
+  };
+
+  inline LocalCaches::~LocalCaches() {
+    auto& registry = depotRegistry();
+    std::lock_guard<std::mutex> guard(registry.locker);
+    for (auto& entry : entries) {
+      if (registry.live.count(entry.depotId)) {
+        entry.depot->_detach(entry.cache);
+      }
+    }
+  }
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef LIBTUN_IMPL_KERNEL_NAT_NFTABLES_INCLUDED
+#define LIBTUN_IMPL_KERNEL_NAT_NFTABLES_INCLUDED
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/Exception.h>
+
+namespace libtun {
+namespace impl {
+
+  /* NFTABLES BATCH (one netlink message)
+  -----------------------------------------------------------------------
+  | BATCH_BEGIN | NEWTABLE | NEWCHAIN | NEWRULE | BATCH_END |
+  -----------------------------------------------------------------------
+  the masquerade setup is the equivalent of
+
+    table ip <table> {
+      chain postrouting {
+        type nat hook postrouting priority srcnat; policy accept;
+        ip saddr <network> oifname != <ifName> masquerade
+      }
+    }
+
+  built by hand over NETLINK_NETFILTER, the kernel applies a batch
+  atomically, so no libnftnl/nft binary is needed at build or run time.
+  */
+
+  class Nftables {
+  public:
+
+    Nftables() {
+      _fd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+      if (_fd == -1) {
+        throw Exception(fmt::format("nftables netlink socket error: {}", strerror(errno)));
+      }
+      timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+      setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    Nftables(const Nftables&) = delete;
+
+    ~Nftables() {
+      ::close(_fd);
+    }
+
+    // `network` is in host order, a table with the same name is replaced
+    void addMasquerade(const std::string& table, uint32_t network, uint8_t prefixLen, const std::string& ifName) {
+      deleteTable(table);
+
+      std::vector<uint8_t> msg;
+      _batch(msg, NFNL_MSG_BATCH_BEGIN);
+
+      auto start = _header(msg, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+      _attrString(msg, NFTA_TABLE_NAME, table);
+      _endMessage(msg, start);
+
+      start = _header(msg, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+      _attrString(msg, NFTA_CHAIN_TABLE, table);
+      _attrString(msg, NFTA_CHAIN_NAME, CHAIN);
+      auto hook = _nest(msg, NFTA_CHAIN_HOOK);
+      _attr32(msg, NFTA_HOOK_HOOKNUM, NF_INET_POST_ROUTING);
+      _attr32(msg, NFTA_HOOK_PRIORITY, NAT_PRIORITY);
+      _end(msg, hook);
+      _attrString(msg, NFTA_CHAIN_TYPE, "nat");
+      _attr32(msg, NFTA_CHAIN_POLICY, NF_ACCEPT);
+      _endMessage(msg, start);
+
+      uint32_t mask = prefixLen == 0 ? 0 : ~0u << (32 - prefixLen);
+      uint32_t maskBig = htonl(mask), networkBig = htonl(network & mask), zero = 0;
+      char ifNameBytes[IFNAMSIZ] = { 0 };
+      strncpy(ifNameBytes, ifName.c_str(), IFNAMSIZ - 1);
+
+      start = _header(msg, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+      _attrString(msg, NFTA_RULE_TABLE, table);
+      _attrString(msg, NFTA_RULE_CHAIN, CHAIN);
+      auto exprs = _nest(msg, NFTA_RULE_EXPRESSIONS);
+
+      // reg1 = ip saddr & mask == network
+      auto expr = _expr(msg, "payload");
+      _attr32(msg, NFTA_PAYLOAD_DREG, NFT_REG_1);
+      _attr32(msg, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+      _attr32(msg, NFTA_PAYLOAD_OFFSET, 12);
+      _attr32(msg, NFTA_PAYLOAD_LEN, 4);
+      _endExpr(msg, expr);
+
+      expr = _expr(msg, "bitwise");
+      _attr32(msg, NFTA_BITWISE_SREG, NFT_REG_1);
+      _attr32(msg, NFTA_BITWISE_DREG, NFT_REG_1);
+      _attr32(msg, NFTA_BITWISE_LEN, 4);
+      _data(msg, NFTA_BITWISE_MASK, &maskBig, 4);
+      _data(msg, NFTA_BITWISE_XOR, &zero, 4);
+      _endExpr(msg, expr);
+
+      expr = _expr(msg, "cmp");
+      _attr32(msg, NFTA_CMP_SREG, NFT_REG_1);
+      _attr32(msg, NFTA_CMP_OP, NFT_CMP_EQ);
+      _data(msg, NFTA_CMP_DATA, &networkBig, 4);
+      _endExpr(msg, expr);
+
+      // reply traffic routed back into the tunnel keeps its address
+      expr = _expr(msg, "meta");
+      _attr32(msg, NFTA_META_KEY, NFT_META_OIFNAME);
+      _attr32(msg, NFTA_META_DREG, NFT_REG_1);
+      _endExpr(msg, expr);
+
+      expr = _expr(msg, "cmp");
+      _attr32(msg, NFTA_CMP_SREG, NFT_REG_1);
+      _attr32(msg, NFTA_CMP_OP, NFT_CMP_NEQ);
+      _data(msg, NFTA_CMP_DATA, ifNameBytes, IFNAMSIZ);
+      _endExpr(msg, expr);
+
+      expr = _expr(msg, "masq");
+      _endExpr(msg, expr);
+
+      _end(msg, exprs);
+      _endMessage(msg, start);
+
+      _batch(msg, NFNL_MSG_BATCH_END);
+      _commit(msg, "add masquerade");
+    }
+
+    // a missing table is not an error
+    void deleteTable(const std::string& table) {
+      std::vector<uint8_t> msg;
+      _batch(msg, NFNL_MSG_BATCH_BEGIN);
+      auto start = _header(msg, NFT_MSG_DELTABLE, 0);
+      _attrString(msg, NFTA_TABLE_NAME, table);
+      _endMessage(msg, start);
+      _batch(msg, NFNL_MSG_BATCH_END);
+      _commit(msg, "delete table", ENOENT);
+    }
+
+  private:
+    static constexpr const char* CHAIN = "postrouting";
+    static const int32_t NAT_PRIORITY = 100;
+
+    int _fd;
+    uint32_t _sequence = 0;
+    uint32_t _acks = 0;
+
+    size_t _header(std::vector<uint8_t>& msg, uint16_t type, uint16_t flags) {
+      return _message(msg, (NFNL_SUBSYS_NFTABLES << 8) | type, NLM_F_REQUEST | NLM_F_ACK | flags, NFPROTO_IPV4, 0);
+    }
+
+    // batch begin/end only carry the subsystem, they are never acked
+    void _batch(std::vector<uint8_t>& msg, uint16_t type) {
+      _endMessage(msg, _message(msg, type, NLM_F_REQUEST, AF_UNSPEC, NFNL_SUBSYS_NFTABLES));
+    }
+
+    size_t _message(std::vector<uint8_t>& msg, uint16_t type, uint16_t flags, uint8_t family, uint16_t resId) {
+      size_t start = msg.size();
+      msg.resize(start + NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(nfgenmsg)));
+
+      auto header = (nlmsghdr*)&msg[start];
+      header->nlmsg_type = type;
+      header->nlmsg_flags = flags;
+      header->nlmsg_seq = ++_sequence;
+      header->nlmsg_pid = 0;
+      if (flags & NLM_F_ACK) {
+        _acks++;
+      }
+
+      auto gen = (nfgenmsg*)&msg[start + NLMSG_HDRLEN];
+      gen->nfgen_family = family;
+      gen->version = NFNETLINK_V0;
+      gen->res_id = htons(resId);
+      return start;
+    }
+
+    void _endMessage(std::vector<uint8_t>& msg, size_t start) {
+      ((nlmsghdr*)&msg[start])->nlmsg_len = msg.size() - start;
+    }
+
+    // closes a nested attribute opened at `start`
+    void _end(std::vector<uint8_t>& msg, size_t start) {
+      ((nlattr*)&msg[start])->nla_len = msg.size() - start;
+    }
+
+    size_t _attr(std::vector<uint8_t>& msg, uint16_t type, const void* data, uint16_t len) {
+      size_t start = msg.size();
+      msg.resize(start + NLA_HDRLEN + NLA_ALIGN(len), 0);
+      auto attr = (nlattr*)&msg[start];
+      attr->nla_type = type;
+      attr->nla_len = NLA_HDRLEN + len;
+      if (len > 0) {
+        memcpy(&msg[start + NLA_HDRLEN], data, len);
+      }
+      return start;
+    }
+
+    void _attrString(std::vector<uint8_t>& msg, uint16_t type, const std::string& value) {
+      _attr(msg, type, value.c_str(), value.size() + 1);
+    }
+
+    // netfilter attributes are big endian
+    void _attr32(std::vector<uint8_t>& msg, uint16_t type, uint32_t value) {
+      uint32_t big = htonl(value);
+      _attr(msg, type, &big, 4);
+    }
+
+    size_t _nest(std::vector<uint8_t>& msg, uint16_t type) {
+      return _attr(msg, type | NLA_F_NESTED, nullptr, 0);
+    }
+
+    void _data(std::vector<uint8_t>& msg, uint16_t type, const void* value, uint16_t len) {
+      auto nest = _nest(msg, type);
+      _attr(msg, NFTA_DATA_VALUE, value, len);
+      _end(msg, nest);
+    }
+
+    // LIST_ELEM { NAME, DATA { ... } }, closed by _endExpr
+    size_t _expr(std::vector<uint8_t>& msg, const std::string& name) {
+      auto elem = _nest(msg, NFTA_LIST_ELEM);
+      _attrString(msg, NFTA_EXPR_NAME, name);
+      _nest(msg, NFTA_EXPR_DATA);
+      return elem;
+    }
+
+    void _endExpr(std::vector<uint8_t>& msg, size_t elem) {
+      auto nameLen = NLA_ALIGN(((nlattr*)&msg[elem + NLA_HDRLEN])->nla_len);
+      _end(msg, elem + NLA_HDRLEN + nameLen);
+      _end(msg, elem);
+    }
+
+    void _commit(std::vector<uint8_t>& msg, const char* what, int ignoredError = 0) {
+      sockaddr_nl kernel;
+      memset(&kernel, 0, sizeof(kernel));
+      kernel.nl_family = AF_NETLINK;
+
+      uint32_t acks = _acks;
+      _acks = 0;
+      if (::sendto(_fd, msg.data(), msg.size(), 0, (sockaddr*)&kernel, sizeof(kernel)) == -1) {
+        throw Exception(fmt::format("nftables {} send error: {}", what, strerror(errno)));
+      }
+
+      // every acked message answers with NLMSG_ERROR, error 0 is the ack
+      uint8_t reply[8192];
+      while (acks > 0) {
+        auto len = ::recv(_fd, reply, sizeof(reply), 0);
+        if (len == -1) {
+          if (errno == EINTR) continue;
+          throw Exception(fmt::format("nftables {} receive error: {}", what, strerror(errno)));
+        }
+
+        for (auto header = (nlmsghdr*)reply; NLMSG_OK(header, len); header = NLMSG_NEXT(header, len)) {
+          if (header->nlmsg_type != NLMSG_ERROR) {
+            continue;
+          }
+          int err = -((nlmsgerr*)NLMSG_DATA(header))->error;
+          if (err != 0 && err != ignoredError) {
+            throw Exception(fmt::format("nftables {} error: {}", what, strerror(err)));
+          }
+          // a failed message aborts the whole batch
+          if (err != 0 || --acks == 0) {
+            return;
+          }
+        }
+      }
+    }
+
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
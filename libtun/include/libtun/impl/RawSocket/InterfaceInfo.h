@@ -1,5 +1,22 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_INTERFACE_INFO_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_INTERFACE_INFO_INCLUDED
+
+#include <net/if.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
 #include <string>
+#include <vector>
+#include <fmt/core.h>
 #include <boost/asio/ip/address_v4.hpp>
+#include <libtun/Exception.h>
 
 namespace libtun {
 namespace impl {
@@ -9,5 +26,56 @@ namespace impl {
     boost::asio::ip::address_v4 address;
   };
 
+  // all the up, non-loopback interfaces with an IP4 address
+  inline std::vector<InterfaceInfo> getIp4Interfaces() {
+    ifaddrs* ifaddr;
+    if (getifaddrs(&ifaddr) == -1) {
+      throw libtun::Exception(fmt::format("raw socket getifaddrs failed: {}", strerror(errno)));
+    }
+
+    char host[NI_MAXHOST];
+    std::vector<InterfaceInfo> ifs;
+
+    for (auto cur = ifaddr; cur; cur = cur->ifa_next) {
+      if (
+        !cur->ifa_addr ||
+        cur->ifa_addr->sa_family != AF_INET ||
+        !(cur->ifa_flags & IFF_UP) ||
+        (cur->ifa_flags & IFF_LOOPBACK)
+      ) {
+        continue;
+      }
+
+      if (getnameinfo(cur->ifa_addr, sizeof(sockaddr_in), host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0) {
+        freeifaddrs(ifaddr);
+        throw libtun::Exception(fmt::format("raw socket getnameinfo failed: {}", strerror(errno)));
+      }
+      ifs.push_back({
+        .name = std::string(cur->ifa_name),
+        .address = boost::asio::ip::make_address_v4(host),
+      });
+    }
+
+    freeifaddrs(ifaddr);
+    return ifs;
+  }
+
+  // 0 when it cannot be read
+  inline uint32_t interfaceMtu(const std::string& ifName) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+      return 0;
+    }
+
+    ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ - 1);
+    bool ok = ioctl(fd, SIOCGIFMTU, &ifr) != -1;
+    close(fd);
+    return ok ? ifr.ifr_mtu : 0;
+  }
+
 } // namespace impl
 } // namespace libtun
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_NEXT_HOP_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_NEXT_HOP_INCLUDED
+
+#include <net/if.h>
+#include <net/route.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/if_ether.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+
+namespace libtun {
+namespace impl {
+
+  /* NEXT HOP
+  the rings build the link layer header of egress packets themselves, which
+  is only right for what the kernel would send to the default gateway of the
+  interface. `mac()` hands out the gateway MAC for those destinations alone,
+  anything a more specific route covers (on-link networks, other gateways,
+  other interfaces) has to go through the kernel, and so does everything
+  while the gateway has no ARP entry. `resolve()` reads /proc/net/route and
+  /proc/net/arp again, the owner calls it periodically so the MAC follows
+  ARP changes, it allocates and does not belong on the packet path.
+  */
+
+  class NextHop {
+  public:
+    // false when there is no default route on the interface or no ARP entry
+    // for its gateway (yet)
+    bool resolve(const std::string& ifName) {
+      std::ifstream routeFile("/proc/net/route");
+      std::string line, iface, destinationHex, gatewayHex, flagsHex, refCnt, use, metric, maskHex;
+      std::vector<Route> routes;
+      uint32_t gateway = 0;
+
+      std::getline(routeFile, line);
+      while (std::getline(routeFile, line)) {
+        std::istringstream fields(line);
+        fields >> iface >> destinationHex >> gatewayHex >> flagsHex >> refCnt >> use >> metric >> maskHex;
+        if (!fields || !(std::stoul(flagsHex, nullptr, 16) & RTF_UP)) {
+          continue;
+        }
+
+        // all in network order
+        uint32_t destination = std::stoul(destinationHex, nullptr, 16);
+        uint32_t mask = std::stoul(maskHex, nullptr, 16);
+        if (mask != 0) {
+          routes.push_back({ destination, mask });
+        } else if (iface == ifName && gateway == 0) {
+          gateway = std::stoul(gatewayHex, nullptr, 16);
+        }
+      }
+      _routes.swap(routes);
+
+      uint8_t mac[ETH_ALEN];
+      bool resolved = gateway != 0 && _arpEntry(ifName, gateway, mac);
+      if (resolved && (!_resolved || memcmp(mac, _mac, ETH_ALEN) != 0)) {
+        memcpy(_mac, mac, ETH_ALEN);
+        LOG_INFO << fmt::format(
+          "raw socket next hop of {} is {:02x}:{:02x}:{:02x}:{:02x}:{:02x}:{:02x}",
+          ifName, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]
+        );
+      } else if (!resolved && _resolved) {
+        LOG_WARNING << fmt::format("raw socket lost the next hop of {}, egress goes through IPPROTO_RAW", ifName);
+      }
+      _resolved = resolved;
+      return resolved;
+    }
+
+    // the gateway MAC when `destination` (network order) leaves through the
+    // default route, nullptr when the kernel has to route it
+    const uint8_t* mac(uint32_t destination) const {
+      if (!_resolved) {
+        return nullptr;
+      }
+      for (auto& route : _routes) {
+        if ((destination & route.mask) == route.destination) {
+          return nullptr;
+        }
+      }
+      return _mac;
+    }
+
+  private:
+    struct Route {
+      uint32_t destination;
+      uint32_t mask;
+    };
+
+    // every route but the default ones, any interface
+    std::vector<Route> _routes;
+    uint8_t _mac[ETH_ALEN];
+    bool _resolved = false;
+
+    static bool _arpEntry(const std::string& ifName, uint32_t ip, uint8_t* mac) {
+      char ipText[INET_ADDRSTRLEN];
+      in_addr addr = { .s_addr = ip };
+      inet_ntop(AF_INET, &addr, ipText, sizeof(ipText));
+
+      std::ifstream arps("/proc/net/arp");
+      std::string line, entry, hwType, flags, hwAddr, mask, iface;
+      std::getline(arps, line);
+      while (std::getline(arps, line)) {
+        std::istringstream fields(line);
+        fields >> entry >> hwType >> flags >> hwAddr >> mask >> iface;
+        if (entry != ipText || iface != ifName || hwAddr == "00:00:00:00:00:00") {
+          continue;
+        }
+
+        unsigned int bytes[ETH_ALEN];
+        if (sscanf(hwAddr.c_str(), "%x:%x:%x:%x:%x:%x", bytes, bytes + 1, bytes + 2, bytes + 3, bytes + 4, bytes + 5) != ETH_ALEN) {
+          return false;
+        }
+        for (int i = 0; i < ETH_ALEN; i++) {
+          mac[i] = bytes[i];
+        }
+        return true;
+      }
+      return false;
+    }
+  };
+
+  inline bool interfaceMac(const std::string& ifName, uint8_t* mac) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      return false;
+    }
+
+    ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ - 1);
+    bool ok = ioctl(fd, SIOCGIFHWADDR, &ifr) != -1;
+    close(fd);
+
+    if (ok) {
+      memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    }
+    return ok;
+  }
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_PACKET_TRACE_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_PACKET_TRACE_INCLUDED
+
+#include <stdint.h>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+#include <libtun/protocol.h>
+
+namespace libtun {
+namespace impl {
+
+  inline void tracePacket(uint8_t* ipData, uint32_t ipSize) {
+    libtun::protocol::Ip4 packet(ipData, ipSize);
+    if (
+      packet.protocol() == libtun::protocol::Ip4::Protocol::TCP ||
+      packet.protocol() == libtun::protocol::Ip4::Protocol::UDP
+    ) {
+      libtun::protocol::Tcp tcp(packet);
+      LOG_TRACE << fmt::format(
+        "{}:{} -> {}:{}, protocol: {}, len: {}",
+        packet.sourceIP().to_string(),
+        tcp.sourcePort(),
+        packet.destIP().to_string(),
+        tcp.destPort(),
+        packet.protocol() == libtun::protocol::Ip4::Protocol::TCP ? "TCP" : "UDP",
+        packet.totalLen()
+      );
+    } else {
+      LOG_TRACE << fmt::format(
+        "{} -> {}, protocol: {}, len: {}",
+        packet.sourceIP().to_string(),
+        packet.destIP().to_string(),
+        packet.protocol(),
+        packet.totalLen()
+      );
+    }
+  }
+
+} // namespace impl
+} // namespace libtun
+
+#endif
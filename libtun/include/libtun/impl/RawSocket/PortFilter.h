@@ -0,0 +1,80 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_PORT_FILTER_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_PORT_FILTER_INCLUDED
+
+#ifdef __APPLE__
+  #include <net/bpf.h>
+#else
+  #include <linux/filter.h>
+#endif
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <vector>
+
+namespace libtun {
+namespace impl {
+
+  /* classic BPF, accepts only
+  -------------------------------------------------------------------------------
+  | [link header] | IP4 to ifAddress | TCP/UDP, dst port in [portFrom, portTo] |
+  -------------------------------------------------------------------------------
+  non first fragments are dropped, they carry no ports. `linkHeaderLen` is 0 for
+  SOCK_DGRAM packet sockets (data starts at the IP header) and 14 for ethernet
+  frames, where the ether type is checked as well. Insn is `sock_filter` on linux
+  and `bpf_insn` on macOS, both are { code, jt, jf, k }.
+  */
+
+  template<typename Insn>
+  std::vector<Insn> portRangeFilter(uint32_t linkHeaderLen, uint32_t ifAddress, uint16_t portFrom, uint16_t portTo) {
+    std::vector<Insn> p;
+    std::vector<size_t> dropOnTrue, dropOnFalse;
+
+    auto stmt = [&](uint16_t code, uint32_t k) {
+      p.push_back({ code, 0, 0, k });
+    };
+    auto jump = [&](uint16_t code, uint32_t k, bool dropWhen) {
+      (dropWhen ? dropOnTrue : dropOnFalse).push_back(p.size());
+      p.push_back({ code, 0, 0, k });
+    };
+
+    uint32_t ip = linkHeaderLen;
+    if (linkHeaderLen >= 14) {
+      stmt(BPF_LD | BPF_H | BPF_ABS, 12);
+      jump(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, false);
+    }
+
+    // TCP or UDP
+    stmt(BPF_LD | BPF_B | BPF_ABS, ip + 9);
+    p.push_back({ BPF_JMP | BPF_JEQ | BPF_K, 1, 0, IPPROTO_TCP });
+    jump(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, false);
+
+    // loads are in network order, so is the comparison
+    stmt(BPF_LD | BPF_W | BPF_ABS, ip + 16);
+    jump(BPF_JMP | BPF_JEQ | BPF_K, ifAddress, false);
+
+    stmt(BPF_LD | BPF_H | BPF_ABS, ip + 6);
+    jump(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, true);
+
+    // x = IP4 header length, then the destination port
+    stmt(BPF_LDX | BPF_B | BPF_MSH, ip);
+    stmt(BPF_LD | BPF_H | BPF_IND, ip + 2);
+    jump(BPF_JMP | BPF_JGE | BPF_K, portFrom, false);
+    jump(BPF_JMP | BPF_JGT | BPF_K, portTo, true);
+
+    stmt(BPF_RET | BPF_K, 0xffffffff);
+    size_t drop = p.size();
+    stmt(BPF_RET | BPF_K, 0);
+
+    for (auto index : dropOnTrue) {
+      p[index].jt = drop - index - 1;
+    }
+    for (auto index : dropOnFalse) {
+      p[index].jf = drop - index - 1;
+    }
+    return p;
+  }
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -7,10 +7,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <ifaddrs.h>
 
+#include <atomic>
+#include <memory>
 #include <vector>
-#include <functional>
 #include <fmt/core.h>
 #include <libtun/logger.h>
 #include <libtun/protocol.h>
@@ -18,48 +18,31 @@
 #include <libtun/BufferPool.h>
 #include <libtun/RawSocket.h>
 #include "./InterfaceInfo.h"
+#include "./PacketTrace.h"
+#include "./PortFilter.h"
+#include "./ReleaseSignal.h"
 
 namespace libtun {
 namespace impl {
 
   const int ETHER_HEADER_LEN = sizeof(u_char) * 12 + sizeof(u_short);
 
+  // reads rotate over READ_BUFFERS bpf buffers, `hold()` keeps the current
+  // one until `release()` and read() sleeps on a ReleaseSignal while all of
+  // them are held
   class RawSocketImpl {
   public:
 
-    std::vector<InterfaceInfo> getInterfaces() {
-      ifaddrs* ifaddr;
-      if (getifaddrs(&ifaddr) == -1) {
-        throw libtun::Exception(fmt::format("raw socket getifaddrs failed: ", strerror(errno)));
-      }
-
-      char host[NI_MAXHOST];
-      std::vector<InterfaceInfo> ifs;
-
-      for (auto cur = ifaddr; cur; cur = cur->ifa_next) {
-        if (
-          !cur->ifa_addr ||
-          cur->ifa_addr->sa_family != AF_INET ||
-          !(cur->ifa_flags & IFF_UP) ||
-          (cur->ifa_flags & IFF_LOOPBACK)
-        ) {
-          continue;
-        }
-
-        if (getnameinfo(cur->ifa_addr, sizeof(sockaddr_in), host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) == -1) {
-          throw libtun::Exception(fmt::format("raw socket getnameinfo failed: ", strerror(errno)));
-        }
-        ifs.push_back({
-          .name = std::string(cur->ifa_name),
-          .address = boost::asio::ip::make_address_v4(host),
-        });
-      }
+    static const int READ_TIMEOUT_MS = 100;
+    static const uint32_t READ_BUFFERS = 4;
+    // most batches `hold()` can have out at once
+    static const uint32_t HELD_BATCHES = READ_BUFFERS;
 
-      freeifaddrs(ifaddr);
-      return ifs;
+    std::vector<InterfaceInfo> getInterfaces() {
+      return getIp4Interfaces();
     }
 
-    void open(uint16_t portFrom, uint16_t portTo, const std::string& ifName) {
+    void open(uint16_t portFrom, uint16_t portTo, const std::string& ifName, const boost::asio::ip::address_v4& ifAddress) {
       for (uint8_t i = 0; i < 99 && _fd == -1; i++) {
         _fd = ::open(fmt::format("/dev/bpf{}", i).c_str(), O_RDWR);
       }
@@ -79,79 +62,113 @@ namespace impl {
         throw Exception(fmt::format("bpf ioctl error: {}", strerror(errno)));
       }
 
-      _buf = new uint8_t[_bufLen];
+      // only TCP/UDP to the NAPT port range leaves the kernel
+      auto filter = portRangeFilter<bpf_insn>(ETHER_HEADER_LEN, ifAddress.to_uint(), portFrom, portTo);
+      bpf_program program = { .bf_len = (u_int)filter.size(), .bf_insns = filter.data() };
+      if (ioctl(_fd, BIOCSETF, &program) == -1) {
+        throw Exception(fmt::format("bpf set port filter error: {}", strerror(errno)));
+      }
+
+      // reads return periodically so the reader thread can be stopped
+      timeval timeout = { .tv_sec = 0, .tv_usec = READ_TIMEOUT_MS * 1000 };
+      ioctl(_fd, BIOCSRTIMEOUT, &timeout);
+
+      _bufs.reset(new uint8_t[_bufLen * READ_BUFFERS]);
+      _taken = 0;
+      _released.store(0, std::memory_order_relaxed);
+      if (!_releaseSignal.open()) {
+        throw Exception(fmt::format("cannot open raw socket release signal: {}", strerror(errno)));
+      }
     }
 
     void close() {
+      _releaseSignal.close();
       ::close(_fd);
       _fd = -1;
-      delete[] _buf;
+      _bufs.reset();
+      _readableLen = 0;
     }
 
     int read() {
       if (!opened()) {
         throw Exception("raw socket is not open");
       }
-      return (_readableLen = ::read(_fd, _buf, _bufLen));
+      if (consumable()) {
+        return _readableLen;
+      }
+      if (_allHeld()) {
+        _releaseSignal.wait([this] { return _allHeld(); }, READ_TIMEOUT_MS);
+        return 0;
+      }
+      return (_readableLen = ::read(_fd, _buf(), _bufLen));
     }
 
     int write(uint8_t* data, uint32_t size) {
       return ::write(_fd, data, size);
     }
 
+    // the next hop is not resolved here, nothing to refresh
+    void refreshNextHop(const std::string&) {}
+
     bool opened() {
       return _fd > 0;
     }
+    int fd() {
+      return _fd;
+    }
     bool consumable() {
       return _readableLen > 0;
     }
 
-    void consume(std::function<void(uint8_t*, uint32_t)> onPacket) {
-      if (!consumable()) return;
+    // the handler is inlined into the packet loop, it is not copied
+    template <typename Handler>
+    void consume(Handler&& onPacket) {
+      release(hold(onPacket));
+    }
+
+    // returns the number of buffers held, 0 or 1
+    template <typename Handler>
+    uint32_t hold(Handler&& onPacket) {
+      if (!consumable()) return 0;
 
-      for (auto cur = _buf; cur < _buf + _readableLen;) {
+      auto buf = _buf();
+      for (auto cur = buf; cur < buf + _readableLen;) {
         bpf_hdr* bpfHeader = (bpf_hdr*)cur;
         ether_header* etherHeader = (ether_header*)(cur + bpfHeader->bh_hdrlen);
         auto ipData = cur + bpfHeader->bh_hdrlen + ETHER_HEADER_LEN;
         auto ipSize = bpfHeader->bh_caplen - ETHER_HEADER_LEN;
 
-        uint16_t srcPort, destPort;
-        libtun::protocol::Ip4 packet(ipData, ipSize);
-        if (
-          packet.protocol() == libtun::protocol::Ip4::Protocol::TCP ||
-          packet.protocol() == libtun::protocol::Ip4::Protocol::UDP
-        ) {
-          libtun::protocol::Tcp tcp(packet);
-          LOG_TRACE << fmt::format(
-            "{}:{} -> {}:{}, protocol: {}, len: {}",
-            packet.sourceIP().to_string(),
-            tcp.sourcePort(),
-            packet.destIP().to_string(),
-            tcp.destPort(),
-            packet.protocol() == libtun::protocol::Ip4::Protocol::TCP ? "TCP" : "UDP",
-            packet.totalLen()
-          );
-        } else {
-          LOG_TRACE << fmt::format(
-            "{} -> {}, protocol: {}, len: {}",
-            packet.sourceIP().to_string(),
-            packet.destIP().to_string(),
-            packet.protocol(),
-            packet.totalLen()
-          );
-        }
-
+        tracePacket(ipData, ipSize);
         onPacket(ipData, ipSize);
         cur += BPF_WORDALIGN(bpfHeader->bh_hdrlen + bpfHeader->bh_caplen);
       }
       _readableLen = 0;
+      _taken++;
+      return 1;
+    }
+
+    void release(uint32_t buffers) {
+      _released.fetch_add(buffers, std::memory_order_release);
+      _releaseSignal.notify();
     }
 
   private:
     int _fd = -1;
     int _bufLen = 0;
-    uint8_t* _buf;
+    std::unique_ptr<uint8_t[]> _bufs;
     int _readableLen = 0;
+    // buffers taken by `hold()` and given back by `release()`, may be two threads
+    uint32_t _taken = 0;
+    std::atomic<uint32_t> _released{0};
+    ReleaseSignal _releaseSignal;
+
+    bool _allHeld() {
+      return _taken - _released.load(std::memory_order_acquire) >= READ_BUFFERS;
+    }
+
+    uint8_t* _buf() {
+      return _bufs.get() + (_taken % READ_BUFFERS) * _bufLen;
+    }
 
   };
 
@@ -0,0 +1,352 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_LINUX_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_LINUX_INCLUDED
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+#include <libtun/protocol.h>
+#include <libtun/Exception.h>
+#include <libtun/BufferPool.h>
+#include "./InterfaceInfo.h"
+#include "./PacketTrace.h"
+#include "./NextHop.h"
+#include "./PortFilter.h"
+#include "./ReleaseSignal.h"
+
+namespace libtun {
+namespace impl {
+
+  /* AF_PACKET + TPACKET_V3 mmap rings
+  -------------------------------------------------------------------
+  | RX block 0 | RX block 1 | ... | TX frame 0 | TX frame 1 | ...
+  -------------------------------------------------------------------
+  the kernel fills a whole RX block and hands it over with TP_STATUS_USER,
+  `consume()` walks the frames inside the block in place and gives the block
+  back. `hold()` walks it the same way but keeps the block, its packets stay
+  valid until `release()` gives it back, from any thread, oldest first. the
+  ring stops being consumable while all of its blocks are held, read() then
+  sleeps on a ReleaseSignal instead of the packet fd. egress
+  copies the packet into the next free TX frame and kicks the kernel with an
+  empty `sendto()`.
+
+  a classic BPF filter keeps everything but TCP/UDP to the NAPT port range
+  of the interface address in the kernel. the socket sees packets after GRO,
+  which may merge TCP segments into superpackets past the MTU, the interface
+  settings are left alone and `RawSocket` drops and counts those.
+
+  the socket is SOCK_DGRAM so frames start at the IP header, the link layer
+  header of egress packets is built by the kernel for the next hop MAC, which
+  is the default gateway of the bound interface. destinations a more
+  specific route covers, and everything while the gateway MAC is unresolved,
+  go through a IPPROTO_RAW socket routed by the kernel, see NextHop.
+  */
+
+  class RawSocketImpl {
+  public:
+
+    static const uint32_t RX_BLOCK_SIZE = 1 << 20;
+    static const uint32_t RX_BLOCK_COUNT = 16;
+    static const uint32_t RX_FRAME_SIZE = 2048;
+    static const uint32_t RX_BLOCK_TIMEOUT_MS = 10;
+    static const uint32_t TX_FRAME_SIZE = 2048;
+    static const uint32_t TX_FRAME_COUNT = 512;
+    static const int READ_TIMEOUT_MS = 100;
+    // most batches `hold()` can have out at once
+    static const uint32_t HELD_BATCHES = RX_BLOCK_COUNT;
+
+    std::vector<InterfaceInfo> getInterfaces() {
+      return getIp4Interfaces();
+    }
+
+    void open(uint16_t portFrom, uint16_t portTo, const std::string& ifName, const boost::asio::ip::address_v4& ifAddress) {
+      int ifIndex = if_nametoindex(ifName.c_str());
+      if (ifIndex == 0) {
+        throw Exception(fmt::format("raw socket interface {} not found: {}", ifName, strerror(errno)));
+      }
+
+      _fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_IP));
+      if (_fd == -1) {
+        throw Exception(fmt::format("cannot open packet socket: {}", strerror(errno)));
+      }
+
+      // the socket sees every interface until bound, filter before anything is queued
+      auto filter = portRangeFilter<sock_filter>(0, ifAddress.to_uint(), portFrom, portTo);
+      sock_fprog program = { .len = (unsigned short)filter.size(), .filter = filter.data() };
+      if (setsockopt(_fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == -1) {
+        _throwAndClose("packet socket attach port filter error");
+      }
+
+      int version = TPACKET_V3;
+      if (setsockopt(_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        _throwAndClose("packet socket set TPACKET_V3 error");
+      }
+
+      tpacket_req3 rxReq;
+      memset(&rxReq, 0, sizeof(rxReq));
+      rxReq.tp_block_size = RX_BLOCK_SIZE;
+      rxReq.tp_block_nr = RX_BLOCK_COUNT;
+      rxReq.tp_frame_size = RX_FRAME_SIZE;
+      rxReq.tp_frame_nr = RX_BLOCK_SIZE / RX_FRAME_SIZE * RX_BLOCK_COUNT;
+      rxReq.tp_retire_blk_tov = RX_BLOCK_TIMEOUT_MS;
+      if (setsockopt(_fd, SOL_PACKET, PACKET_RX_RING, &rxReq, sizeof(rxReq)) == -1) {
+        _throwAndClose("packet socket set RX ring error");
+      }
+
+      // block transmit is not supported by the kernel, the TX ring is frame based
+      tpacket_req3 txReq;
+      memset(&txReq, 0, sizeof(txReq));
+      txReq.tp_block_size = RX_BLOCK_SIZE;
+      txReq.tp_frame_size = TX_FRAME_SIZE;
+      txReq.tp_frame_nr = TX_FRAME_COUNT;
+      txReq.tp_block_nr = TX_FRAME_COUNT * TX_FRAME_SIZE / RX_BLOCK_SIZE;
+      if (setsockopt(_fd, SOL_PACKET, PACKET_TX_RING, &txReq, sizeof(txReq)) == -1) {
+        _throwAndClose("packet socket set TX ring error");
+      }
+
+      // egress packets written by ourself should not come back through the RX ring
+      int enabled = 1;
+      setsockopt(_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enabled, sizeof(enabled));
+
+      _ringSize = RX_BLOCK_SIZE * RX_BLOCK_COUNT + TX_FRAME_SIZE * TX_FRAME_COUNT;
+      auto ring = mmap(NULL, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, _fd, 0);
+      if (ring == MAP_FAILED) {
+        ring = mmap(NULL, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+      }
+      if (ring == MAP_FAILED) {
+        _throwAndClose("packet socket mmap ring error");
+      }
+      _rxRing = (uint8_t*)ring;
+      _txRing = _rxRing + RX_BLOCK_SIZE * RX_BLOCK_COUNT;
+      _rxBlock = 0;
+      _taken = 0;
+      _released.store(0, std::memory_order_relaxed);
+      _txFrame = 0;
+
+      sockaddr_ll bound;
+      memset(&bound, 0, sizeof(bound));
+      bound.sll_family = AF_PACKET;
+      bound.sll_protocol = htons(ETH_P_IP);
+      bound.sll_ifindex = ifIndex;
+      if (bind(_fd, (sockaddr*)&bound, sizeof(bound)) == -1) {
+        _throwAndClose("packet socket bind error");
+      }
+
+      _txAddr = bound;
+      _txAddr.sll_halen = ETH_ALEN;
+      _rawFd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+      if (_rawFd == -1) {
+        _throwAndClose("cannot open IPPROTO_RAW socket");
+      }
+      if (!_releaseSignal.open()) {
+        _throwAndClose("cannot open raw socket release signal");
+      }
+      if (!_nextHop.resolve(ifName)) {
+        LOG_WARNING << fmt::format("raw socket cannot resolve next hop of {}, egress falls back to IPPROTO_RAW", ifName);
+      }
+    }
+
+    void close() {
+      _releaseSignal.close();
+      if (_rxRing) {
+        munmap(_rxRing, _ringSize);
+        _rxRing = _txRing = nullptr;
+      }
+      if (_rawFd > 0) {
+        ::close(_rawFd);
+        _rawFd = -1;
+      }
+      if (_fd > 0) {
+        ::close(_fd);
+        _fd = -1;
+      }
+    }
+
+    // waits until the current RX block is handed over by the kernel,
+    // returns the number of packets in it, 0 on timeout.
+    int read() {
+      if (!opened()) {
+        throw Exception("raw socket is not open");
+      }
+      if (consumable()) {
+        return _currentBlock()->hdr.bh1.num_pkts;
+      }
+      if (_allHeld()) {
+        _releaseSignal.wait([this] { return _allHeld(); }, READ_TIMEOUT_MS);
+        return 0;
+      }
+
+      pollfd pfd = { .fd = _fd, .events = POLLIN | POLLERR, .revents = 0 };
+      if (poll(&pfd, 1, READ_TIMEOUT_MS) == -1 && errno != EINTR) {
+        return -1;
+      }
+      return consumable() ? _currentBlock()->hdr.bh1.num_pkts : 0;
+    }
+
+    int write(uint8_t* data, uint32_t size) {
+      libtun::protocol::Ip4 ip(data, size);
+      auto mac = _nextHop.mac(htonl(ip.destIP().to_uint()));
+      if (!mac) {
+        return _writeRaw(data, size);
+      }
+      if (size > TX_FRAME_SIZE - _txDataOffset()) {
+        return -1;
+      }
+      if (memcmp(_txAddr.sll_addr, mac, ETH_ALEN) != 0) {
+        memcpy(_txAddr.sll_addr, mac, ETH_ALEN);
+      }
+
+      auto frame = _txFrameAt(_txFrame);
+      if (_txStatus(frame) != TP_STATUS_AVAILABLE) {
+        // the ring is full, kick the kernel once and give up if it is still busy
+        _kick(MSG_DONTWAIT);
+        if (_txStatus(frame) == TP_STATUS_WRONG_FORMAT) {
+          frame->tp_status = TP_STATUS_AVAILABLE;
+        }
+        if (_txStatus(frame) != TP_STATUS_AVAILABLE) {
+          return -1;
+        }
+      }
+
+      std::memcpy((uint8_t*)frame + _txDataOffset(), data, size);
+      frame->tp_len = size;
+      __sync_synchronize();
+      frame->tp_status = TP_STATUS_SEND_REQUEST;
+      _txFrame = (_txFrame + 1) % TX_FRAME_COUNT;
+
+      return _kick(MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != ENOBUFS ? -1 : size;
+    }
+
+    // rereads the routes and the gateway MAC, not on the packet path
+    void refreshNextHop(const std::string& ifName) {
+      _nextHop.resolve(ifName);
+    }
+
+    bool opened() {
+      return _fd > 0;
+    }
+    int fd() {
+      return _fd;
+    }
+    bool consumable() {
+      return _rxRing &&
+        _taken - _released.load(std::memory_order_acquire) < RX_BLOCK_COUNT &&
+        (_currentBlock()->hdr.bh1.block_status & TP_STATUS_USER);
+    }
+
+    // the handler is inlined into the packet loop, it is not copied
+    template <typename Handler>
+    void consume(Handler&& onPacket) {
+      release(hold(onPacket));
+    }
+
+    // returns the number of blocks held, 0 or 1
+    template <typename Handler>
+    uint32_t hold(Handler&& onPacket) {
+      if (!consumable()) return 0;
+
+      auto block = _currentBlock();
+      __sync_synchronize();
+
+      auto frame = (tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+      for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+        auto ipData = (uint8_t*)frame + frame->tp_mac;
+        auto ipSize = frame->tp_snaplen;
+
+        tracePacket(ipData, ipSize);
+        onPacket(ipData, ipSize);
+        frame = (tpacket3_hdr*)((uint8_t*)frame + frame->tp_next_offset);
+      }
+
+      _rxBlock = (_rxBlock + 1) % RX_BLOCK_COUNT;
+      _taken++;
+      return 1;
+    }
+
+    // gives the oldest `blocks` held blocks back to the kernel
+    void release(uint32_t blocks) {
+      uint32_t released = _released.load(std::memory_order_relaxed);
+      for (uint32_t i = 0; i < blocks; i++, released++) {
+        auto block = (tpacket_block_desc*)(_rxRing + (released % RX_BLOCK_COUNT) * RX_BLOCK_SIZE);
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+      }
+      _released.store(released, std::memory_order_release);
+      _releaseSignal.notify();
+    }
+
+  private:
+    int _fd = -1;
+    int _rawFd = -1;
+    uint8_t* _rxRing = nullptr;
+    uint8_t* _txRing = nullptr;
+    size_t _ringSize = 0;
+    uint32_t _rxBlock = 0;
+    // blocks taken by `hold()` and given back by `release()`, may be two threads
+    uint32_t _taken = 0;
+    std::atomic<uint32_t> _released{0};
+    uint32_t _txFrame = 0;
+    sockaddr_ll _txAddr;
+    NextHop _nextHop;
+    ReleaseSignal _releaseSignal;
+
+    bool _allHeld() {
+      return _taken - _released.load(std::memory_order_acquire) >= RX_BLOCK_COUNT;
+    }
+
+    tpacket_block_desc* _currentBlock() {
+      return (tpacket_block_desc*)(_rxRing + _rxBlock * RX_BLOCK_SIZE);
+    }
+
+    tpacket3_hdr* _txFrameAt(uint32_t index) {
+      return (tpacket3_hdr*)(_txRing + index * TX_FRAME_SIZE);
+    }
+
+    uint32_t _txStatus(tpacket3_hdr* frame) {
+      __sync_synchronize();
+      return frame->tp_status;
+    }
+
+    static uint32_t _txDataOffset() {
+      return TPACKET3_HDRLEN - sizeof(sockaddr_ll);
+    }
+
+    int _kick(int flags) {
+      return sendto(_fd, NULL, 0, flags, (sockaddr*)&_txAddr, sizeof(_txAddr));
+    }
+
+    int _writeRaw(uint8_t* data, uint32_t size) {
+      libtun::protocol::Ip4 ip(data, size);
+      sockaddr_in dest;
+      memset(&dest, 0, sizeof(dest));
+      dest.sin_family = AF_INET;
+      dest.sin_addr.s_addr = htonl(ip.destIP().to_uint());
+      return sendto(_rawFd, data, size, MSG_DONTWAIT, (sockaddr*)&dest, sizeof(dest));
+    }
+
+    void _throwAndClose(const char* what) {
+      auto msg = fmt::format("{}: {}", what, strerror(errno));
+      close();
+      throw Exception(msg);
+    }
+
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
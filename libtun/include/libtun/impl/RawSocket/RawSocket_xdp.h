@@ -0,0 +1,435 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_XDP_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_XDP_INCLUDED
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+#include <libtun/protocol.h>
+#include <libtun/Exception.h>
+#include <libtun/BufferPool.h>
+#include "./InterfaceInfo.h"
+#include "./PacketTrace.h"
+#include "./NextHop.h"
+#include "./XdpProgram.h"
+#include "./ReleaseSignal.h"
+
+#ifndef SOL_XDP
+  #define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+  #define AF_XDP 44
+#endif
+
+namespace libtun {
+namespace impl {
+
+  /* AF_XDP socket
+  ---------------------------------------------------------------------------
+  | UMEM: one page aligned BufferPool<FRAME_SIZE> chunk, FRAME_COUNT frames |
+  ---------------------------------------------------------------------------
+  | fill ring -> RX ring -> consume() -> fill ring (frames stay in place)   |
+  | pool.alloc() -> TX ring -> completion ring -> pool.free()               |
+  ---------------------------------------------------------------------------
+  the XDP program redirects TCP/UDP packets to the interface address within
+  the NAPT port range to this socket, so the kernel stack never sees them.
+  half of the frames are lent to the fill ring for good, the other half are
+  TX frames allocated from the pool and freed when the kernel completes them.
+
+  `hold()` leaves the frames out of the fill ring until `release()`, which
+  the thread that drains them calls oldest first. while frames are held the
+  loop thread alone touches the fill ring. with every RX frame held the fd
+  polls readable for good, read() sleeps on a ReleaseSignal instead.
+
+  frames are ethernet, `consume()` hands over the IP packet behind the header,
+  egress prepends the header for the next hop MAC (default gateway of the
+  interface), what NextHop does not cover goes through a IPPROTO_RAW socket
+  like on the packet socket backend.
+
+  only queue 0 of the interface is served, multi-queue NICs have to steer the
+  NAPT ports there (ethtool -N) or run with a single combined channel.
+  */
+
+  class RawSocketImpl {
+  public:
+
+    static const uint32_t FRAME_SIZE = 2048;
+    static const uint32_t FRAME_COUNT = 4096;
+    static const uint32_t RING_SIZE = FRAME_COUNT / 2;
+    static const uint32_t QUEUE_ID = 0;
+    static const uint32_t RX_BATCH = 64;
+    static const int READ_TIMEOUT_MS = 100;
+    // most batches `hold()` can have out at once, one frame each at worst
+    static const uint32_t HELD_BATCHES = RING_SIZE;
+
+    std::vector<InterfaceInfo> getInterfaces() {
+      return getIp4Interfaces();
+    }
+
+    void open(uint16_t portFrom, uint16_t portTo, const std::string& ifName, const boost::asio::ip::address_v4& ifAddress) {
+      int ifIndex = if_nametoindex(ifName.c_str());
+      if (ifIndex == 0) {
+        throw Exception(fmt::format("raw socket interface {} not found: {}", ifName, strerror(errno)));
+      }
+      _warnMultiQueue(ifName);
+
+      _fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+      if (_fd == -1) {
+        throw Exception(fmt::format("cannot open AF_XDP socket: {}", strerror(errno)));
+      }
+
+      // one chunk is the UMEM, the pool must never grow past it
+      BufferPoolOptions frames;
+      frames.buffersPerChunk = FRAME_COUNT;
+      frames.initialChunks = 1;
+      frames.maxBuffers = FRAME_COUNT;
+      _frames.reset(new BufferPool<FRAME_SIZE>(frames));
+      _umem = _frames->chunks().front();
+
+      xdp_umem_reg umem;
+      memset(&umem, 0, sizeof(umem));
+      umem.addr = (uint64_t)_umem;
+      umem.len = _frames->chunkSize();
+      umem.chunk_size = FRAME_SIZE;
+      umem.headroom = 0;
+      if (setsockopt(_fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) == -1) {
+        _throwAndClose("AF_XDP register UMEM error");
+      }
+
+      int ringSize = RING_SIZE;
+      if (
+        setsockopt(_fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) == -1 ||
+        setsockopt(_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) == -1 ||
+        setsockopt(_fd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) == -1 ||
+        setsockopt(_fd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) == -1
+      ) {
+        _throwAndClose("AF_XDP set ring size error");
+      }
+
+      xdp_mmap_offsets offsets;
+      socklen_t optlen = sizeof(offsets);
+      if (getsockopt(_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) == -1) {
+        _throwAndClose("AF_XDP get ring offsets error");
+      }
+      _mapRing(_rx, offsets.rx, XDP_PGOFF_RX_RING, sizeof(xdp_desc));
+      _mapRing(_tx, offsets.tx, XDP_PGOFF_TX_RING, sizeof(xdp_desc));
+      _mapRing(_fill, offsets.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t));
+      _mapRing(_completion, offsets.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t));
+      _rxTaken = 0;
+
+      // the fill ring owns its frames until close
+      for (uint32_t i = 0; i < RING_SIZE; i++) {
+        auto frame = _frames->alloc();
+        _fill.addr(i) = frame.internal() - _umem;
+      }
+      __atomic_store_n(_fill.producer, RING_SIZE, __ATOMIC_RELEASE);
+      // the rest stays reachable from the sending thread
+      _frames->flush();
+
+      sockaddr_xdp bound;
+      memset(&bound, 0, sizeof(bound));
+      bound.sxdp_family = AF_XDP;
+      bound.sxdp_ifindex = ifIndex;
+      bound.sxdp_queue_id = QUEUE_ID;
+      bound.sxdp_flags = XDP_USE_NEED_WAKEUP;
+      if (bind(_fd, (sockaddr*)&bound, sizeof(bound)) == -1) {
+        _throwAndClose("AF_XDP bind error");
+      }
+
+      xdp_options options;
+      optlen = sizeof(options);
+      _zeroCopy = getsockopt(_fd, SOL_XDP, XDP_OPTIONS, &options, &optlen) == 0 &&
+        (options.flags & XDP_OPTIONS_ZEROCOPY);
+
+      if (!_releaseSignal.open()) {
+        _throwAndClose("cannot open raw socket release signal");
+      }
+
+      try {
+        _program.attach(ifIndex, htonl(ifAddress.to_uint()), portFrom, portTo);
+        _program.setSocket(QUEUE_ID, _fd);
+      } catch (...) {
+        close();
+        throw;
+      }
+
+      _resolveEgress(ifName);
+      LOG_INFO << fmt::format("raw socket uses AF_XDP on {} queue {}, {}", ifName, uint32_t(QUEUE_ID), _zeroCopy ? "zero copy" : "copy mode");
+    }
+
+    void close() {
+      _releaseSignal.close();
+      _program.detach();
+      _unmapRing(_rx);
+      _unmapRing(_tx);
+      _unmapRing(_fill);
+      _unmapRing(_completion);
+      if (_rawFd > 0) {
+        ::close(_rawFd);
+        _rawFd = -1;
+      }
+      if (_fd > 0) {
+        ::close(_fd);
+        _fd = -1;
+      }
+      // the kernel has released the UMEM with the socket
+      _frames.reset();
+      _umem = nullptr;
+    }
+
+    // waits until the RX ring has packets, returns how many, 0 on timeout.
+    int read() {
+      if (!opened()) {
+        throw Exception("raw socket is not open");
+      }
+      if (consumable()) {
+        return _rxAvailable();
+      }
+      if (_allHeld()) {
+        _releaseSignal.wait([this] { return _allHeld(); }, READ_TIMEOUT_MS);
+        return 0;
+      }
+
+      pollfd pfd = { .fd = _fd, .events = POLLIN | POLLERR, .revents = 0 };
+      if (poll(&pfd, 1, READ_TIMEOUT_MS) == -1 && errno != EINTR) {
+        return -1;
+      }
+      return _rxAvailable();
+    }
+
+    int write(uint8_t* data, uint32_t size) {
+      libtun::protocol::Ip4 ip(data, size);
+      auto mac = _hasSource ? _nextHop.mac(htonl(ip.destIP().to_uint())) : nullptr;
+      if (!mac) {
+        return _writeRaw(data, size);
+      }
+      if (size + ETH_HLEN > FRAME_SIZE) {
+        return -1;
+      }
+
+      _reclaim();
+      uint32_t producer = *_tx.producer;
+      Buffer frame;
+      if (producer - __atomic_load_n(_tx.consumer, __ATOMIC_ACQUIRE) >= RING_SIZE || !_frames->tryAlloc(frame)) {
+        // the ring is full, kick the kernel once and give up if it is still busy
+        _kick();
+        return -1;
+      }
+
+      auto ether = (ethhdr*)frame.internal();
+      memcpy(ether->h_dest, mac, ETH_ALEN);
+      memcpy(ether->h_source, _source, ETH_ALEN);
+      ether->h_proto = htons(ETH_P_IP);
+      memcpy(frame.internal() + ETH_HLEN, data, size);
+
+      auto& desc = _tx.desc(producer);
+      desc.addr = frame.internal() - _umem;
+      desc.len = size + ETH_HLEN;
+      desc.options = 0;
+      __atomic_store_n(_tx.producer, producer + 1, __ATOMIC_RELEASE);
+
+      return _kick() == -1 && errno != EAGAIN && errno != ENOBUFS && errno != EBUSY ? -1 : size;
+    }
+
+    // rereads the routes and the gateway MAC, not on the packet path
+    void refreshNextHop(const std::string& ifName) {
+      _nextHop.resolve(ifName);
+    }
+
+    bool opened() {
+      return _fd > 0;
+    }
+    int fd() {
+      return _fd;
+    }
+    bool consumable() {
+      return _rx.map && _rxAvailable() > 0;
+    }
+
+    // the handler is inlined into the packet loop, it is not copied
+    template <typename Handler>
+    void consume(Handler&& onPacket) {
+      // the frames go straight back to the kernel
+      release(hold(onPacket));
+    }
+
+    // returns the number of frames held
+    template <typename Handler>
+    uint32_t hold(Handler&& onPacket) {
+      uint32_t count = std::min(_rxAvailable(), uint32_t(RX_BATCH));
+
+      for (uint32_t i = 0; i < count; i++) {
+        auto& desc = _rx.desc(_rxTaken + i);
+        auto frame = _umem + desc.addr;
+
+        if (desc.len > ETH_HLEN && ((ethhdr*)frame)->h_proto == htons(ETH_P_IP)) {
+          tracePacket(frame + ETH_HLEN, desc.len - ETH_HLEN);
+          onPacket(frame + ETH_HLEN, desc.len - ETH_HLEN);
+        }
+      }
+      _rxTaken += count;
+      return count;
+    }
+
+    // the oldest `count` held frames go back to the fill ring
+    void release(uint32_t count) {
+      if (count == 0) return;
+
+      uint32_t consumer = *_rx.consumer;
+      uint32_t fillProducer = *_fill.producer;
+      for (uint32_t i = 0; i < count; i++) {
+        auto& desc = _rx.desc(consumer + i);
+        _fill.addr(fillProducer + i) = desc.addr - desc.addr % FRAME_SIZE;
+      }
+
+      __atomic_store_n(_fill.producer, fillProducer + count, __ATOMIC_RELEASE);
+      __atomic_store_n(_rx.consumer, consumer + count, __ATOMIC_RELEASE);
+
+      if (*_fill.flags & XDP_RING_NEED_WAKEUP) {
+        recvfrom(_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+      }
+      _releaseSignal.notify();
+    }
+
+  private:
+    struct Ring {
+      uint32_t* producer = nullptr;
+      uint32_t* consumer = nullptr;
+      uint32_t* flags = nullptr;
+      uint8_t* descs = nullptr;
+      void* map = nullptr;
+      size_t mapSize = 0;
+
+      xdp_desc& desc(uint32_t index) {
+        return ((xdp_desc*)descs)[index & (RING_SIZE - 1)];
+      }
+      uint64_t& addr(uint32_t index) {
+        return ((uint64_t*)descs)[index & (RING_SIZE - 1)];
+      }
+    };
+
+    int _fd = -1;
+    int _rawFd = -1;
+    bool _zeroCopy = false;
+    std::unique_ptr<BufferPool<FRAME_SIZE>> _frames;
+    uint8_t* _umem = nullptr;
+    Ring _rx, _tx, _fill, _completion;
+    // RX descriptors walked by `hold()`, ahead of the consumer index until released
+    uint32_t _rxTaken = 0;
+    XdpProgram _program;
+    NextHop _nextHop;
+    uint8_t _source[ETH_ALEN];
+    bool _hasSource = false;
+    ReleaseSignal _releaseSignal;
+
+    void _mapRing(Ring& ring, const xdp_ring_offset& offset, off_t pgoff, size_t descSize) {
+      ring.mapSize = offset.desc + RING_SIZE * descSize;
+      auto map = mmap(NULL, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, pgoff);
+      if (map == MAP_FAILED) {
+        _throwAndClose("AF_XDP mmap ring error");
+      }
+      ring.map = map;
+      ring.producer = (uint32_t*)((uint8_t*)map + offset.producer);
+      ring.consumer = (uint32_t*)((uint8_t*)map + offset.consumer);
+      ring.flags = (uint32_t*)((uint8_t*)map + offset.flags);
+      ring.descs = (uint8_t*)map + offset.desc;
+    }
+
+    void _unmapRing(Ring& ring) {
+      if (ring.map) {
+        munmap(ring.map, ring.mapSize);
+      }
+      ring = Ring();
+    }
+
+    // every frame of the fill ring is out with the owner
+    bool _allHeld() {
+      return _rxTaken - __atomic_load_n(_rx.consumer, __ATOMIC_ACQUIRE) >= RING_SIZE;
+    }
+
+    uint32_t _rxAvailable() {
+      return __atomic_load_n(_rx.producer, __ATOMIC_ACQUIRE) - _rxTaken;
+    }
+
+    // TX frames completed by the kernel go back to the pool
+    void _reclaim() {
+      uint32_t producer = __atomic_load_n(_completion.producer, __ATOMIC_ACQUIRE);
+      uint32_t consumer = *_completion.consumer;
+      for (; consumer != producer; consumer++) {
+        _frames->free(Buffer(_umem + _completion.addr(consumer), FRAME_SIZE));
+      }
+      __atomic_store_n(_completion.consumer, consumer, __ATOMIC_RELEASE);
+    }
+
+    // copy mode transmits inside sendto(), zero copy only when the driver asks for it
+    int _kick() {
+      if (_zeroCopy && !(*_tx.flags & XDP_RING_NEED_WAKEUP)) {
+        return 0;
+      }
+      return sendto(_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    void _resolveEgress(const std::string& ifName) {
+      _rawFd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+      if (_rawFd == -1) {
+        _throwAndClose("cannot open IPPROTO_RAW socket");
+      }
+
+      _hasSource = interfaceMac(ifName, _source);
+      if (!_hasSource || !_nextHop.resolve(ifName)) {
+        LOG_WARNING << fmt::format("raw socket cannot resolve next hop of {}, egress falls back to IPPROTO_RAW", ifName);
+      }
+    }
+
+    int _writeRaw(uint8_t* data, uint32_t size) {
+      libtun::protocol::Ip4 ip(data, size);
+      sockaddr_in dest;
+      memset(&dest, 0, sizeof(dest));
+      dest.sin_family = AF_INET;
+      dest.sin_addr.s_addr = htonl(ip.destIP().to_uint());
+      return sendto(_rawFd, data, size, MSG_DONTWAIT, (sockaddr*)&dest, sizeof(dest));
+    }
+
+    void _warnMultiQueue(const std::string& ifName) {
+      auto dir = opendir(fmt::format("/sys/class/net/{}/queues", ifName).c_str());
+      if (!dir) return;
+
+      int rxQueues = 0;
+      while (auto entry = readdir(dir)) {
+        rxQueues += strncmp(entry->d_name, "rx-", 3) == 0;
+      }
+      closedir(dir);
+
+      if (rxQueues > 1) {
+        LOG_WARNING << fmt::format("{} has {} rx queues, AF_XDP only serves queue {}", ifName, rxQueues, uint32_t(QUEUE_ID));
+      }
+    }
+
+    void _throwAndClose(const char* what) {
+      auto msg = fmt::format("{}: {}", what, strerror(errno));
+      close();
+      throw Exception(msg);
+    }
+
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_RELEASE_SIGNAL_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_RELEASE_SIGNAL_INCLUDED
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+  #include <sys/eventfd.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+
+namespace libtun {
+namespace impl {
+
+  /* RELEASE SIGNAL
+  the reader thread sleeps here while the owner holds every batch of the
+  backend, polling the packet fd would return at once because the kernel
+  has packets queued that cannot be taken. `release()` on the loop thread
+  calls `notify()`, which only writes the eventfd (a pipe off linux) while
+  the reader is actually waiting, so the datapath pays no syscall.
+
+  `wait()` publishes the waiting flag before it checks `held()` again and
+  `notify()` publishes the release before it reads the flag, a release
+  between the two is either seen by the check or wakes the poll.
+  */
+
+  class ReleaseSignal {
+  public:
+
+    // false with errno set, nothing to close then
+    bool open() {
+      _waiting.store(false, std::memory_order_relaxed);
+#ifdef __linux__
+      _readFd = _writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      return _readFd != -1;
+#else
+      int fds[2];
+      if (pipe(fds) == -1) {
+        return false;
+      }
+      fcntl(fds[0], F_SETFL, O_NONBLOCK);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      _readFd = fds[0];
+      _writeFd = fds[1];
+      return true;
+#endif
+    }
+
+    void close() {
+      if (_writeFd != -1 && _writeFd != _readFd) {
+        ::close(_writeFd);
+      }
+      if (_readFd != -1) {
+        ::close(_readFd);
+      }
+      _readFd = _writeFd = -1;
+    }
+
+    // reader thread, returns once `held()` is false, on `notify()` or after
+    // `timeoutMs` so the thread still sees `stop()`
+    template <typename Held>
+    void wait(Held&& held, int timeoutMs) {
+      _waiting.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (held()) {
+        pollfd pfd = { .fd = _readFd, .events = POLLIN, .revents = 0 };
+        poll(&pfd, 1, timeoutMs);
+      }
+      _waiting.store(false, std::memory_order_relaxed);
+
+      uint8_t drained[64];
+      while (::read(_readFd, drained, sizeof(drained)) > 0);
+    }
+
+    // loop thread, after the released units are published
+    void notify() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!_waiting.load(std::memory_order_relaxed)) return;
+
+      uint64_t one = 1;
+      if (::write(_writeFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_ERROR << fmt::format("raw socket release signal failed: {}", strerror(errno));
+      }
+    }
+
+  private:
+    int _readFd = -1;
+    int _writeFd = -1;
+    std::atomic<bool> _waiting{false};
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef LIBTUN_IMPL_RAWSOCKET_XDP_PROGRAM_INCLUDED
+#define LIBTUN_IMPL_RAWSOCKET_XDP_PROGRAM_INCLUDED
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/logger.h>
+#include <libtun/Exception.h>
+
+namespace libtun {
+namespace impl {
+
+  inline int bpfSyscall(int cmd, bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+  }
+
+  /* XDP PORT RANGE REDIRECT
+  ------------------------------------------------------------------------
+  | eth | IP4 to ifAddress | TCP/UDP dst port in [portFrom, portTo] | ... |
+  ------------------------------------------------------------------------
+  matched packets are redirected to the AF_XDP socket of their rx queue in
+  the XSKMAP, everything else (and packets of queues without a socket) goes
+  on to the kernel stack with XDP_PASS. the program is hand assembled so no
+  libbpf/clang is needed at build or run time.
+  */
+
+  class XdpProgram {
+  public:
+    static const uint32_t MAX_QUEUES = 64;
+
+    // tries native (driver) mode first, generic (SKB) mode works on any device, e.g. veth
+    void attach(int ifIndex, uint32_t ifAddress, uint16_t portFrom, uint16_t portTo) {
+      bpf_attr attr;
+
+      memset(&attr, 0, sizeof(attr));
+      attr.map_type = BPF_MAP_TYPE_XSKMAP;
+      attr.key_size = sizeof(uint32_t);
+      attr.value_size = sizeof(uint32_t);
+      attr.max_entries = MAX_QUEUES;
+      _mapFd = bpfSyscall(BPF_MAP_CREATE, &attr);
+      if (_mapFd == -1) {
+        _throwAndDetach("xdp create XSKMAP error");
+      }
+
+      auto insns = _assemble(ifAddress, portFrom, portTo);
+      char log[4096] = { 0 };
+      memset(&attr, 0, sizeof(attr));
+      attr.prog_type = BPF_PROG_TYPE_XDP;
+      attr.expected_attach_type = BPF_XDP;
+      attr.insns = (uint64_t)insns.data();
+      attr.insn_cnt = insns.size();
+      attr.license = (uint64_t)"GPL";
+      attr.log_buf = (uint64_t)log;
+      attr.log_size = sizeof(log);
+      attr.log_level = 1;
+      _progFd = bpfSyscall(BPF_PROG_LOAD, &attr);
+      if (_progFd == -1) {
+        LOG_DEBUG << fmt::format("xdp verifier log: {}", log);
+        _throwAndDetach("xdp load program error");
+      }
+
+      _linkFd = _link(ifIndex, XDP_FLAGS_DRV_MODE);
+      if (_linkFd == -1) {
+        LOG_INFO << fmt::format("xdp native mode unavailable ({}), using generic mode", strerror(errno));
+        _linkFd = _link(ifIndex, XDP_FLAGS_SKB_MODE);
+      }
+      if (_linkFd == -1) {
+        _throwAndDetach("xdp attach program error");
+      }
+    }
+
+    // closing the link fd detaches the program from the interface
+    void detach() {
+      if (_linkFd > 0) ::close(_linkFd);
+      if (_progFd > 0) ::close(_progFd);
+      if (_mapFd > 0) ::close(_mapFd);
+      _linkFd = _progFd = _mapFd = -1;
+    }
+
+    void setSocket(uint32_t queue, int xskFd) {
+      bpf_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.map_fd = _mapFd;
+      attr.key = (uint64_t)&queue;
+      attr.value = (uint64_t)&xskFd;
+      attr.flags = BPF_ANY;
+      if (bpfSyscall(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        throw Exception(fmt::format("xdp register socket of queue {} error: {}", queue, strerror(errno)));
+      }
+    }
+
+  private:
+    int _mapFd = -1;
+    int _progFd = -1;
+    int _linkFd = -1;
+
+    int _link(int ifIndex, uint32_t flags) {
+      bpf_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.link_create.prog_fd = _progFd;
+      attr.link_create.target_ifindex = ifIndex;
+      attr.link_create.attach_type = BPF_XDP;
+      attr.link_create.flags = flags;
+      return bpfSyscall(BPF_LINK_CREATE, &attr);
+    }
+
+    void _throwAndDetach(const char* what) {
+      auto msg = fmt::format("{}: {}", what, strerror(errno));
+      detach();
+      throw Exception(msg);
+    }
+
+    static bpf_insn _insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+      bpf_insn insn;
+      insn.code = code;
+      insn.dst_reg = dst;
+      insn.src_reg = src;
+      insn.off = off;
+      insn.imm = imm;
+      return insn;
+    }
+
+    // r6 = ctx, r2 = data, r3 = data_end
+    std::vector<bpf_insn> _assemble(uint32_t ifAddress, uint16_t portFrom, uint16_t portTo) {
+      const int16_t ETH = 14;
+      std::vector<bpf_insn> p;
+      std::vector<size_t> toPass;
+
+      auto jumpToPass = [&](uint8_t code, uint8_t dst, uint8_t src, int32_t imm) {
+        toPass.push_back(p.size());
+        p.push_back(_insn(code, dst, src, 0, imm));
+      };
+
+      p.push_back(_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+      p.push_back(_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, data), 0));
+      p.push_back(_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, offsetof(xdp_md, data_end), 0));
+
+      // eth + minimal IP4 header
+      p.push_back(_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+      p.push_back(_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH + 20));
+      jumpToPass(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0);
+
+      // ether type IP4
+      p.push_back(_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0));
+      p.push_back(_insn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16));
+      jumpToPass(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, ETH_P_IP);
+
+      // destination is the interface address, compared in network order
+      p.push_back(_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH + 16, 0));
+      jumpToPass(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, (int32_t)ifAddress);
+
+      // TCP or UDP
+      p.push_back(_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH + 9, 0));
+      p.push_back(_insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 1, IPPROTO_TCP));
+      jumpToPass(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP);
+
+      // non first fragments carry no ports
+      p.push_back(_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH + 6, 0));
+      p.push_back(_insn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16));
+      jumpToPass(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_5, 0, 0x1fff);
+
+      // skip the IP4 header by its IHL, then bounds check the ports
+      p.push_back(_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH, 0));
+      p.push_back(_insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x0f));
+      p.push_back(_insn(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_5, 0, 0, 2));
+      jumpToPass(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_5, 0, 20);
+      p.push_back(_insn(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_5, 0, 0));
+      p.push_back(_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+      p.push_back(_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH + 4));
+      jumpToPass(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0);
+
+      // destination port in range
+      p.push_back(_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, ETH + 2, 0));
+      p.push_back(_insn(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_5, 0, 0, 16));
+      jumpToPass(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_5, 0, portFrom);
+      jumpToPass(BPF_JMP | BPF_JGT | BPF_K, BPF_REG_5, 0, portTo);
+
+      // bpf_redirect_map(xskmap, rx_queue_index, XDP_PASS when the queue has no socket)
+      p.push_back(_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, rx_queue_index), 0));
+      p.push_back(_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, _mapFd));
+      p.push_back(_insn(0, 0, 0, 0, 0));
+      p.push_back(_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+      p.push_back(_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+      p.push_back(_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+      size_t pass = p.size();
+      p.push_back(_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+      p.push_back(_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+      for (auto index : toPass) {
+        p[index].off = pass - index - 1;
+      }
+      return p;
+    }
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
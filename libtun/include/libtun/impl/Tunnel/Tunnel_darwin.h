@@ -10,9 +10,11 @@
 #include <net/if_utun.h>
 
 #include <stdint.h>
+#include <vector>
 #include <fmt/core.h>
 #include <libtun/Exception.h>
 #include <libtun/BufferPool.h>
+#include <libtun/protocol/offload.h>
 
 namespace libtun {
 namespace impl {
@@ -20,9 +22,16 @@ namespace impl {
   class TunnelImpl {
   public:
     int fd = -1;
+    std::vector<int> fds;
     std::string ifName;
+    bool offload = false;
+
+    // utun has no multi-queue support, there is always exactly 1 queue
+    void openTunnel(uint16_t queueCount = 1, bool offload = false) {
+      if (offload) {
+        throw Exception("tunnel offload is only supported on linux");
+      }
 
-    void openTunnel() {
       fd = socket(PF_SYSTEM, SOCK_DGRAM, SYSPROTO_CONTROL);
       if (fd == -1) {
         throw Exception(fmt::format("tunnel socket open failed: {}", strerror(errno)));
@@ -55,6 +64,7 @@ namespace impl {
       }
 
       ifName = tunname;
+      fds.assign(1, fd);
     }
 
     void close() {
@@ -62,9 +72,18 @@ namespace impl {
         ::close(fd);
         fd = -1;
       }
+      fds.clear();
+    }
+
+    uint16_t queueCount() const {
+      return fds.size();
+    }
+
+    void setAddress(uint32_t address, uint8_t prefixLen) {
+      throw Exception("tunnel address setup is only supported on linux");
     }
 
-    Buffer read(Buffer buf) {
+    Buffer read(Buffer buf, uint16_t queue = 0, protocol::Offload* offloads = nullptr) {
       if (fd <= 0) return buf;
 
       auto len = ::read(fd, buf.data(), buf.size());
@@ -73,7 +92,7 @@ namespace impl {
       return buf;
     }
 
-    int write(Buffer buf) {
+    int write(Buffer buf, uint16_t queue = 0) {
       if (buf.prefixSpace() < 4 || fd <= 0) {
         return 0;
       }
@@ -84,6 +103,24 @@ namespace impl {
       return ::write(fd, data, buf.size());
     }
 
+    // utun reads block, `wait` is ignored
+    uint32_t readBatch(
+      Buffer* bufs, uint32_t count, uint16_t queue = 0,
+      protocol::Offload* offloads = nullptr, bool wait = true
+    ) {
+      if (count == 0) return 0;
+      bufs[0] = read(bufs[0]);
+      return bufs[0].size() > 0 ? 1 : 0;
+    }
+
+    uint32_t writeBatch(const Buffer* bufs, uint32_t count, uint16_t queue = 0) {
+      uint32_t written = 0;
+      while (written < count && write(bufs[written]) > 0) {
+        written++;
+      }
+      return written;
+    }
+
   };
 
 } // namespace impl
@@ -0,0 +1,254 @@
+#ifndef LIBTUN_IMPL_TUNNEL_LINUX_INCLUDED
+#define LIBTUN_IMPL_TUNNEL_LINUX_INCLUDED
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <fmt/core.h>
+#include <libtun/Exception.h>
+#include <libtun/BufferPool.h>
+#include <libtun/protocol/offload.h>
+
+namespace libtun {
+namespace impl {
+
+  // mirrors struct virtio_net_hdr, <linux/virtio_net.h> does not compile as C++
+  // (a member named `class`) on recent kernel headers
+  struct VirtioNetHeader {
+    static const uint8_t F_NEEDS_CSUM = 1;
+    static const uint8_t GSO_NONE = 0;
+    static const uint8_t GSO_TCPV4 = 1;
+    static const uint8_t GSO_ECN = 0x80;
+
+    uint8_t flags;
+    uint8_t gsoType;
+    uint16_t headerLen;
+    uint16_t gsoSize;
+    uint16_t checksumStart;
+    uint16_t checksumOffset;
+  };
+
+  // every queue is a separate fd attached to the same tun device (IFF_MULTI_QUEUE),
+  // the kernel spreads flows across them so each queue can be served by its own core.
+  // IFF_NO_PI means packets are raw IP without the 4 bytes utun/tun prefix.
+  //
+  // with offload (IFF_VNET_HDR + TSO4/CSUM) every packet carries a virtio_net_hdr,
+  // the kernel hands over TCP superpackets up to 64KB with deferred checksums,
+  // reads need buffers that large and report each packet's `protocol::Offload`.
+  // TSO6 is left off, the tunnel datapath is IP4 only.
+  class TunnelImpl {
+  public:
+    int fd = -1;
+    std::vector<int> fds;
+    std::string ifName;
+    bool offload = false;
+
+    void openTunnel(uint16_t queueCount = 1, bool offload = false) {
+      if (queueCount == 0) {
+        throw Exception("tunnel requires at least 1 queue");
+      }
+
+      for (uint16_t i = 0; i < queueCount; i++) {
+        int queueFd = ::open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+        if (queueFd == -1) {
+          throw Exception(fmt::format("tunnel open /dev/net/tun failed: {}", strerror(errno)));
+        }
+        fds.push_back(queueFd);
+
+        ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE | (offload ? IFF_VNET_HDR : 0);
+        strncpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ - 1);
+
+        if (ioctl(queueFd, TUNSETIFF, &ifr) == -1) {
+          throw Exception(fmt::format("tunnel ioctl TUNSETIFF error: {}", strerror(errno)));
+        }
+        if (offload) {
+          int headerSize = sizeof(VirtioNetHeader);
+          if (
+            ioctl(queueFd, TUNSETVNETHDRSZ, &headerSize) == -1 ||
+            ioctl(queueFd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) == -1
+          ) {
+            throw Exception(fmt::format("tunnel set offload error: {}", strerror(errno)));
+          }
+        }
+        if (fcntl(queueFd, F_SETFL, fcntl(queueFd, F_GETFL) | O_NONBLOCK) == -1) {
+          throw Exception(fmt::format("tunnel set non-blocking error: {}", strerror(errno)));
+        }
+
+        ifName = ifr.ifr_name;
+      }
+
+      fd = fds[0];
+      this->offload = offload;
+    }
+
+    void close() {
+      for (auto queueFd : fds) {
+        ::close(queueFd);
+      }
+      fds.clear();
+      fd = -1;
+      offload = false;
+    }
+
+    uint16_t queueCount() const {
+      return fds.size();
+    }
+
+    // assigns `address`/`prefixLen` to the device and brings it up
+    void setAddress(uint32_t address, uint8_t prefixLen) {
+      int sock = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if (sock == -1) {
+        throw Exception(fmt::format("tunnel address socket error: {}", strerror(errno)));
+      }
+
+      ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      strncpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ - 1);
+      auto addr = (sockaddr_in*)&ifr.ifr_addr;
+      addr->sin_family = AF_INET;
+
+      addr->sin_addr.s_addr = htonl(address);
+      bool failed = ioctl(sock, SIOCSIFADDR, &ifr) == -1;
+      addr->sin_addr.s_addr = htonl(prefixLen == 0 ? 0 : ~0u << (32 - prefixLen));
+      failed = failed || ioctl(sock, SIOCSIFNETMASK, &ifr) == -1;
+      failed = failed || ioctl(sock, SIOCGIFFLAGS, &ifr) == -1;
+      ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+      failed = failed || ioctl(sock, SIOCSIFFLAGS, &ifr) == -1;
+
+      int err = errno;
+      ::close(sock);
+      if (failed) {
+        throw Exception(fmt::format("tunnel set address error: {}", strerror(err)));
+      }
+    }
+
+    Buffer read(Buffer buf, uint16_t queue = 0, protocol::Offload* offloads = nullptr) {
+      if (readBatch(&buf, 1, queue, offloads) == 0) {
+        buf.size(0);
+      }
+      return buf;
+    }
+
+    int write(Buffer buf, uint16_t queue = 0) {
+      if (queue >= fds.size()) return 0;
+      return _write(fds[queue], buf);
+    }
+
+    // blocks until the queue is readable, then drains up to `count` packets
+    // without blocking again. sizes of the read buffers are updated in place,
+    // returns how many buffers are filled. `offloads` is required with offload on.
+    // with `wait` off an empty queue returns 0 right away, for event loop callers.
+    uint32_t readBatch(
+      Buffer* bufs, uint32_t count, uint16_t queue = 0,
+      protocol::Offload* offloads = nullptr, bool wait = true
+    ) {
+      if (queue >= fds.size() || count == 0) return 0;
+      if (offload && !offloads) {
+        throw Exception("tunnel reads with offload need offload info");
+      }
+
+      int queueFd = fds[queue];
+      uint32_t filled = 0;
+
+      while (filled < count) {
+        auto len = _read(queueFd, bufs[filled], offloads ? &offloads[filled] : nullptr);
+        if (len >= 0) {
+          bufs[filled++].size(len);
+          continue;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN || filled > 0 || !wait || !_waitReadable(queueFd)) {
+          break;
+        }
+      }
+      return filled;
+    }
+
+    // returns how many buffers are written, stops at the first failure
+    uint32_t writeBatch(const Buffer* bufs, uint32_t count, uint16_t queue = 0) {
+      if (queue >= fds.size()) return 0;
+
+      uint32_t written = 0;
+      while (written < count) {
+        if (_write(fds[queue], bufs[written]) < 0) {
+          if (errno == EINTR) continue;
+          break;
+        }
+        written++;
+      }
+      return written;
+    }
+
+  private:
+    ssize_t _read(int queueFd, const Buffer& buf, protocol::Offload* info) {
+      if (!offload) {
+        return ::read(queueFd, buf.data(), buf.size());
+      }
+
+      VirtioNetHeader header;
+      iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = buf.data(), .iov_len = buf.size() },
+      };
+      auto len = ::readv(queueFd, iov, 2);
+      if (len < (ssize_t)sizeof(header)) {
+        return len < 0 ? len : 0;
+      }
+
+      uint8_t gsoType = header.gsoType & ~VirtioNetHeader::GSO_ECN;
+      info->type = gsoType == VirtioNetHeader::GSO_TCPV4 ? protocol::Offload::TCP4 : protocol::Offload::NONE;
+      info->segmentSize = header.gsoSize;
+      info->needsChecksum = header.flags & VirtioNetHeader::F_NEEDS_CSUM;
+      info->checksumStart = header.checksumStart;
+      info->checksumOffset = header.checksumOffset;
+      return len - sizeof(header);
+    }
+
+    // packets written with offload on carry an empty header, they are complete
+    ssize_t _write(int queueFd, const Buffer& buf) {
+      if (!offload) {
+        return ::write(queueFd, buf.data(), buf.size());
+      }
+
+      VirtioNetHeader header;
+      memset(&header, 0, sizeof(header));
+      header.gsoType = VirtioNetHeader::GSO_NONE;
+      iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = buf.data(), .iov_len = buf.size() },
+      };
+      auto len = ::writev(queueFd, iov, 2);
+      return len < (ssize_t)sizeof(header) ? len : len - sizeof(header);
+    }
+
+    bool _waitReadable(int queueFd) {
+      pollfd pfd = { .fd = queueFd, .events = POLLIN, .revents = 0 };
+      while (::poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) return false;
+      }
+      return pfd.revents & POLLIN;
+    }
+
+  };
+
+} // namespace impl
+} // namespace libtun
+
+#endif
@@ -6,6 +6,7 @@
 #include <string>
 #include <boost/container_hash/hash.hpp>
 #include <boost/pool/object_pool.hpp>
+#include "./MemoryAccounting.h"
 
 namespace libtun {
 
@@ -141,7 +142,7 @@ namespace libtun {
       return ptr;
     }
 
-    void removeClient(uint8_t clientID) {
+    void removeClient(uint16_t clientID) {
       auto it = _clientMap.upper_bound({
         .clientID = clientID,
         .clientPort = 0,
@@ -163,9 +164,15 @@ namespace libtun {
   private:
     uint16_t _portFrom;
     uint16_t _portTo;
-    std::unordered_map<ServerKey, Connection*, ServerKeyHash> _serverMap;
-    std::map<ClientKey, Connection*> _clientMap;
-    object_pool<Connection> _pool;
+    std::unordered_map<
+      ServerKey, Connection*, ServerKeyHash, std::equal_to<ServerKey>,
+      AccountedAllocator<std::pair<const ServerKey, Connection*>, MemoryAccounting::NAPT_TABLES>
+    > _serverMap;
+    std::map<
+      ClientKey, Connection*, std::less<ClientKey>,
+      AccountedAllocator<std::pair<const ClientKey, Connection*>, MemoryAccounting::NAPT_TABLES>
+    > _clientMap;
+    object_pool<Connection, AccountedUserAllocator<MemoryAccounting::NAPT_TABLES>> _pool;
   };
 
 } // namespace libtun
@@ -4,5 +4,6 @@
 #include "./protocol/ip4.h"
 #include "./protocol/tcp.h"
 #include "./protocol/udp.h"
+#include "./protocol/offload.h"
 
 #endif
\ No newline at end of file
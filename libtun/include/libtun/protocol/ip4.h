@@ -13,6 +13,18 @@ namespace protocol {
   namespace endian = boost::endian;
   using boost::asio::mutable_buffer;
 
+  // incremental update of a ones' complement checksum (RFC 1624) when a 32 bit
+  // word it covers changes from `from` to `to`, no need to walk the packet again
+  inline uint16_t adjustChecksum(uint16_t sum, uint32_t from, uint32_t to) {
+    uint32_t s = (uint16_t)~sum;
+    s += (uint16_t)~(from >> 16) + (uint16_t)~(from & 0xffff);
+    s += (to >> 16) + (to & 0xffff);
+    while (s >> 16) {
+      s = (s & 0xffff) + (s >> 16);
+    }
+    return ~s;
+  }
+
   class Ip4 {
   public:
 
@@ -100,6 +112,12 @@ namespace protocol {
     }
 
     // setters
+    void totalLen(uint16_t len) {
+      _header->totalLen = endian::native_to_big(len);
+    }
+    void id(uint16_t id) {
+      _header->id = endian::native_to_big(id);
+    }
     void checksum(uint16_t sum) {
       _header->checksum = endian::native_to_big(sum);
     }
@@ -111,6 +129,17 @@ namespace protocol {
     }
 
     // mutates
+    // set an address and adjust the header checksum in place, the TCP/UDP
+    // checksum covers the address too and is left to the caller
+    void replaceSourceIP(Address ip) {
+      checksum(adjustChecksum(checksum(), sourceIP().to_uint(), ip.to_uint()));
+      sourceIP(ip);
+    }
+    void replaceDestIP(Address ip) {
+      checksum(adjustChecksum(checksum(), destIP().to_uint(), ip.to_uint()));
+      destIP(ip);
+    }
+
     uint16_t calculateChecksum() {
       uint8_t* data = (uint8_t*)_header;
       uint32_t sum = 0;
@@ -0,0 +1,110 @@
+#ifndef LIBTUN_PROTOCOL_OFFLOAD_INCLUDED
+#define LIBTUN_PROTOCOL_OFFLOAD_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "./ip4.h"
+#include "./tcp.h"
+
+namespace libtun {
+namespace protocol {
+
+  // offload state of a packet read from a tun device with offloads on
+  // (virtio_net_hdr), everything else is a plain packet
+  struct Offload {
+    enum Type: uint8_t {
+      NONE = 0,
+      TCP4 = 1,
+    };
+
+    Type type = NONE;
+    // payload bytes per segment of a TCP4 superpacket
+    uint16_t segmentSize = 0;
+    // the checksum at checksumStart + checksumOffset only holds the pseudo header sum
+    bool needsChecksum = false;
+    uint16_t checksumStart = 0;
+    uint16_t checksumOffset = 0;
+  };
+
+  // folds the bytes from checksumStart on into the seeded checksum field
+  inline void completeChecksum(uint8_t* data, uint32_t size, const Offload& offload) {
+    if (!offload.needsChecksum || offload.checksumStart + offload.checksumOffset + 2u > size) {
+      return;
+    }
+
+    uint32_t sum = 0;
+    for (uint32_t i = offload.checksumStart; i < size; i += 2) {
+      sum += ((uint16_t)data[i] << 8) + (i + 1 < size ? data[i + 1] : 0);
+    }
+    while (sum >> 16) {
+      sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    uint16_t checksum = ~sum;
+    data[offload.checksumStart + offload.checksumOffset] = checksum >> 8;
+    data[offload.checksumStart + offload.checksumOffset + 1] = checksum & 0xff;
+  }
+
+  /* TCP4 SEGMENTATION
+  --------------------------------------------------------
+  | ip4 | tcp | payload 0 | payload 1 | ... | payload n |
+  --------------------------------------------------------
+          ||
+  | ip4 | tcp | payload 0 |, | ip4 | tcp | payload 1 |, ...
+  every segment copies the headers with its own total length, IP id and
+  sequence number, FIN/PSH stay on the last segment and CWR on the first
+  one, both checksums are recomputed. `alloc()` returns a Buffer to write a
+  segment into, `emit(Buffer)` gets it sized to the segment. returns the
+  number of segments, 0 when the packet is not a TCP4 packet.
+  */
+
+  template<typename Alloc, typename Emit>
+  uint32_t segmentTcp4(uint8_t* data, uint32_t size, uint16_t segmentSize, Alloc alloc, Emit emit) {
+    Ip4 ip(data, size);
+    if (size < 20 || ip.version() != 4 || ip.protocol() != Ip4::Protocol::TCP || segmentSize == 0) {
+      return 0;
+    }
+
+    Tcp tcp(ip);
+    uint32_t headerLen = ip.headerLen() * 4 + tcp.headerLen() * 4;
+    if (headerLen > size) {
+      return 0;
+    }
+
+    const uint8_t CWR = 0b10000000, PSH = 0b00001000, FIN = 0b00000001;
+    uint32_t payloadLen = size - headerLen;
+    uint32_t count = 0;
+
+    for (uint32_t offset = 0; offset < payloadLen || count == 0; offset += segmentSize) {
+      uint32_t len = std::min<uint32_t>(segmentSize, payloadLen - offset);
+      bool last = offset + len >= payloadLen;
+
+      auto buf = alloc();
+      memcpy(buf.data(), data, headerLen);
+      memcpy(buf.data() + headerLen, data + headerLen + offset, len);
+      buf.size(headerLen + len);
+
+      Ip4 segmentIp(buf.data(), buf.size());
+      segmentIp.totalLen(buf.size());
+      segmentIp.id(ip.id() + count);
+      segmentIp.calculateChecksumInplace();
+
+      Tcp segmentTcp(segmentIp);
+      uint8_t flags = tcp.flags();
+      if (count > 0) flags &= ~CWR;
+      if (!last) flags &= ~(PSH | FIN);
+      segmentTcp.sequence(tcp.sequence() + offset);
+      segmentTcp.flags(flags);
+      segmentTcp.calculateChecksumInplace();
+
+      emit(buf);
+      count++;
+    }
+    return count;
+  }
+
+} // namespace protocol
+} // namespace libtun
+
+#endif
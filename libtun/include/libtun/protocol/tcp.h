@@ -52,6 +52,7 @@ namespace protocol {
     bool RST() { return _header->flags & 0b00000100; }
     bool SYN() { return _header->flags & 0b00000010; }
     bool FIN() { return _header->flags & 0b00000001; }
+    uint8_t flags() { return _header->flags; }
     uint16_t window() {
       return endian::big_to_native(_header->window);
     }
@@ -75,6 +76,22 @@ namespace protocol {
     void destPort(uint16_t port) {
       _header->destPort = endian::native_to_big(port);
     }
+    void sequence(uint32_t seq) {
+      _header->sequence = endian::native_to_big(seq);
+    }
+    void acknowledgment(uint32_t ack) {
+      _header->acknowledgment = endian::native_to_big(ack);
+    }
+    // in 32 bit words, like the getter
+    void headerLen(uint8_t len) {
+      _header->hlen_reserve = (len << 4) | (_header->hlen_reserve & 0xf);
+    }
+    void flags(uint8_t flags) {
+      _header->flags = flags;
+    }
+    void window(uint16_t window) {
+      _header->window = endian::native_to_big(window);
+    }
     void checksum(uint16_t sum) {
       _header->checksum = endian::native_to_big(sum);
     }
@@ -91,9 +108,10 @@ namespace protocol {
       sum += static_cast<uint8_t>(_ip.protocol());
       sum += _size;
 
+      // an odd trailing byte is padded with zero
       for (int i = 0; i < _size; i += 2) {
         if (i != 16) {
-          sum += ((uint16_t)data[i] << 8) + data[i + 1];
+          sum += ((uint16_t)data[i] << 8) + (i + 1 < _size ? data[i + 1] : 0);
         }
       }
 
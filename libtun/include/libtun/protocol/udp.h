@@ -59,6 +59,36 @@ namespace protocol {
       _header->checksum = endian::native_to_big(sum);
     }
 
+    // mutates
+    // over the pseudo header and the datagram, 0 is sent as 0xffff (0 means no checksum)
+    uint16_t calculateChecksum() {
+      uint8_t* data = (uint8_t*)_header;
+      uint32_t sum = 0;
+      auto sourceIP = _ip.sourceIP().to_bytes();
+      auto destIP = _ip.destIP().to_bytes();
+
+      sum += ((uint16_t)sourceIP[0] << 8) + sourceIP[1] + ((uint16_t)sourceIP[2] << 8) + sourceIP[3];
+      sum += ((uint16_t)destIP[0] << 8) + destIP[1] + ((uint16_t)destIP[2] << 8) + destIP[3];
+      sum += static_cast<uint8_t>(_ip.protocol());
+      sum += _size;
+
+      for (uint32_t i = 0; i < _size; i += 2) {
+        if (i != 6) {
+          sum += ((uint16_t)data[i] << 8) + (i + 1 < _size ? data[i + 1] : 0);
+        }
+      }
+
+      while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+      }
+      uint16_t result = ~sum;
+      return result == 0 ? 0xffff : result;
+    }
+
+    void calculateChecksumInplace() {
+      checksum(calculateChecksum());
+    }
+
   private:
     struct Header {
       uint16_t sourcePort: 16;
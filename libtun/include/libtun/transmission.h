@@ -5,6 +5,6 @@
 #include "./transmission/Cryptor.h"
 #include "./transmission/Rpc.h"
 #include "./transmission/RpcProtocol.h"
-#include "./transmission/Session.h"
+#include "./transmission/SessionTable.h"
 
 #endif
\ No newline at end of file
@@ -50,6 +50,21 @@ namespace transmission {
       _encryption.Resynchronize((Byte*)(iv.data()), iv.size());
     }
 
+    // the segments of a buffer sequence (e.g. a BufferChain) as one stream, the first `skip` bytes stay plain
+    template <typename MutableBufferSequence>
+    void encryptBuffers(const MutableBufferSequence& buffers, uint32_t skip) {
+      for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it) {
+        mutable_buffer segment(*it);
+        if (segment.size() <= skip) {
+          skip -= segment.size();
+          continue;
+        }
+        _encryption.ProcessData((Byte*)segment.data() + skip, (Byte*)segment.data() + skip, segment.size() - skip);
+        skip = 0;
+      }
+      _encryption.Resynchronize((Byte*)(iv.data()), iv.size());
+    }
+
     void decrypt(void* data, uint32_t size) {
       _decryption.ProcessData((Byte*)data, (Byte*)data, size);
       _decryption.Resynchronize((Byte*)(iv.data()), iv.size());
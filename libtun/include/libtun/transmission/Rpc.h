@@ -5,6 +5,7 @@
 #include <map>
 #include <functional>
 #include <chrono>
+#include <utility>
 #include <boost/asio.hpp>
 #include <boost/container_hash/hash.hpp>
 #include <boost/pool/object_pool.hpp>
@@ -12,6 +13,9 @@
 #include <boost/system/error_code.hpp>
 #include "../logger.h"
 #include "../BufferPool.h"
+#include "../BufferChain.h"
+#include "../HandlerAllocator.h"
+#include "../MemoryAccounting.h"
 #include "./constant.h"
 #include "./Cryptor.h"
 
@@ -34,14 +38,21 @@ namespace transmission {
 
   class Rpc {
   public:
+    static const uint32_t HEADER_SIZE = 3;
+    typedef BufferChain<HEADER_SIZE> Chain;
 
+    // `buffer` is the payload that goes out (request or reply), it is returned to
+    // its pool with the block. `chain` frames it for the socket
     struct ControlBlock {
       int8_t remain = 0;
       steady_timer timer;
       udp::endpoint endpoint;
       uint16_t id;
-      Buffer buffer;
+      PooledBuffer buffer;
+      Chain chain;
       std::function<void(error_code, Buffer, ControlBlock*)> onComplete;
+
+      ControlBlock(io_context& context): timer(context) {}
     };
 
     std::function<bool(Buffer, ControlBlock*)> onRequest;
@@ -62,33 +73,20 @@ namespace transmission {
       LOG_DEBUG << fmt::format("RAW_RPC feed: type {}, #{} len {}", type, id, buf.size() + 3);
 
       if (type == Command::REQUEST && _replying.find({from, id}) == _replying.end()) {
-        ControlBlock* control = _pool.malloc();
+        ControlBlock* control = _pool.construct(*_context);
         control->remain = _retry;
-        control->timer = steady_timer(*_context);
         control->endpoint = from;
         control->id = id;
-        control->buffer = buf;
-        control->onComplete = nullptr;
 
         LOG_DEBUG << fmt::format("RAW_RPC request: #{} len {}", id, buf.size() + 3);
 
-        if (onRequest(buf, control)) {
-          if (control->buffer.prefixSpace() < 3) {
-            control->onComplete(boostErrc::make_error_code(boostErrc::no_buffer_space), Buffer(), nullptr);
-            _pool.free(control);
-            return;
-          }
-          control->buffer.moveFrontBoundary(-3);
-
-          auto inputData = control->buffer.data();
-          inputData[0] = Command::REPLY;
-          *((uint16_t*)(inputData + 1)) = endian::native_to_big(control->id);
-          _cryptor->encrypt(inputData + 1, control->buffer.size() - 1);
-
+        // the handler puts the reply into `control->buffer`
+        if (onRequest(buf, control) && control->buffer) {
+          _frame(control, Command::REPLY);
           _replying[{from, id}] = control;
           _onReplyTimer(error_code(), control);
         } else {
-          _pool.free(control);
+          _pool.destroy(control);
         }
       } else if (type == Command::REPLY && _requesting.find(id) != _requesting.end()) {
         LOG_DEBUG << fmt::format("RAW_RPC reply: #{} len {}", id, buf.size() + 3);
@@ -99,35 +97,24 @@ namespace transmission {
       }
     }
 
+    // takes the ownership of buf, it is kept for the retries. the header goes in
+    // front of it without any headroom
     void send(
       const udp::endpoint& to,
-      Buffer buf,
+      PooledBuffer buf,
       std::function<void(error_code, Buffer, ControlBlock*)> onComplete
     ) {
-      if (buf.prefixSpace() < 3) {
-        onComplete(boostErrc::make_error_code(boostErrc::no_buffer_space), Buffer(), nullptr);
-        return;
-      }
-
-      uint16_t id = _nextId();
-
-      buf.moveFrontBoundary(-3);
-      auto data = buf.data();
-      data[0] = Command::REQUEST;
-      *((uint16_t*)(data + 1)) = endian::native_to_big(id);
-      _cryptor->encrypt(data + 1, buf.size() - 1);
-
-      ControlBlock* control = _pool.malloc();
+      ControlBlock* control = _pool.construct(*_context);
       control->remain = _retry;
-      control->timer = steady_timer(*_context);
       control->endpoint = to;
-      control->id = id;
-      control->buffer = buf;
-      control->onComplete = onComplete;
+      control->id = _nextId();
+      control->buffer = std::move(buf);
+      control->onComplete = std::move(onComplete);
+      _frame(control, Command::REQUEST);
 
-      LOG_DEBUG << fmt::format("RAW_RPC send: #{} len {}", id, buf.size());
+      LOG_DEBUG << fmt::format("RAW_RPC send: #{} len {}", control->id, control->chain.size());
 
-      _requesting[id] = control;
+      _requesting[control->id] = control;
       _onRequestTimer(error_code(), control);
     }
 
@@ -157,9 +144,24 @@ namespace transmission {
     udp::socket* _socket;
     Cryptor* _cryptor;
 
-    object_pool<ControlBlock> _pool;
-    std::map<IDWithEndpoint, ControlBlock*> _replying;
-    std::map<uint16_t, ControlBlock*> _requesting;
+    object_pool<ControlBlock, AccountedUserAllocator<MemoryAccounting::RPC>> _pool;
+    std::map<
+      IDWithEndpoint, ControlBlock*, std::less<IDWithEndpoint>,
+      AccountedAllocator<std::pair<const IDWithEndpoint, ControlBlock*>, MemoryAccounting::RPC>
+    > _replying;
+    std::map<
+      uint16_t, ControlBlock*, std::less<uint16_t>,
+      AccountedAllocator<std::pair<const uint16_t, ControlBlock*>, MemoryAccounting::RPC>
+    > _requesting;
+
+    // everything but the command is encrypted, as one stream
+    void _frame(ControlBlock* control, Command command) {
+      auto header = control->chain.prepend(HEADER_SIZE);
+      header[0] = command;
+      *((uint16_t*)(header + 1)) = endian::native_to_big(control->id);
+      control->chain.append(*control->buffer);
+      _cryptor->encryptBuffers(control->chain, 1);
+    }
 
     uint16_t _nextId() {
       if (_id == 0xffff) {
@@ -171,23 +173,25 @@ namespace transmission {
 
     void _onReplyTimer(const error_code& err, ControlBlock* control) {
       if (--control->remain <= 0 || err.failed()) {
-        control->onComplete(err, control->buffer, control);
+        if (control->onComplete) {
+          control->onComplete(err, *control->buffer, control);
+        }
         _replying.erase({control->endpoint, control->id});
-        _pool.free(control);
+        _pool.destroy(control);
         return;
       }
 
       _socket->async_send_to(
-        control->buffer.toConstBuffer(),
+        control->chain,
         control->endpoint,
-        [&, control](const error_code& sendErr, std::size_t transfered) {
+        recycled([&, control](const error_code& sendErr, std::size_t transfered) {
           if (sendErr.failed()) {
             _onReplyTimer(sendErr, control);
           } else {
             control->timer.expires_after(std::chrono::seconds(1));
-            control->timer.async_wait(std::bind(&Rpc::_onReplyTimer, this, std::placeholders::_1, control));
+            control->timer.async_wait(recycled(std::bind(&Rpc::_onReplyTimer, this, std::placeholders::_1, control)));
           }
-        }
+        })
       );
     }
 
@@ -199,21 +203,21 @@ namespace transmission {
           control->onComplete(err, Buffer(), control);
         }
         _requesting.erase(control->id);
-        _pool.free(control);
+        _pool.destroy(control);
         return;
       }
 
       _socket->async_send_to(
-        control->buffer.toConstBuffer(),
+        control->chain,
         control->endpoint,
-        [&, control](const error_code& sendErr, std::size_t transfered) {
+        recycled([&, control](const error_code& sendErr, std::size_t transfered) {
           if (sendErr.failed()) {
             _onRequestTimer(sendErr, control);
           } else {
             control->timer.expires_after(std::chrono::seconds(1));
-            control->timer.async_wait(std::bind(&Rpc::_onRequestTimer, this, std::placeholders::_1, control));
+            control->timer.async_wait(recycled(std::bind(&Rpc::_onRequestTimer, this, std::placeholders::_1, control)));
           }
-        }
+        })
       );
     }
 
@@ -47,23 +47,26 @@ namespace transmission {
     // FUNCTION: (endpoint) => (error)
     std::function<RpcErrorType(udp::endpoint)> onDisconnect;
 
-    RpcProtocol(io_context* context, udp::socket* socket, Cryptor* cryptor, BufferPool<1600>* bufferPool, uint16_t retry = 10):
+    // the messages take buffers of the class they fit, mostly SMALL ones
+    RpcProtocol(io_context* context, udp::socket* socket, Cryptor* cryptor, SizedBufferPool* bufferPool, uint16_t retry = 10):
       Rpc(context, socket, cryptor, retry),
       _bufferPool(bufferPool) {
       onRequest = std::bind(&RpcProtocol::_requestHandler, this, std::placeholders::_1, std::placeholders::_2);
     }
 
     void sendJson(const udp::endpoint& to, const json& payload, std::function<void(json)> onReply) {
-      auto buf = _bufferPool->alloc();
-      buf.moveFrontBoundary(10);
-      buf.size(0);
-      buf.writeStringToBack(payload.dump());
-
-      LOG_TRACE << fmt::format("RPC send: {}", payload.dump());
+      auto payloadStr = payload.dump();
+      // the length prefix and the spare byte `writeBuffer` keeps
+      auto buf = _bufferPool->acquire(payloadStr.size() + 3);
+      if (!buf) {
+        return onReply({ { "error", RpcErrorType::NETWORK_ISSUE } });
+      }
+      buf->size(0);
+      buf->writeStringToBack(payloadStr);
 
-      send(to, buf, [&, onReply](error_code err, Buffer replyBuf, ControlBlock* control) {
-        _bufferPool->free(control->buffer);
+      LOG_TRACE << fmt::format("RPC send: {}", payloadStr);
 
+      send(to, std::move(buf), [onReply](error_code err, Buffer replyBuf, ControlBlock* control) {
         if (err.failed()) {
           LOG_TRACE << fmt::format("RPC send failed: {}", err.message());
           return onReply({ { "error", RpcErrorType::NETWORK_ISSUE } });
@@ -117,7 +120,7 @@ namespace transmission {
     }
 
   private:
-    BufferPool<1600>* _bufferPool;
+    SizedBufferPool* _bufferPool;
 
     bool _requestHandler(Buffer buf, ControlBlock* control) {
       auto jsonStr = buf.readStringFromFront();
@@ -147,18 +150,15 @@ namespace transmission {
         return false;
       }
 
-      LOG_TRACE << fmt::format("RPC reply: {}", replyPayload.dump());
-
-      auto replyBuf = _bufferPool->alloc();
-      replyBuf.moveFrontBoundary(10);
-      replyBuf.size(0);
-      replyBuf.writeStringToBack(replyPayload.dump());
-
-      control->buffer = replyBuf;
-      control->onComplete = [&](error_code err, Buffer completeBuf, ControlBlock* control) {
-        _bufferPool->free(completeBuf);
-      };
+      auto replyStr = replyPayload.dump();
+      LOG_TRACE << fmt::format("RPC reply: {}", replyStr);
 
+      control->buffer = _bufferPool->acquire(replyStr.size() + 3);
+      if (!control->buffer) {
+        return false;
+      }
+      control->buffer->size(0);
+      control->buffer->writeStringToBack(replyStr);
       return true;
     }
 
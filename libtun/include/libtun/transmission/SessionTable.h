@@ -0,0 +1,231 @@
+#ifndef LIBTUN_TRANSMISSION_SESSION_TABLE_INCLUDED
+#define LIBTUN_TRANSMISSION_SESSION_TABLE_INCLUDED
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/pool/pool.hpp>
+#include <boost/container_hash/hash.hpp>
+#include <fmt/format.h>
+#include "../BufferPool.h"
+#include "../Exception.h"
+#include "../MemoryAccounting.h"
+#include "./constant.h"
+#include "./Cryptor.h"
+
+namespace libtun {
+namespace transmission {
+
+  using boost::asio::ip::udp;
+  using boost::asio::ip::address_v4;
+  using std::chrono::system_clock;
+
+  /* SESSION TABLE
+  ---------------------------
+  | entry 0 | entry 1 | ... |  hot: endpoint, status, cipher, counters
+  ---------------------------
+  | keys 0  | keys 1  | ... |  cold: key material, read on connect
+  ---------------------------
+  | quota 0 | quota 1 | ... |  buffers in flight toward each client
+  ---------------------------
+  every array is sized for `capacity` sessions up front, so the memory of the
+  table is known at startup and nothing in it ever moves. the id of a session
+  is its index, the free ids are a stack: lowest first on a fresh table, then
+  the most recently closed id first, its entry is likely still cached. the
+  cipher context of a session comes from a pool on connect and goes back on
+  close (unordered, so closing is O(1) however many sessions there are), an
+  idle slot holds no cipher at all.
+  */
+
+  class SessionTable {
+  public:
+
+    typedef Cryptor::Byte Byte;
+
+    static const uint32_t KEY_SIZE = CryptoPP::AES::DEFAULT_KEYLENGTH;
+    // the client id on the wire is 16 bits
+    static const uint32_t MAX_CAPACITY = 65536;
+
+    struct KeyMaterial {
+      Byte key[KEY_SIZE];
+      Byte iv[KEY_SIZE];
+    };
+
+    // what the packet path touches
+    struct Entry {
+      udp::endpoint endpoint;
+      SessionStatus status = SessionStatus::IDLE;
+      Cryptor* cryptor = nullptr;
+      uint64_t transmittedBytes = 0;
+      system_clock::time_point lastActiveAt;
+      // the source address of the client on its side of the tunnel (KERNEL_NAT),
+      // unspecified until its first packet
+      address_v4 innerSource;
+
+      bool isConnected() const {
+        return status == SessionStatus::CONNECTED;
+      }
+
+      bool isIdle() const {
+        return status == SessionStatus::IDLE;
+      }
+
+      void updateTransmit(uint32_t len) {
+        lastActiveAt = system_clock::now();
+        transmittedBytes += len;
+      }
+    };
+
+    explicit SessionTable(uint32_t capacity):
+      _capacity(capacity) {
+      uint32_t maxCapacity = MAX_CAPACITY;
+      if (capacity == 0 || capacity > maxCapacity) {
+        throw Exception(fmt::format("a session table holds 1 to {} sessions, not {}", maxCapacity, capacity));
+      }
+      _entries.reset(new Entry[capacity]);
+      _keys.reset(new KeyMaterial[capacity]);
+      _quotas.reset(new BufferQuota[capacity]);
+      _free.reserve(capacity);
+      for (uint32_t i = capacity; i > 0; i--) {
+        _free.push_back(i - 1);
+      }
+      _byEndpoint.reserve(capacity);
+      MemoryAccounting::account(MemoryAccounting::SESSIONS).allocated(_arraysSize());
+    }
+
+    SessionTable(const SessionTable&) = delete;
+
+    ~SessionTable() {
+      for (uint32_t i = 0; i < _capacity; i++) {
+        if (_entries[i].cryptor) {
+          _entries[i].cryptor->~Cryptor();
+        }
+      }
+      MemoryAccounting::account(MemoryAccounting::SESSIONS).released(_arraysSize());
+    }
+
+    uint32_t capacity() const {
+      return _capacity;
+    }
+
+    // connected sessions
+    uint32_t size() const {
+      return _capacity - _free.size();
+    }
+
+    Entry& operator [] (uint16_t id) {
+      return _entries[id];
+    }
+
+    // nullptr unless `id` is a connected session
+    Entry* connected(uint32_t id) {
+      if (id >= _capacity || !_entries[id].isConnected()) {
+        return nullptr;
+      }
+      return &_entries[id];
+    }
+
+    const KeyMaterial& keys(uint16_t id) const {
+      return _keys[id];
+    }
+
+    BufferQuota& quota(uint16_t id) {
+      return _quotas[id];
+    }
+
+    // the connected session of an endpoint, -1 if there is none
+    int32_t lookup(const udp::endpoint& from) const {
+      auto it = _byEndpoint.find(from);
+      if (it == _byEndpoint.end()) {
+        return -1;
+      }
+      return it->second;
+    }
+
+    // a connected session with fresh key material, -1 when the table is full
+    int32_t open(const udp::endpoint& from) {
+      if (_free.empty()) {
+        return -1;
+      }
+      uint16_t id = _free.back();
+      _free.pop_back();
+
+      auto& keys = _keys[id];
+      _random.GenerateBlock(keys.key, KEY_SIZE);
+      _random.GenerateBlock(keys.iv, KEY_SIZE);
+
+      auto& entry = _entries[id];
+      entry.endpoint = from;
+      entry.status = SessionStatus::CONNECTED;
+      entry.cryptor = new (_ciphers.malloc()) Cryptor(key(id), iv(id));
+      entry.transmittedBytes = 0;
+      entry.lastActiveAt = system_clock::now();
+      entry.innerSource = address_v4();
+      // buffers of the previous tenant may still be in flight
+      _quotas[id].resetRefused();
+      _byEndpoint[from] = id;
+      return id;
+    }
+
+    void close(uint16_t id) {
+      if (id >= _capacity || _entries[id].isIdle()) {
+        return;
+      }
+      auto& entry = _entries[id];
+      auto it = _byEndpoint.find(entry.endpoint);
+      if (it != _byEndpoint.end() && it->second == id) {
+        _byEndpoint.erase(it);
+      }
+      entry.cryptor->~Cryptor();
+      _ciphers.free(entry.cryptor);
+      entry.cryptor = nullptr;
+      entry.status = SessionStatus::IDLE;
+      _free.push_back(id);
+    }
+
+    std::string key(uint16_t id) const {
+      return std::string((const char*)_keys[id].key, KEY_SIZE);
+    }
+
+    std::string iv(uint16_t id) const {
+      return std::string((const char*)_keys[id].iv, KEY_SIZE);
+    }
+
+  private:
+    struct EndpointHash {
+      size_t operator() (const udp::endpoint& e) const {
+        size_t seed = 0;
+        if (e.address().is_v4()) {
+          boost::hash_combine(seed, e.address().to_v4().to_uint());
+        } else {
+          boost::hash_combine(seed, e.address().to_v6().to_bytes());
+        }
+        boost::hash_combine(seed, e.port());
+        return seed;
+      }
+    };
+
+    size_t _arraysSize() const {
+      return (size_t)_capacity * (sizeof(Entry) + sizeof(KeyMaterial) + sizeof(BufferQuota) + sizeof(uint16_t));
+    }
+
+    uint32_t _capacity;
+    std::unique_ptr<Entry[]> _entries;
+    std::unique_ptr<KeyMaterial[]> _keys;
+    std::unique_ptr<BufferQuota[]> _quotas;
+    std::vector<uint16_t> _free;
+    std::unordered_map<
+      udp::endpoint, uint16_t, EndpointHash, std::equal_to<udp::endpoint>,
+      AccountedAllocator<std::pair<const udp::endpoint, uint16_t>, MemoryAccounting::SESSIONS>
+    > _byEndpoint;
+    boost::pool<AccountedUserAllocator<MemoryAccounting::SESSIONS>> _ciphers{sizeof(Cryptor)};
+    CryptoPP::AutoSeededRandomPool _random;
+  };
+
+} // namespace transmission
+} // namespace libtun
+
+#endif
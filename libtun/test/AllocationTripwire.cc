@@ -0,0 +1,61 @@
+// the test binary carries the counting hooks
+#define LIBTUN_ALLOCATION_TRIPWIRE_HOOKS
+#include <libtun/AllocationTripwire.h>
+
+#include <stdlib.h>
+#include <memory>
+#include <boost/test/unit_test.hpp>
+#include <libtun/BufferPool.h>
+#include <libtun/HandlerAllocator.h>
+
+BOOST_AUTO_TEST_SUITE(allocation_tripwire)
+
+  using libtun::AllocationTripwire;
+  using libtun::DatapathScope;
+
+  BOOST_AUTO_TEST_CASE(counts_inside_datapath_scopes) {
+    AllocationTripwire::arm(AllocationTripwire::COUNT);
+
+    std::unique_ptr<int> outside(new int(1));
+    BOOST_REQUIRE_EQUAL(AllocationTripwire::allocations(), 0);
+
+    {
+      DatapathScope scope;
+      BOOST_REQUIRE(AllocationTripwire::inDatapath());
+      std::unique_ptr<int> inside(new int(2));
+#ifdef __GLIBC__
+      auto raw = malloc(16);
+      free(raw);
+      BOOST_REQUIRE_EQUAL(AllocationTripwire::allocations(), 2);
+#else
+      BOOST_REQUIRE_EQUAL(AllocationTripwire::allocations(), 1);
+#endif
+    }
+    BOOST_REQUIRE(!AllocationTripwire::inDatapath());
+
+    AllocationTripwire::arm(AllocationTripwire::OFF);
+    DatapathScope scope;
+    std::unique_ptr<int> disarmed(new int(3));
+    BOOST_REQUIRE_EQUAL(AllocationTripwire::allocations(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(pools_take_no_heap_after_warm_up) {
+    libtun::BufferPool<2048> pool;
+    auto warmUp = [&pool]() {
+      auto buf = pool.acquire();
+      auto block = libtun::impl::HandlerArena::allocate(200);
+      libtun::impl::HandlerArena::deallocate(block, 200);
+      return (bool)buf;
+    };
+    BOOST_REQUIRE(warmUp());
+
+    AllocationTripwire::arm(AllocationTripwire::COUNT);
+    for (int i = 0; i < 1000; i++) {
+      DatapathScope scope;
+      BOOST_REQUIRE(warmUp());
+    }
+    BOOST_REQUIRE_EQUAL(AllocationTripwire::allocations(), 0);
+    AllocationTripwire::arm(AllocationTripwire::OFF);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
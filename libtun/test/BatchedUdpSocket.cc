@@ -0,0 +1,249 @@
+#include <string>
+#include <cstring>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/BatchedUdpSocket.h>
+
+BOOST_AUTO_TEST_SUITE(batched_udp_socket)
+
+  namespace asio = boost::asio;
+  using asio::ip::udp;
+  using libtun::BufferPool;
+  using libtun::BatchedUdpSocket;
+
+  BOOST_AUTO_TEST_CASE(send_and_receive_batches) {
+    asio::io_context context;
+    BufferPool<1600> pool;
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10070));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10071));
+      BatchedUdpSocket server(&serverSocket, &pool, 4);
+      BatchedUdpSocket client(&clientSocket, &pool, 4);
+
+      auto onReceive = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        BOOST_REQUIRE_EQUAL(from.port(), 10071);
+        BOOST_REQUIRE_EQUAL(buf.prefixSpace(), 50);
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      server.startReceive(onReceive);
+
+      for (int i = 0; i < 10; i++) {
+        auto buf = pool.acquire();
+        buf->size(0);
+        buf->writeStringToBack(std::to_string(i));
+        client.send(udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10070), std::move(buf));
+      }
+      BOOST_REQUIRE_EQUAL(client.pendingCount(), 2);
+
+      asio::steady_timer timer(context);
+      timer.expires_after(std::chrono::milliseconds(500));
+      timer.async_wait([&](boost::system::error_code err) {
+        context.stop();
+      });
+      context.run();
+
+      BOOST_REQUIRE_EQUAL(client.pendingCount(), 0);
+      BOOST_REQUIRE_EQUAL(client.stats().sentDatagrams, 10);
+      BOOST_REQUIRE_EQUAL(client.stats().sendCalls, 3);
+      BOOST_REQUIRE_EQUAL(server.stats().receivedDatagrams, 10);
+      BOOST_REQUIRE_LE(server.stats().receiveCalls, 10);
+    }
+
+    BOOST_REQUIRE_EQUAL(received.size(), 10);
+    for (int i = 0; i < 10; i++) {
+      BOOST_REQUIRE_EQUAL(received[i].substr(2), std::to_string(i));
+    }
+    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(send_chains) {
+    asio::io_context context;
+    BufferPool<1600> pool;
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10083));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10084));
+      BatchedUdpSocket server(&serverSocket, &pool, 4);
+      BatchedUdpSocket client(&clientSocket, &pool, 4);
+
+      auto onReceive = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      server.startReceive(onReceive);
+
+      for (int i = 0; i < 6; i++) {
+        auto buf = pool.acquire();
+        buf->size(1);
+        buf->data()[0] = '0' + i;
+        libtun::BufferChain<2> chain;
+        memcpy(chain.prepend(2), "hd", 2);
+        chain.append(*buf);
+        client.send(udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10083), chain, std::move(buf));
+      }
+
+      asio::steady_timer timer(context);
+      timer.expires_after(std::chrono::milliseconds(200));
+      timer.async_wait([&](boost::system::error_code err) {
+        context.stop();
+      });
+      context.run();
+
+      BOOST_REQUIRE_EQUAL(client.stats().sentDatagrams, 6);
+    }
+
+    BOOST_REQUIRE_EQUAL(received.size(), 6);
+    for (int i = 0; i < 6; i++) {
+      BOOST_REQUIRE_EQUAL(received[i], "hd" + std::to_string(i));
+    }
+    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(send_and_receive_with_offload) {
+    asio::io_context context;
+    BufferPool<1600> pool;
+    libtun::OffloadBufferPool offloadPool(4);
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10072));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10073));
+      BatchedUdpSocket server(&serverSocket, &pool, 4);
+      BatchedUdpSocket client(&clientSocket, &pool, 4);
+
+      if (!server.enableOffload(&offloadPool) || !client.enableOffload(&offloadPool)) {
+        BOOST_TEST_MESSAGE("UDP GSO/GRO is not supported, skipped");
+        return;
+      }
+
+      auto onReceive = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      server.startReceive(onReceive);
+
+      // 2 runs of equal sized datagrams, the run of the 1st endpoint ends with a shorter one
+      auto serverEp = udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10072);
+      for (int i = 0; i < 12; i++) {
+        auto buf = pool.acquire();
+        buf->size(i == 9 ? 10 : 1000);
+        std::memset(buf->data(), 'a' + i, buf->size());
+        client.send(i < 10 ? serverEp : udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10074), std::move(buf));
+      }
+      // a larger datagram in between opens a new message, the one after it
+      // must not join the earlier message and overtake it
+      const int sizes[] = {1000, 1200, 1000};
+      for (int i = 0; i < 3; i++) {
+        auto buf = pool.acquire();
+        buf->size(sizes[i]);
+        std::memset(buf->data(), 'x' + i, buf->size());
+        client.send(serverEp, std::move(buf));
+      }
+
+      asio::steady_timer timer(context);
+      timer.expires_after(std::chrono::milliseconds(500));
+      timer.async_wait([&](boost::system::error_code err) {
+        context.stop();
+      });
+      context.run();
+
+      BOOST_REQUIRE_EQUAL(client.pendingCount(), 0);
+      BOOST_REQUIRE_EQUAL(client.stats().sentDatagrams, 15);
+      BOOST_REQUIRE_EQUAL(client.stats().sentAggregates, 3);
+      BOOST_REQUIRE_EQUAL(client.stats().sendCalls, 1);
+      BOOST_REQUIRE_EQUAL(server.stats().receivedDatagrams, 13);
+    }
+
+    BOOST_REQUIRE_EQUAL(received.size(), 13);
+    for (int i = 0; i < 10; i++) {
+      BOOST_REQUIRE_EQUAL(received[i], std::string(i == 9 ? 10 : 1000, 'a' + i));
+    }
+    BOOST_REQUIRE_EQUAL(received[10], std::string(1000, 'x'));
+    BOOST_REQUIRE_EQUAL(received[11], std::string(1200, 'y'));
+    BOOST_REQUIRE_EQUAL(received[12], std::string(1000, 'z'));
+    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+    BOOST_REQUIRE_EQUAL(offloadPool.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(receive_depth_drains_several_batches) {
+    asio::io_context context;
+    BufferPool<1600> pool;
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10077));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10078));
+      BatchedUdpSocket server(&serverSocket, &pool, 4);
+      server.receiveDepth(3);
+
+      // everything is queued in the socket before the first wakeup
+      for (int i = 0; i < 10; i++) {
+        clientSocket.send_to(asio::buffer(std::to_string(i)), udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10077));
+      }
+
+      auto onReceive = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      server.startReceive(onReceive);
+
+      asio::steady_timer timer(context);
+      timer.expires_after(std::chrono::milliseconds(300));
+      timer.async_wait([&](boost::system::error_code err) {
+        context.stop();
+      });
+      context.run();
+
+      BOOST_REQUIRE_EQUAL(server.stats().receiveWakeups, 1);
+      BOOST_REQUIRE_EQUAL(server.stats().receiveCalls, 3);
+      BOOST_REQUIRE_EQUAL(server.stats().receivedDatagrams, 10);
+    }
+
+    BOOST_REQUIRE_EQUAL(received.size(), 10);
+    for (int i = 0; i < 10; i++) {
+      BOOST_REQUIRE_EQUAL(received[i], std::to_string(i));
+    }
+    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(receive_on_demand) {
+    asio::io_context context;
+    libtun::BufferPoolOptions options;
+    options.maxBuffers = 32;
+    BufferPool<1600> pool(options);
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10085));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10086));
+      auto serverEp = udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10085);
+      BatchedUdpSocket server(&serverSocket, &pool, 4);
+      server.receiveOnDemand();
+      auto onReceive = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      server.startReceive(onReceive);
+      BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+
+      // the pool is drained, the datagram is dropped instead of spinning
+      std::vector<libtun::PooledBuffer> held;
+      while (auto buf = pool.acquire()) {
+        held.push_back(std::move(buf));
+      }
+      clientSocket.send_to(asio::buffer(std::string("dropped")), serverEp);
+      context.run_for(std::chrono::milliseconds(100));
+      BOOST_REQUIRE_EQUAL(server.stats().receiveDrops, 1);
+      BOOST_REQUIRE_EQUAL(received.size(), 0);
+
+      held.clear();
+      clientSocket.send_to(asio::buffer(std::string("received")), serverEp);
+      context.restart();
+      context.run_for(std::chrono::milliseconds(100));
+      BOOST_REQUIRE_EQUAL(received.size(), 1);
+      BOOST_REQUIRE_EQUAL(received[0], "received");
+      BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+    }
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,65 @@
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/BufferChain.h>
+
+BOOST_AUTO_TEST_SUITE(buffer_chain)
+
+  namespace asio = boost::asio;
+  using asio::ip::udp;
+  using libtun::BufferChain;
+
+  BOOST_AUTO_TEST_CASE(prepend_and_append) {
+    uint8_t payload[] = { 'c', 'd' };
+    BufferChain<4> chain;
+    BOOST_REQUIRE_EQUAL(chain.count(), 0);
+
+    chain.append(payload, sizeof(payload));
+    BOOST_REQUIRE_EQUAL(chain.count(), 1);
+    chain.prepend(1)[0] = 'b';
+    chain.prepend(1)[0] = 'a';
+    BOOST_REQUIRE_EQUAL(chain.count(), 2);
+    BOOST_REQUIRE_EQUAL(chain.headerSize(), 2);
+    BOOST_REQUIRE_EQUAL(chain.size(), 4);
+    BOOST_REQUIRE_EQUAL(std::string((const char*)chain.header(), 2), "ab");
+
+    iovec iovecs[2];
+    BOOST_REQUIRE_EQUAL(chain.toIovecs(iovecs), 2);
+    BOOST_REQUIRE_EQUAL(iovecs[0].iov_len, 2);
+    BOOST_REQUIRE(iovecs[1].iov_base == payload);
+
+    BOOST_REQUIRE_THROW(chain.prepend(3), libtun::Exception);
+    BOOST_REQUIRE_THROW(chain.append(payload, 1), libtun::Exception);
+  }
+
+  BOOST_AUTO_TEST_CASE(copy_keeps_its_header) {
+    uint8_t payload[] = { 'c' };
+    BufferChain<2> chain;
+    chain.prepend(2)[1] = 'b';
+    chain.header()[0] = 'a';
+    chain.append(payload, 1);
+
+    libtun::DatagramChain wider(chain);
+    chain.header()[0] = 'x';
+    BOOST_REQUIRE_EQUAL(wider.size(), 3);
+    BOOST_REQUIRE(wider.begin()->data() == wider.header());
+    BOOST_REQUIRE_EQUAL(std::string((const char*)wider.header(), 2), "ab");
+  }
+
+  BOOST_AUTO_TEST_CASE(send_gathered) {
+    asio::io_context context;
+    udp::socket receiver(context, udp::endpoint(udp::v4(), 10082));
+    udp::socket sender(context, udp::endpoint(udp::v4(), 0));
+
+    std::string payload = "payload";
+    BufferChain<3> chain;
+    chain.append(&payload[0], payload.size());
+    memcpy(chain.prepend(3), "hdr", 3);
+    sender.send_to(chain, udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10082));
+
+    char received[64];
+    auto len = receiver.receive(asio::buffer(received));
+    BOOST_REQUIRE_EQUAL(std::string(received, len), "hdrpayload");
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
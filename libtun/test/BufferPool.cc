@@ -1,3 +1,8 @@
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include <boost/test/unit_test.hpp>
 #include <libtun/BufferPool.h>
 
@@ -172,4 +177,271 @@ BOOST_AUTO_TEST_SUITE(BufferPool)
     BOOST_REQUIRE_EQUAL(pool.availableCount(), 32);
   }
 
+  BOOST_AUTO_TEST_CASE(reserve) {
+    libtun::BufferPool<200> reserved(32);
+    reserved.reserve(40);
+    BOOST_REQUIRE_EQUAL(reserved.allCount(), 64);
+    BOOST_REQUIRE_EQUAL(reserved.availableCount(), 64);
+    BOOST_REQUIRE_EQUAL(reserved.chunks().size(), 2);
+    BOOST_REQUIRE_EQUAL(reserved.chunkSize(), 200 * 32);
+  }
+
+  BOOST_AUTO_TEST_CASE(mapped_chunks) {
+    libtun::BufferPoolOptions options;
+    options.buffersPerChunk = 100;
+    options.initialChunks = 2;
+    options.hugePages = true;
+    options.prefault = true;
+    libtun::BufferPool<1600> mapped(options);
+
+    // raised to fill a huge page, the chunks are 2MB aligned
+    BOOST_REQUIRE_EQUAL(mapped.allCount(), 2 * ((2 << 20) / 1600));
+    BOOST_REQUIRE_EQUAL(mapped.chunks().size(), 2);
+    for (auto chunk : mapped.chunks()) {
+      BOOST_REQUIRE_EQUAL((uintptr_t)chunk % (2 << 20), 0);
+    }
+
+    auto buf = mapped.acquire();
+    memset(buf->data(), 1, buf->size());
+    BOOST_REQUIRE_EQUAL(mapped.consumedCount(), 1);
+  }
+
+  BOOST_AUTO_TEST_CASE(pooled_buffer_returns_itself) {
+    libtun::BufferPool<200> owned(32);
+    {
+      auto first = owned.acquire();
+      BOOST_REQUIRE(first);
+      BOOST_REQUIRE_EQUAL(first->size(), 200);
+      BOOST_REQUIRE_EQUAL(owned.consumedCount(), 1);
+
+      libtun::PooledBuffer second = std::move(first);
+      BOOST_REQUIRE(!first);
+      BOOST_REQUIRE_EQUAL(owned.consumedCount(), 1);
+
+      second = owned.acquire();
+      BOOST_REQUIRE_EQUAL(owned.consumedCount(), 1);
+      second.reset();
+      BOOST_REQUIRE_EQUAL(owned.consumedCount(), 0);
+      second.reset();
+      BOOST_REQUIRE_EQUAL(owned.consumedCount(), 0);
+
+      second = owned.acquire();
+    }
+    BOOST_REQUIRE_EQUAL(owned.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(pooled_buffer_share) {
+    libtun::BufferPool<200> owned(32);
+    auto buffer = owned.acquire();
+    buffer->moveFrontBoundary(10);
+    buffer->size(20);
+    BOOST_REQUIRE(buffer.share());
+    BOOST_REQUIRE_EQUAL(buffer->prefixSpace(), 10);
+    BOOST_REQUIRE_EQUAL(buffer->size(), 20);
+    BOOST_REQUIRE_EQUAL(buffer->internalSize(), 196);
+
+    auto other = buffer.ref();
+    BOOST_REQUIRE_EQUAL(other->data(), buffer->data());
+    BOOST_REQUIRE_EQUAL(buffer.refCount(), 2);
+    other->moveFrontBoundary(-5);
+    BOOST_REQUIRE_EQUAL(buffer->prefixSpace(), 10);
+
+    buffer.reset();
+    BOOST_REQUIRE_EQUAL(owned.consumedCount(), 1);
+    BOOST_REQUIRE_EQUAL(other.refCount(), 1);
+    other.reset();
+    BOOST_REQUIRE_EQUAL(owned.consumedCount(), 0);
+
+    // no room left for the count
+    auto full = owned.acquire();
+    BOOST_REQUIRE(!full.share());
+    BOOST_REQUIRE(!full.ref());
+  }
+
+  BOOST_AUTO_TEST_CASE(hard_limit) {
+    libtun::BufferPoolOptions options;
+    options.buffersPerChunk = 4;
+    options.maxBuffers = 8;
+    libtun::BufferPool<200> bounded(options);
+    std::vector<TunBuffer> taken(8);
+    for (auto& buffer : taken) {
+      BOOST_REQUIRE(bounded.tryAlloc(buffer));
+    }
+    TunBuffer extra;
+    BOOST_REQUIRE(!bounded.tryAlloc(extra));
+    BOOST_REQUIRE(!bounded.acquire());
+    BOOST_REQUIRE_THROW(bounded.alloc(), std::bad_alloc);
+    BOOST_REQUIRE_EQUAL(bounded.allCount(), 8);
+    BOOST_REQUIRE_EQUAL(bounded.stats().exhausted, 3);
+
+    bounded.free(taken.back());
+    BOOST_REQUIRE(bounded.tryAlloc(extra));
+    bounded.free(extra);
+    taken.pop_back();
+    for (auto& buffer : taken) {
+      bounded.free(buffer);
+    }
+    BOOST_REQUIRE_EQUAL(bounded.availableCount(), 8);
+  }
+
+  BOOST_AUTO_TEST_CASE(soft_limit) {
+    libtun::BufferPoolOptions options;
+    options.softBuffers = 3;
+    libtun::BufferPool<200> soft(options);
+    auto first = soft.acquire();
+    auto second = soft.acquire();
+    BOOST_REQUIRE(!soft.pressured());
+    auto third = soft.acquire();
+    BOOST_REQUIRE(soft.pressured());
+    third.reset();
+    BOOST_REQUIRE(!soft.pressured());
+  }
+
+  BOOST_AUTO_TEST_CASE(trim_releases_idle_chunks) {
+    libtun::BufferPoolOptions options;
+    options.buffersPerChunk = 32;
+    options.initialChunks = 2;
+    options.releaseIdle = std::chrono::milliseconds(1);
+    libtun::BufferPool<200> trimmed(options);
+
+    std::vector<TunBuffer> taken;
+    for (int i = 0; i < 32 * 4; i++) {
+      taken.push_back(trimmed.alloc());
+    }
+    BOOST_REQUIRE_EQUAL(trimmed.stats().chunks, 4);
+    for (auto& buffer : taken) {
+      trimmed.free(buffer);
+    }
+    trimmed.flush();
+
+    // the peak of the first window still needs every chunk
+    BOOST_REQUIRE_EQUAL(trimmed.trim(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    BOOST_REQUIRE_EQUAL(trimmed.trim(), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    // an idle window needs one spare chunk, initialChunks are kept anyway
+    BOOST_REQUIRE_EQUAL(trimmed.trim(), 2);
+    BOOST_REQUIRE_EQUAL(trimmed.stats().chunks, 2);
+    BOOST_REQUIRE_EQUAL(trimmed.stats().releasedChunks, 2);
+    BOOST_REQUIRE_EQUAL(trimmed.availableCount(), 64);
+
+    auto buffer = trimmed.alloc();
+    memset(buffer.data(), 1, buffer.size());
+    trimmed.free(buffer);
+  }
+
+  BOOST_AUTO_TEST_CASE(pooled_buffer_quota) {
+    libtun::BufferPool<200> charged(32);
+    libtun::BufferQuota quota(2);
+    {
+      auto first = charged.acquire();
+      auto second = charged.acquire();
+      BOOST_REQUIRE(first.charge(&quota));
+      BOOST_REQUIRE(!first.charge(&quota));
+      BOOST_REQUIRE(second.charge(&quota));
+      BOOST_REQUIRE_EQUAL(quota.inFlight(), 2);
+      BOOST_REQUIRE(!quota.admits());
+      BOOST_REQUIRE_EQUAL(quota.refused(), 1);
+
+      auto third = charged.acquire();
+      BOOST_REQUIRE(!third.charge(&quota));
+      BOOST_REQUIRE_EQUAL(quota.refused(), 2);
+
+      libtun::PooledBuffer moved = std::move(first);
+      BOOST_REQUIRE_EQUAL(quota.inFlight(), 2);
+      moved.reset();
+      BOOST_REQUIRE_EQUAL(quota.inFlight(), 1);
+      BOOST_REQUIRE(quota.admits());
+    }
+    BOOST_REQUIRE_EQUAL(quota.inFlight(), 0);
+    BOOST_REQUIRE_EQUAL(charged.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(sized_classes) {
+    libtun::SizedBufferPool pools;
+    BOOST_REQUIRE_EQUAL(pools.classOf(30), libtun::SizedBufferPool::SMALL);
+    BOOST_REQUIRE_EQUAL(pools.classOf(257), libtun::SizedBufferPool::MTU);
+    BOOST_REQUIRE_EQUAL(pools.classOf(1601), libtun::SizedBufferPool::OFFLOAD);
+    BOOST_REQUIRE_EQUAL(pools.classOf(65537), libtun::SizedBufferPool::CLASS_COUNT);
+
+    {
+      auto small = pools.acquire(30);
+      BOOST_REQUIRE_EQUAL(small->size(), 256);
+      auto mtu = pools.acquire(1500);
+      BOOST_REQUIRE_EQUAL(mtu->size(), 1600);
+      BOOST_REQUIRE_EQUAL(pools.stats(libtun::SizedBufferPool::SMALL).consumed, 1);
+      BOOST_REQUIRE_EQUAL(pools.stats(libtun::SizedBufferPool::MTU).consumed, 1);
+      BOOST_REQUIRE_EQUAL(pools.stats(libtun::SizedBufferPool::OFFLOAD).chunks, 0);
+    }
+    BOOST_REQUIRE_EQUAL(pools.small().consumedCount(), 0);
+    BOOST_REQUIRE_EQUAL(pools.mtu().consumedCount(), 0);
+
+    auto large = pools.alloc(9000);
+    BOOST_REQUIRE_EQUAL(large.size(), 65536);
+    BOOST_REQUIRE_EQUAL(pools.offload().consumedCount(), 1);
+    pools.free(large);
+    BOOST_REQUIRE_EQUAL(pools.offload().consumedCount(), 0);
+
+    BOOST_REQUIRE_THROW(pools.acquire(65537), libtun::Exception);
+  }
+
+  BOOST_AUTO_TEST_CASE(cross_thread_free) {
+    libtun::BufferPool<200> shared(64);
+    std::vector<TunBuffer> taken;
+    for (int i = 0; i < 100; i++) {
+      taken.push_back(shared.alloc());
+    }
+    std::thread releaser([&]() {
+      for (auto& buffer : taken) {
+        shared.free(buffer);
+      }
+    });
+    releaser.join();
+    BOOST_REQUIRE_EQUAL(shared.consumedCount(), 0);
+
+    // the exited thread handed its magazines back, nothing new is carved
+    uint32_t all = shared.allCount();
+    for (auto& buffer : taken) {
+      buffer = shared.alloc();
+    }
+    BOOST_REQUIRE_EQUAL(shared.allCount(), all);
+    std::set<uint8_t*> distinct;
+    for (auto& buffer : taken) {
+      distinct.insert(buffer.internal());
+      shared.free(buffer);
+    }
+    BOOST_REQUIRE_EQUAL(distinct.size(), 100);
+    BOOST_REQUIRE_EQUAL(shared.availableCount(), all);
+  }
+
+  BOOST_AUTO_TEST_CASE(concurrent_alloc_free) {
+    libtun::BufferPool<64> shared(32);
+    std::atomic<bool> overlap{false};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; t++) {
+      workers.emplace_back([&, t]() {
+        std::vector<TunBuffer> held;
+        for (int round = 0; round < 2000; round++) {
+          for (int i = 0; i < 40; i++) {
+            held.push_back(shared.alloc());
+            memset(held.back().internal(), t, 64);
+          }
+          for (auto& buffer : held) {
+            if (buffer.internal()[0] != t || buffer.internal()[63] != t) {
+              overlap = true;
+            }
+            shared.free(buffer);
+          }
+          held.clear();
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    BOOST_REQUIRE(!overlap);
+    BOOST_REQUIRE_EQUAL(shared.consumedCount(), 0);
+    BOOST_REQUIRE_EQUAL(shared.availableCount(), shared.allCount());
+  }
+
 BOOST_AUTO_TEST_SUITE_END()
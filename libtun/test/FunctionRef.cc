@@ -0,0 +1,45 @@
+#include <boost/test/unit_test.hpp>
+#include <libtun/FunctionRef.h>
+
+BOOST_AUTO_TEST_SUITE(function_ref)
+
+  using libtun::FunctionRef;
+
+  class Counter {
+  public:
+    uint32_t total = 0;
+
+    uint32_t add(uint32_t value) {
+      total += value;
+      return total;
+    }
+  };
+
+  BOOST_AUTO_TEST_CASE(refers_to_a_callable) {
+    uint32_t calls = 0;
+    auto count = [&calls](uint32_t value) {
+      calls += value;
+      return calls;
+    };
+
+    FunctionRef<uint32_t(uint32_t)> ref;
+    BOOST_REQUIRE(!ref);
+    ref = count;
+    BOOST_REQUIRE(ref);
+    BOOST_REQUIRE_EQUAL(ref(2), 2);
+    BOOST_REQUIRE_EQUAL(ref(3), 5);
+
+    auto copy = ref;
+    copy(1);
+    BOOST_REQUIRE_EQUAL(calls, 6);
+  }
+
+  BOOST_AUTO_TEST_CASE(binds_a_member) {
+    Counter counter;
+    auto ref = FunctionRef<uint32_t(uint32_t)>::bind<Counter, &Counter::add>(&counter);
+    BOOST_REQUIRE_EQUAL(ref(4), 4);
+    BOOST_REQUIRE_EQUAL(ref(1), 5);
+    BOOST_REQUIRE_EQUAL(counter.total, 5);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,49 @@
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/HandlerAllocator.h>
+
+BOOST_AUTO_TEST_SUITE(handler_allocator)
+
+  namespace asio = boost::asio;
+  using libtun::impl::HandlerArena;
+
+  BOOST_AUTO_TEST_CASE(blocks_are_recycled) {
+    auto first = HandlerArena::allocate(100);
+    HandlerArena::deallocate(first, 100);
+    auto second = HandlerArena::allocate(120);
+    BOOST_REQUIRE(first == second);
+    HandlerArena::deallocate(second, 120);
+
+    // beyond the largest class
+    auto large = HandlerArena::allocate(4096);
+    HandlerArena::deallocate(large, 4096);
+  }
+
+  BOOST_AUTO_TEST_CASE(steady_state_takes_no_heap) {
+    asio::io_context context;
+    asio::steady_timer timer(context);
+    int remain = 1000;
+    uint64_t warmedUp = 0;
+
+    std::function<void()> wait;
+    wait = [&]() {
+      timer.expires_after(std::chrono::microseconds(1));
+      timer.async_wait(libtun::recycled([&](const boost::system::error_code& err) {
+        if (--remain == 990) {
+          warmedUp = HandlerArena::stats().heapAllocations;
+        }
+        if (remain > 0) {
+          wait();
+        }
+      }));
+    };
+    wait();
+    context.run();
+
+    BOOST_REQUIRE_EQUAL(remain, 0);
+    BOOST_REQUIRE_EQUAL(HandlerArena::stats().heapAllocations, warmedUp);
+    BOOST_REQUIRE_GE(HandlerArena::stats().recycled, 990);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,62 @@
+#ifdef LIBTUN_IO_URING
+
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/IoUringEngine.h>
+
+BOOST_AUTO_TEST_SUITE(io_uring_engine)
+
+  namespace asio = boost::asio;
+  using asio::ip::udp;
+  using libtun::BufferPool;
+  using libtun::IoUringEngine;
+
+  BOOST_AUTO_TEST_CASE(send_and_receive_datagrams) {
+    asio::io_context context;
+    BufferPool<1600> pool;
+    std::vector<std::string> received;
+
+    {
+      udp::socket serverSocket(context, udp::endpoint(udp::v4(), 10075));
+      udp::socket clientSocket(context, udp::endpoint(udp::v4(), 10076));
+      IoUringEngine engine(&context, &pool, 64, 8);
+
+      auto onDatagram = [&](const udp::endpoint& from, libtun::Buffer buf) {
+        BOOST_REQUIRE_EQUAL(from.port(), 10076);
+        // the recvmsg header sits between the headroom and the payload
+        BOOST_REQUIRE_GE(buf.prefixSpace(), 50);
+        received.push_back(std::string((const char*)buf.data(), buf.size()));
+      };
+      engine.receiveFrom(serverSocket.native_handle(), onDatagram);
+
+      // more datagrams than provided buffers, they have to be recycled
+      for (int i = 0; i < 20; i++) {
+        auto buf = pool.acquire();
+        buf->size(0);
+        buf->writeStringToBack(std::to_string(i));
+        engine.sendTo(clientSocket.native_handle(), udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10075), std::move(buf));
+      }
+
+      asio::steady_timer timer(context);
+      timer.expires_after(std::chrono::milliseconds(500));
+      timer.async_wait([&](boost::system::error_code err) {
+        context.stop();
+      });
+      context.run();
+
+      BOOST_REQUIRE_EQUAL(engine.stats().sent, 20);
+      BOOST_REQUIRE_EQUAL(engine.stats().received, 20);
+    }
+
+    BOOST_REQUIRE_EQUAL(received.size(), 20);
+    for (int i = 0; i < 20; i++) {
+      BOOST_REQUIRE_EQUAL(received[i].substr(2), std::to_string(i));
+    }
+    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+#endif
@@ -0,0 +1,60 @@
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/pool/object_pool.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/MemoryAccounting.h>
+#include <libtun/BufferPool.h>
+#include <libtun/napt.h>
+
+BOOST_AUTO_TEST_SUITE(memory_accounting)
+
+  using libtun::MemoryAccount;
+  using libtun::MemoryAccounting;
+  using boost::asio::ip::address_v4;
+
+  BOOST_AUTO_TEST_CASE(high_water) {
+    MemoryAccount account;
+    account.allocated(100);
+    account.allocated(50);
+    account.released(120);
+    account.allocated(10);
+
+    auto usage = account.usage();
+    BOOST_REQUIRE_EQUAL(usage.bytes, 40);
+    BOOST_REQUIRE_EQUAL(usage.highWater, 150);
+    BOOST_REQUIRE_EQUAL(usage.allocations, 3);
+  }
+
+  BOOST_AUTO_TEST_CASE(accounted_allocators) {
+    auto before = MemoryAccounting::usage(MemoryAccounting::RPC).bytes;
+    {
+      std::map<int, int, std::less<int>, libtun::AccountedAllocator<std::pair<const int, int>, MemoryAccounting::RPC>> map;
+      map[1] = 1;
+      map[2] = 2;
+      BOOST_REQUIRE_GT(MemoryAccounting::usage(MemoryAccounting::RPC).bytes, before);
+
+      boost::object_pool<uint64_t, libtun::AccountedUserAllocator<MemoryAccounting::RPC>> pool;
+      BOOST_REQUIRE_EQUAL(*pool.construct(7), 7);
+    }
+    BOOST_REQUIRE_EQUAL(MemoryAccounting::usage(MemoryAccounting::RPC).bytes, before);
+  }
+
+  BOOST_AUTO_TEST_CASE(subsystems_are_charged) {
+    auto buffers = MemoryAccounting::usage(MemoryAccounting::BUFFERS).bytes;
+    auto napt = MemoryAccounting::usage(MemoryAccounting::NAPT_TABLES).bytes;
+    {
+      libtun::BufferPoolOptions options;
+      options.initialChunks = 1;
+      libtun::BufferPool<2048> pool(options);
+      BOOST_REQUIRE_EQUAL(MemoryAccounting::usage(MemoryAccounting::BUFFERS).bytes, buffers + 2048 * 32);
+
+      libtun::NAPT<address_v4, address_v4> table(10000, 10010);
+      table.createIfNotExist(1, 2000, address_v4::loopback(), 80);
+      BOOST_REQUIRE_GT(MemoryAccounting::usage(MemoryAccounting::NAPT_TABLES).bytes, napt);
+    }
+    BOOST_REQUIRE_EQUAL(MemoryAccounting::usage(MemoryAccounting::BUFFERS).bytes, buffers);
+    BOOST_REQUIRE_EQUAL(MemoryAccounting::usage(MemoryAccounting::NAPT_TABLES).bytes, napt);
+    BOOST_REQUIRE(MemoryAccounting::report().find("napt") != std::string::npos);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+#include <thread>
+#include <boost/test/unit_test.hpp>
+#include <libtun/SpscRing.h>
+
+BOOST_AUTO_TEST_SUITE(spsc_ring)
+
+  using libtun::SpscRing;
+
+  BOOST_AUTO_TEST_CASE(capacity_rounds_up) {
+    SpscRing<int> ring(5);
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 8);
+    BOOST_REQUIRE_EQUAL(ring.size(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(reset_allocates_and_empties) {
+    SpscRing<int> ring;
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 0);
+    BOOST_REQUIRE_EQUAL(ring.stats().capacity, 0);
+
+    ring.reset(3);
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 4);
+    *ring.producerSlot() = 1;
+    ring.publish();
+
+    ring.reset(8);
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 8);
+    BOOST_REQUIRE(ring.consumerSlot() == nullptr);
+    BOOST_REQUIRE_EQUAL(ring.stats().published, 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(full_and_empty) {
+    SpscRing<int> ring(4);
+    BOOST_REQUIRE(ring.consumerSlot() == nullptr);
+
+    for (int i = 0; i < 4; i++) {
+      *ring.producerSlot() = i;
+      ring.publish();
+    }
+    BOOST_REQUIRE(ring.producerSlot() == nullptr);
+    BOOST_REQUIRE_EQUAL(ring.size(), 4);
+
+    for (int i = 0; i < 4; i++) {
+      BOOST_REQUIRE_EQUAL(*ring.consumerSlot(), i);
+      ring.release();
+    }
+    BOOST_REQUIRE(ring.consumerSlot() == nullptr);
+
+    auto stats = ring.stats();
+    BOOST_REQUIRE_EQUAL(stats.size, 0);
+    BOOST_REQUIRE_EQUAL(stats.highWatermark, 4);
+    BOOST_REQUIRE_EQUAL(stats.published, 4);
+    BOOST_REQUIRE_EQUAL(stats.released, 4);
+    BOOST_REQUIRE_EQUAL(stats.full, 1);
+  }
+
+  BOOST_AUTO_TEST_CASE(producer_and_consumer_threads) {
+    const uint32_t count = 200000;
+    SpscRing<uint32_t> ring(64);
+
+    std::thread producer([&]() {
+      for (uint32_t i = 0; i < count;) {
+        auto slot = ring.producerSlot();
+        if (!slot) continue;
+        *slot = i++;
+        ring.publish();
+      }
+    });
+
+    uint32_t expected = 0;
+    while (expected < count) {
+      auto slot = ring.consumerSlot();
+      if (!slot) continue;
+      BOOST_REQUIRE_EQUAL(*slot, expected++);
+      ring.release();
+    }
+    producer.join();
+
+    BOOST_REQUIRE_EQUAL(ring.stats().published, count);
+    BOOST_REQUIRE_LE(ring.stats().highWatermark, 64);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,221 @@
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/TcpRelay.h>
+
+BOOST_AUTO_TEST_SUITE(tcp_relay)
+
+  namespace asio = boost::asio;
+  using asio::ip::tcp;
+  using libtun::TcpRelay;
+  using libtun::protocol::Ip4;
+  using libtun::protocol::Tcp;
+
+  const uint8_t FIN = 0x01, SYN = 0x02, RST = 0x04, PSH = 0x08, ACK = 0x10;
+  const char* CLIENT_IP = "10.0.0.2";
+  const uint16_t CLIENT_PORT = 40000;
+
+  struct Packet {
+    uint8_t flags;
+    uint32_t sequence;
+    uint32_t acknowledgment;
+    std::string payload;
+  };
+
+  // a client segment toward 127.0.0.1:`port`, with an MSS option on SYNs
+  std::vector<uint8_t> clientSegment(uint16_t port, uint8_t flags, uint32_t seq, uint32_t ack, const std::string& payload = "") {
+    uint32_t headerLen = (flags & SYN) ? 24 : 20;
+    std::vector<uint8_t> packet(20 + headerLen + payload.size(), 0);
+    packet[0] = 0x45;
+    packet[8] = 64;
+    packet[9] = Ip4::Protocol::TCP;
+
+    Ip4 ip(packet.data(), packet.size());
+    ip.totalLen(packet.size());
+    ip.sourceIP(asio::ip::make_address_v4(CLIENT_IP));
+    ip.destIP(asio::ip::make_address_v4("127.0.0.1"));
+
+    Tcp tcp(ip);
+    tcp.sourcePort(CLIENT_PORT);
+    tcp.destPort(port);
+    tcp.sequence(seq);
+    tcp.acknowledgment(ack);
+    tcp.headerLen(headerLen / 4);
+    tcp.flags(flags);
+    tcp.window(65535);
+    if (flags & SYN) {
+      uint8_t mss[4] = { 2, 4, 0x05, 0x78 };   // 1400
+      memcpy(packet.data() + 40, mss, 4);
+    }
+    memcpy(packet.data() + 20 + headerLen, payload.data(), payload.size());
+    tcp.calculateChecksumInplace();
+    ip.calculateChecksumInplace();
+    return packet;
+  }
+
+  struct Fixture {
+    asio::io_context context;
+    asio::executor_work_guard<asio::io_context::executor_type> work{context.get_executor()};
+    TcpRelay relay{&context};
+    std::vector<Packet> output;
+
+    Fixture() {
+      relay.onPacket = TcpRelay::PacketHandler::bind<Fixture, &Fixture::toClient>(this);
+    }
+
+    void toClient(uint16_t clientId, uint8_t* data, uint32_t size) {
+      BOOST_REQUIRE_EQUAL(clientId, 7);
+      Ip4 ip(data, size);
+      Tcp tcp(ip);
+      BOOST_REQUIRE_EQUAL(ip.totalLen(), size);
+      BOOST_REQUIRE_EQUAL(ip.checksum(), ip.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(tcp.checksum(), tcp.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(ip.destIP().to_string(), CLIENT_IP);
+      BOOST_REQUIRE_EQUAL(tcp.destPort(), CLIENT_PORT);
+      auto payload = tcp.payload();
+      output.push_back({
+        tcp.flags(), tcp.sequence(), tcp.acknowledgment(),
+        std::string((const char*)payload.data(), payload.size()),
+      });
+    }
+
+    void input(const std::vector<uint8_t>& packet) {
+      auto copy = packet;
+      relay.input(7, copy.data(), copy.size());
+    }
+
+    bool runUntil(std::function<bool()> done, int timeoutMs = 2000) {
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+      while (!done() && std::chrono::steady_clock::now() < deadline) {
+        context.run_one_for(std::chrono::milliseconds(10));
+      }
+      return done();
+    }
+  };
+
+  BOOST_AUTO_TEST_CASE(relays_a_flow_both_ways) {
+    Fixture f;
+    tcp::acceptor acceptor(f.context, tcp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10079));
+    tcp::socket upstream(f.context);
+    bool accepted = false;
+    acceptor.async_accept(upstream, [&](boost::system::error_code err) {
+      accepted = !err;
+    });
+
+    // handshake, the SYN-ACK waits for the upstream connect
+    f.input(clientSegment(10079, SYN, 1000, 0));
+    BOOST_REQUIRE(f.runUntil([&]() { return accepted && f.output.size() == 1; }));
+    BOOST_REQUIRE_EQUAL(f.output[0].flags, SYN | ACK);
+    BOOST_REQUIRE_EQUAL(f.output[0].acknowledgment, 1001);
+    uint32_t iss = f.output[0].sequence;
+    f.input(clientSegment(10079, ACK, 1001, iss + 1));
+    BOOST_REQUIRE_EQUAL(f.relay.flowCount(), 1);
+
+    // client -> upstream
+    f.output.clear();
+    f.input(clientSegment(10079, PSH | ACK, 1001, iss + 1, "hello"));
+    std::string received(5, 0);
+    bool read = false;
+    asio::async_read(upstream, asio::buffer(&received[0], 5), [&](boost::system::error_code err, size_t) {
+      read = !err;
+    });
+    BOOST_REQUIRE(f.runUntil([&]() { return read; }));
+    BOOST_REQUIRE_EQUAL(received, "hello");
+    BOOST_REQUIRE_EQUAL(f.output.back().flags, ACK);
+    BOOST_REQUIRE_EQUAL(f.output.back().acknowledgment, 1006);
+
+    // upstream -> client in MSS sized segments, resent while unacked
+    f.output.clear();
+    std::string reply(3000, 'x');
+    asio::write(upstream, asio::buffer(reply));
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() >= 3; }));
+    std::string relayed;
+    for (uint32_t i = 0; i < 3; i++) {
+      BOOST_REQUIRE_EQUAL(f.output[i].sequence, iss + 1 + relayed.size());
+      BOOST_REQUIRE_LE(f.output[i].payload.size(), 1400);
+      relayed += f.output[i].payload;
+    }
+    BOOST_REQUIRE_EQUAL(relayed, reply);
+
+    BOOST_REQUIRE(f.runUntil([&]() { return f.relay.stats().retransmits > 0; }));
+    BOOST_REQUIRE_EQUAL(f.output[3].sequence, iss + 1);
+    f.input(clientSegment(10079, ACK, 1006, iss + 3001));
+
+    // upstream closes first, its FIN is relayed, then the client's
+    f.output.clear();
+    upstream.shutdown(tcp::socket::shutdown_send);
+    BOOST_REQUIRE(f.runUntil([&]() { return !f.output.empty(); }));
+    BOOST_REQUIRE_EQUAL(f.output[0].flags, FIN | ACK);
+    BOOST_REQUIRE_EQUAL(f.output[0].sequence, iss + 3001);
+
+    bool eof = false;
+    char byte;
+    upstream.async_read_some(asio::buffer(&byte, 1), [&](boost::system::error_code err, size_t) {
+      eof = err == asio::error::eof;
+    });
+    f.input(clientSegment(10079, FIN | ACK, 1006, iss + 3002));
+    BOOST_REQUIRE(f.runUntil([&]() { return eof; }));
+    BOOST_REQUIRE_EQUAL(f.relay.flowCount(), 0);
+    BOOST_REQUIRE_EQUAL(f.relay.stats().upstreamBytes, 5);
+    BOOST_REQUIRE_EQUAL(f.relay.stats().downstreamBytes, 3000);
+  }
+
+  BOOST_AUTO_TEST_CASE(refused_connect_resets_the_client) {
+    Fixture f;
+    f.input(clientSegment(10080, SYN, 5000, 0));
+    BOOST_REQUIRE(f.runUntil([&]() { return !f.output.empty(); }));
+    BOOST_REQUIRE_EQUAL(f.output[0].flags, RST | ACK);
+    BOOST_REQUIRE_EQUAL(f.output[0].acknowledgment, 5001);
+    BOOST_REQUIRE_EQUAL(f.relay.flowCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(flows_are_capped) {
+    asio::io_context context;
+    std::vector<uint8_t> flags;
+    auto onPacket = [&](uint16_t, uint8_t* data, uint32_t size) {
+      Ip4 ip(data, size);
+      flags.push_back(Tcp(ip).flags());
+    };
+    TcpRelay relay(&context, 2, 3);
+    relay.onPacket = onPacket;
+    auto syn = [&](uint16_t clientId, uint16_t port) {
+      auto packet = clientSegment(port, SYN, 5000, 0);
+      relay.input(clientId, packet.data(), packet.size());
+    };
+
+    // the connects are pending, the third SYN of a client is reset at once
+    syn(7, 10081);
+    syn(7, 10082);
+    syn(7, 10083);
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 2);
+    BOOST_REQUIRE_EQUAL(flags.size(), 1);
+    BOOST_REQUIRE_EQUAL(flags[0], RST | ACK);
+
+    // and the relay takes 3 flows in all
+    syn(8, 10081);
+    syn(8, 10082);
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 3);
+    BOOST_REQUIRE_EQUAL(relay.stats().refusedFlows, 2);
+
+    // refused connects close the flows and free their slots
+    for (int i = 0; i < 200 && relay.flowCount() > 0; i++) {
+      context.run_one_for(std::chrono::milliseconds(10));
+    }
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 0);
+    syn(7, 10083);
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 1);
+  }
+
+  BOOST_AUTO_TEST_CASE(unknown_segments_are_reset) {
+    Fixture f;
+    f.input(clientSegment(10080, ACK, 5000, 777, "late"));
+    BOOST_REQUIRE_EQUAL(f.output.size(), 1);
+    BOOST_REQUIRE_EQUAL(f.output[0].flags, RST);
+    BOOST_REQUIRE_EQUAL(f.output[0].sequence, 777);
+    BOOST_REQUIRE_EQUAL(f.relay.flowCount(), 0);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,162 @@
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libtun/UdpRelay.h>
+
+BOOST_AUTO_TEST_SUITE(udp_relay)
+
+  namespace asio = boost::asio;
+  using asio::ip::udp;
+  using libtun::BufferPool;
+  using libtun::UdpRelay;
+  using libtun::protocol::Ip4;
+  using libtun::protocol::Udp;
+
+  const char* CLIENT_IP = "10.0.0.2";
+
+  std::vector<uint8_t> clientDatagram(uint16_t sourcePort, uint16_t destPort, const std::string& payload) {
+    std::vector<uint8_t> packet(28 + payload.size(), 0);
+    packet[0] = 0x45;
+    packet[8] = 64;
+    packet[9] = Ip4::Protocol::UDP;
+
+    Ip4 ip(packet.data(), packet.size());
+    ip.totalLen(packet.size());
+    ip.sourceIP(asio::ip::make_address_v4(CLIENT_IP));
+    ip.destIP(asio::ip::make_address_v4("127.0.0.1"));
+    ip.calculateChecksumInplace();
+
+    Udp udp(ip);
+    udp.sourcePort(sourcePort);
+    udp.destPort(destPort);
+    udp.totalLen(8 + payload.size());
+    memcpy(packet.data() + 28, payload.data(), payload.size());
+    return packet;
+  }
+
+  struct Fixture {
+    asio::io_context context;
+    asio::executor_work_guard<asio::io_context::executor_type> work{context.get_executor()};
+    BufferPool<1600> pool;
+    udp::socket echo{context, udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 10081)};
+    udp::endpoint echoFrom;
+    char echoBuffer[1500];
+    std::vector<std::vector<uint8_t>> output;
+
+    Fixture() {
+      _echo();
+    }
+
+    void attach(UdpRelay& relay) {
+      relay.onPacket = UdpRelay::PacketHandler::bind<Fixture, &Fixture::toClient>(this);
+    }
+
+    void toClient(uint16_t clientId, uint8_t* data, uint32_t size) {
+      BOOST_REQUIRE_EQUAL(clientId, 3);
+      output.push_back(std::vector<uint8_t>(data, data + size));
+    }
+
+    void input(UdpRelay& relay, const std::vector<uint8_t>& packet) {
+      auto copy = packet;
+      relay.input(3, copy.data(), copy.size());
+    }
+
+    bool runUntil(std::function<bool()> done, int timeoutMs = 2000) {
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+      while (!done() && std::chrono::steady_clock::now() < deadline) {
+        context.run_one_for(std::chrono::milliseconds(10));
+      }
+      return done();
+    }
+
+    void _echo() {
+      echo.async_receive_from(asio::buffer(echoBuffer), echoFrom, [this](boost::system::error_code err, size_t len) {
+        if (err) return;
+        echo.send_to(asio::buffer(echoBuffer, len), echoFrom);
+        _echo();
+      });
+    }
+  };
+
+  BOOST_AUTO_TEST_CASE(relays_replies_with_client_headers) {
+    Fixture f;
+    UdpRelay relay(&f.context, &f.pool);
+    f.attach(relay);
+
+    f.input(relay, clientDatagram(5353, 10081, "query 1"));
+    f.input(relay, clientDatagram(5353, 10081, "query 2"));
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 2; }));
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 1);
+
+    for (int i = 0; i < 2; i++) {
+      auto& packet = f.output[i];
+      Ip4 ip(packet.data(), packet.size());
+      Udp udp(ip);
+      BOOST_REQUIRE_EQUAL(ip.totalLen(), packet.size());
+      BOOST_REQUIRE_EQUAL(ip.checksum(), ip.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(ip.sourceIP().to_string(), "127.0.0.1");
+      BOOST_REQUIRE_EQUAL(ip.destIP().to_string(), CLIENT_IP);
+      BOOST_REQUIRE_EQUAL(udp.sourcePort(), 10081);
+      BOOST_REQUIRE_EQUAL(udp.destPort(), 5353);
+      BOOST_REQUIRE_EQUAL(udp.totalLen(), packet.size() - 20);
+      BOOST_REQUIRE_EQUAL(udp.checksum(), udp.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(std::string((char*)packet.data() + 28, packet.size() - 28), "query " + std::to_string(i + 1));
+    }
+
+    // another source port is another flow with its own socket
+    f.input(relay, clientDatagram(5354, 10081, "query 3"));
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 3; }));
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 2);
+    BOOST_REQUIRE_EQUAL(relay.stats().sentDatagrams, 3);
+    BOOST_REQUIRE_EQUAL(relay.stats().receivedDatagrams, 3);
+
+    relay.removeClient(3);
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 0);
+    f.runUntil([]() { return false; }, 50);
+  }
+
+  BOOST_AUTO_TEST_CASE(idle_flows_expire) {
+    Fixture f;
+    UdpRelay relay(&f.context, &f.pool, std::chrono::seconds(1));
+    f.attach(relay);
+
+    f.input(relay, clientDatagram(5353, 10081, "query"));
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 1; }));
+    BOOST_REQUIRE(f.runUntil([&]() { return relay.flowCount() == 0; }, 3000));
+    BOOST_REQUIRE_EQUAL(relay.stats().expired, 1);
+  }
+
+  BOOST_AUTO_TEST_CASE(idle_flows_hold_no_buffers) {
+    Fixture f;
+    UdpRelay relay(&f.context, &f.pool);
+    f.attach(relay);
+
+    f.input(relay, clientDatagram(5353, 10081, "query"));
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 1; }));
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 1);
+    BOOST_REQUIRE_EQUAL(f.pool.consumedCount(), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(flows_are_capped_per_client) {
+    Fixture f;
+    UdpRelay relay(&f.context, &f.pool, std::chrono::seconds(60), 2);
+    f.attach(relay);
+
+    f.input(relay, clientDatagram(5353, 10081, "query 1"));
+    f.input(relay, clientDatagram(5354, 10081, "query 2"));
+    f.input(relay, clientDatagram(5355, 10081, "query 3"));
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 2);
+    BOOST_REQUIRE_EQUAL(relay.stats().refusedFlows, 1);
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 2; }));
+
+    // a closed flow makes room again
+    relay.removeClient(3);
+    f.input(relay, clientDatagram(5355, 10081, "query 3"));
+    BOOST_REQUIRE_EQUAL(relay.flowCount(), 1);
+    BOOST_REQUIRE(f.runUntil([&]() { return f.output.size() == 3; }));
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -43,4 +43,24 @@ BOOST_AUTO_TEST_SUITE(protocol_ip4)
     BOOST_REQUIRE_EQUAL(newIp.destIP(), address2);
   }
 
+  BOOST_AUTO_TEST_CASE(replace_addresses) {
+    auto sample = readFile("test/.data/ip_tcp_1");
+    Ip4 ip((uint8_t*)sample.data(), sample.size());
+    libtun::protocol::Tcp tcp(ip);
+    auto address1 = boost::asio::ip::make_address_v4("10.200.0.2");
+    auto address2 = boost::asio::ip::make_address_v4("1.2.3.4");
+
+    auto from = ip.sourceIP().to_uint();
+    ip.replaceSourceIP(address1);
+    tcp.checksum(libtun::protocol::adjustChecksum(tcp.checksum(), from, address1.to_uint()));
+    from = ip.destIP().to_uint();
+    ip.replaceDestIP(address2);
+    tcp.checksum(libtun::protocol::adjustChecksum(tcp.checksum(), from, address2.to_uint()));
+
+    BOOST_REQUIRE_EQUAL(ip.sourceIP(), address1);
+    BOOST_REQUIRE_EQUAL(ip.destIP(), address2);
+    BOOST_REQUIRE_EQUAL(ip.checksum(), ip.calculateChecksum());
+    BOOST_REQUIRE_EQUAL(tcp.checksum(), tcp.calculateChecksum());
+  }
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,93 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <libtun/protocol.h>
+#include <libtun/BufferPool.h>
+#include "../_utils/utils.h"
+
+BOOST_AUTO_TEST_SUITE(protocol_offload)
+
+  using libtun::Buffer;
+  using libtun::BufferPool;
+  using libtun::protocol::Ip4;
+  using libtun::protocol::Tcp;
+  using libtun::protocol::Offload;
+
+  // the sample TCP packet grown into a superpacket with `payloadLen` bytes of payload
+  std::vector<uint8_t> superPacket(uint32_t payloadLen, uint8_t flags) {
+    auto sample = readFile("test/.data/ip_tcp_1");
+    Ip4 sampleIp((uint8_t*)sample.data(), sample.size());
+    uint32_t headerLen = sampleIp.headerLen() * 4 + Tcp(sampleIp).headerLen() * 4;
+
+    std::vector<uint8_t> packet(headerLen + payloadLen);
+    memcpy(packet.data(), sample.data(), headerLen);
+    for (uint32_t i = 0; i < payloadLen; i++) {
+      packet[headerLen + i] = i;
+    }
+
+    Ip4 ip(packet.data(), packet.size());
+    ip.totalLen(packet.size());
+    Tcp(ip).flags(flags);
+    return packet;
+  }
+
+  BOOST_AUTO_TEST_CASE(segment_tcp4) {
+    BufferPool<1600> pool;
+    auto packet = superPacket(2501, 0b00011001);
+    Ip4 ip(packet.data(), packet.size());
+    uint32_t sequence = Tcp(ip).sequence();
+    std::vector<Buffer> segments;
+
+    auto count = libtun::protocol::segmentTcp4(
+      packet.data(), packet.size(), 1000,
+      [&]() { return pool.alloc(); },
+      [&](Buffer buf) { segments.push_back(buf); }
+    );
+
+    BOOST_REQUIRE_EQUAL(count, 3);
+    BOOST_REQUIRE_EQUAL(segments.size(), 3);
+    for (uint32_t i = 0; i < 3; i++) {
+      Ip4 segmentIp(segments[i]);
+      Tcp tcp(segmentIp);
+      uint32_t payloadLen = i < 2 ? 1000 : 501;
+
+      BOOST_REQUIRE_EQUAL(segmentIp.totalLen(), segments[i].size());
+      BOOST_REQUIRE_EQUAL(segmentIp.id(), (uint16_t)(ip.id() + i));
+      BOOST_REQUIRE_EQUAL(segmentIp.checksum(), segmentIp.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(tcp.checksum(), tcp.calculateChecksum());
+      BOOST_REQUIRE_EQUAL(tcp.sequence(), sequence + i * 1000);
+      BOOST_REQUIRE_EQUAL(tcp.payload().size(), payloadLen);
+      BOOST_REQUIRE_EQUAL(((uint8_t*)tcp.payload().data())[0], (uint8_t)(i * 1000));
+      BOOST_REQUIRE_EQUAL(tcp.ACK(), true);
+      BOOST_REQUIRE_EQUAL(tcp.PSH(), i == 2);
+      BOOST_REQUIRE_EQUAL(tcp.FIN(), i == 2);
+      pool.free(segments[i]);
+    }
+  }
+
+  BOOST_AUTO_TEST_CASE(complete_checksum) {
+    auto packet = superPacket(333, 0b00010000);
+    Ip4 ip(packet.data(), packet.size());
+    Tcp tcp(ip);
+    uint16_t expected = tcp.calculateChecksum();
+
+    // what the kernel leaves behind: the checksum field seeded with the pseudo header sum
+    tcp.checksum(0);
+    uint32_t headerLen = ip.headerLen() * 4;
+    uint32_t pseudo = (ip.sourceIP().to_uint() >> 16) + (ip.sourceIP().to_uint() & 0xffff) +
+      (ip.destIP().to_uint() >> 16) + (ip.destIP().to_uint() & 0xffff) +
+      Ip4::Protocol::TCP + (packet.size() - headerLen);
+    while (pseudo >> 16) {
+      pseudo = (pseudo & 0xffff) + (pseudo >> 16);
+    }
+    tcp.checksum(pseudo);
+
+    Offload offload;
+    offload.needsChecksum = true;
+    offload.checksumStart = headerLen;
+    offload.checksumOffset = 16;
+    libtun::protocol::completeChecksum(packet.data(), packet.size(), offload);
+
+    BOOST_REQUIRE_EQUAL(tcp.checksum(), expected);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
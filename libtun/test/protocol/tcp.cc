@@ -40,10 +40,17 @@ BOOST_AUTO_TEST_SUITE(protocol_tcp)
     tcp.sourcePort(0xffff);
     tcp.destPort(0xfeff);
     tcp.checksum(0xfefe);
+    tcp.acknowledgment(0x01020304);
+    tcp.window(0xabcd);
+    tcp.headerLen(7);
 
     BOOST_REQUIRE_EQUAL(tcp.sourcePort(), 0xffff);
     BOOST_REQUIRE_EQUAL(tcp.destPort(), 0xfeff);
     BOOST_REQUIRE_EQUAL(tcp.checksum(), 0xfefe);
+    BOOST_REQUIRE_EQUAL(tcp.acknowledgment(), 0x01020304);
+    BOOST_REQUIRE_EQUAL(tcp.window(), 0xabcd);
+    BOOST_REQUIRE_EQUAL(tcp.headerLen(), 7);
+    BOOST_REQUIRE_EQUAL(tcp.ACK(), true);
   }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -17,4 +17,25 @@ BOOST_AUTO_TEST_SUITE(protocol_udp)
     BOOST_REQUIRE_EQUAL(udp.checksum(), 0);
   }
 
+  BOOST_AUTO_TEST_CASE(calculate_checksum) {
+    auto sample = readFile("test/.data/ip_udp_1");
+    Ip4 ip(sample);
+    Udp udp(ip);
+    udp.calculateChecksumInplace();
+
+    // summed with its checksum the datagram and the pseudo header fold to 0xffff
+    auto data = (uint8_t*)udp.payload().data() - 8;
+    uint32_t sum = Ip4::Protocol::UDP + udp.totalLen();
+    sum += (ip.sourceIP().to_uint() >> 16) + (ip.sourceIP().to_uint() & 0xffff);
+    sum += (ip.destIP().to_uint() >> 16) + (ip.destIP().to_uint() & 0xffff);
+    for (uint32_t i = 0; i < udp.totalLen(); i += 2) {
+      sum += ((uint16_t)data[i] << 8) + (i + 1 < udp.totalLen() ? data[i + 1] : 0);
+    }
+    while (sum >> 16) {
+      sum = (sum & 0xffff) + (sum >> 16);
+    }
+    BOOST_REQUIRE_NE(udp.checksum(), 0);
+    BOOST_REQUIRE_EQUAL(sum, 0xffff);
+  }
+
 BOOST_AUTO_TEST_SUITE_END()
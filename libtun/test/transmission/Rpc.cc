@@ -34,17 +34,10 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc)
       _rpc.onRequest = [&](libtun::Buffer buf, Rpc::ControlBlock* control) {
         requests.push_back(std::string((const char*)buf.data(), buf.size()));
 
-        auto buffer = _pool->alloc();
-        buffer.moveFrontBoundary(10);
-        buffer.data()[0] = 3;
-        buffer.data()[1] = 4;
-        buffer.size(2);
-
-        control->buffer = buffer;
-        control->onComplete = [&](boost::system::error_code err, libtun::Buffer buf, Rpc::ControlBlock* control) {
-          _pool->free(buf);
-        };
-
+        control->buffer = _pool->acquire();
+        control->buffer->data()[0] = 3;
+        control->buffer->data()[1] = 4;
+        control->buffer->size(2);
         return true;
       };
 
@@ -71,17 +64,15 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc)
     }
 
     void send() {
-      auto buffer = _pool->alloc();
-      buffer.moveFrontBoundary(10);
-      buffer.data()[0] = 1;
-      buffer.data()[1] = 2;
-      buffer.size(2);
+      auto buffer = _pool->acquire();
+      buffer->data()[0] = 1;
+      buffer->data()[1] = 2;
+      buffer->size(2);
 
-      _rpc.send(udp::endpoint(udp::v4(), 10060), buffer, [&](boost::system::error_code err, libtun::Buffer buf, Rpc::ControlBlock* control) {
+      _rpc.send(udp::endpoint(udp::v4(), 10060), std::move(buffer), [&](boost::system::error_code err, libtun::Buffer buf, Rpc::ControlBlock* control) {
         if (!err.failed()) {
           replies.push_back(std::string((const char*)buf.data(), buf.size()));
         }
-        _pool->free(control->buffer);
       });
     }
 
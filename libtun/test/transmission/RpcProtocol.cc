@@ -14,7 +14,7 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc_protocol)
   using libtun::transmission::Cryptor;
   using libtun::transmission::RpcProtocol;
   using libtun::transmission::RpcErrorType;
-  using libtun::BufferPool;
+  using libtun::SizedBufferPool;
 
   class Communicator {
   public:
@@ -26,7 +26,7 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc_protocol)
     libtun::Buffer socketBuf;
     uint8_t internalBuf[1600];
 
-    Communicator(asio::io_context* context, Cryptor* cryptor, BufferPool<1600>* pool, int port):
+    Communicator(asio::io_context* context, Cryptor* cryptor, SizedBufferPool* pool, int port):
       _context(context),
       _cryptor(cryptor),
       _pool(pool),
@@ -83,7 +83,7 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc_protocol)
   private:
     asio::io_context* _context;
     Cryptor* _cryptor;
-    BufferPool<1600>* _pool;
+    SizedBufferPool* _pool;
     udp::socket _socket;
     RpcProtocol _rpc;
 
@@ -92,7 +92,7 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc_protocol)
   BOOST_AUTO_TEST_CASE(rpc_protocol_communication) {
     asio::io_context context;
     Cryptor cryptor;
-    BufferPool<1600> pool;
+    SizedBufferPool pool;
 
     Communicator server(&context, &cryptor, &pool, 10060);
     Communicator client(&context, &cryptor, &pool, 10061);
@@ -123,8 +123,10 @@ BOOST_AUTO_TEST_SUITE(protocol_transmission_rpc_protocol)
     BOOST_REQUIRE_EQUAL(client.replies[1], "ping:1");
     BOOST_REQUIRE_EQUAL(client.replies[2], "disconnect:0");
 
-    BOOST_REQUIRE_EQUAL(pool.consumedCount(), 0);
-    BOOST_REQUIRE_EQUAL(pool.availableCount(), 32);
+    // the messages fit SMALL buffers, no MTU one is pinned
+    BOOST_REQUIRE_EQUAL(pool.small().consumedCount(), 0);
+    BOOST_REQUIRE_EQUAL(pool.small().availableCount(), 32);
+    BOOST_REQUIRE_EQUAL(pool.mtu().allCount(), 0);
   }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,97 @@
+#include <string>
+#include <boost/test/unit_test.hpp>
+#include <libtun/Exception.h>
+#include <libtun/transmission/SessionTable.h>
+
+BOOST_AUTO_TEST_SUITE(protocol_transmission_session_table)
+
+  using boost::asio::ip::udp;
+  using boost::asio::ip::address_v4;
+  using libtun::transmission::SessionTable;
+  using libtun::transmission::Cryptor;
+
+  udp::endpoint client(uint16_t port) {
+    return udp::endpoint(address_v4::loopback(), port);
+  }
+
+  BOOST_AUTO_TEST_CASE(open_and_close) {
+    SessionTable sessions(2);
+    BOOST_REQUIRE_EQUAL(sessions.capacity(), 2);
+    BOOST_REQUIRE_EQUAL(sessions.size(), 0);
+    BOOST_REQUIRE(sessions.connected(0) == nullptr);
+    BOOST_REQUIRE(sessions.connected(5) == nullptr);
+
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1000)), 0);
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1001)), 1);
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1002)), -1);
+    BOOST_REQUIRE_EQUAL(sessions.size(), 2);
+
+    BOOST_REQUIRE_EQUAL(sessions.lookup(client(1001)), 1);
+    BOOST_REQUIRE(sessions.connected(1)->endpoint == client(1001));
+
+    sessions.close(0);
+    BOOST_REQUIRE(sessions.connected(0) == nullptr);
+    BOOST_REQUIRE(sessions[0].cryptor == nullptr);
+    BOOST_REQUIRE_EQUAL(sessions.lookup(client(1000)), -1);
+    BOOST_REQUIRE_EQUAL(sessions.size(), 1);
+
+    // the freed id is handed out again
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1002)), 0);
+    BOOST_REQUIRE_EQUAL(sessions.lookup(client(1002)), 0);
+  }
+
+  BOOST_AUTO_TEST_CASE(inner_source_is_per_tenant) {
+    SessionTable sessions(1);
+    auto id = sessions.open(client(1000));
+    BOOST_REQUIRE(sessions[id].innerSource.is_unspecified());
+    sessions[id].innerSource = address_v4(0x0a000002);
+
+    sessions.close(id);
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1001)), id);
+    BOOST_REQUIRE(sessions[id].innerSource.is_unspecified());
+  }
+
+  BOOST_AUTO_TEST_CASE(quota_refusals_are_per_tenant) {
+    SessionTable sessions(1);
+    auto id = sessions.open(client(1000));
+    auto& quota = sessions.quota(id);
+    quota.limit(1);
+    BOOST_REQUIRE(quota.charge());
+    BOOST_REQUIRE(!quota.charge());
+
+    sessions.close(id);
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1001)), id);
+    BOOST_REQUIRE_EQUAL(quota.refused(), 0);
+    BOOST_REQUIRE_EQUAL(quota.inFlight(), 1);
+  }
+
+  BOOST_AUTO_TEST_CASE(cipher_from_key_material) {
+    SessionTable sessions(1);
+    uint32_t keySize = SessionTable::KEY_SIZE;
+    auto id = sessions.open(client(1000));
+    BOOST_REQUIRE_EQUAL(sessions.key(id).size(), keySize);
+    BOOST_REQUIRE_EQUAL(sessions.iv(id).size(), keySize);
+
+    std::string data = "this is my data";
+    std::string str(data);
+    Cryptor peer(sessions.key(id), sessions.iv(id));
+    peer.encrypt((void*)str.data(), str.size());
+    sessions.connected(id)->cryptor->decrypt((void*)str.data(), str.size());
+    BOOST_REQUIRE_EQUAL(str, data);
+  }
+
+  BOOST_AUTO_TEST_CASE(bounded_capacity) {
+    uint32_t maxCapacity = SessionTable::MAX_CAPACITY;
+    BOOST_REQUIRE_THROW(SessionTable(0), libtun::Exception);
+    BOOST_REQUIRE_THROW(SessionTable(maxCapacity + 1), libtun::Exception);
+
+    SessionTable sessions(maxCapacity);
+    for (uint32_t i = 0; i < maxCapacity; i++) {
+      sessions.open(udp::endpoint(address_v4(0x0a000000 + i), 1000));
+    }
+    BOOST_REQUIRE_EQUAL(sessions.size(), maxCapacity);
+    BOOST_REQUIRE_EQUAL(sessions.open(client(1000)), -1);
+    BOOST_REQUIRE_EQUAL(sessions.lookup(udp::endpoint(address_v4(0x0a00ffff), 1000)), 0xffff);
+  }
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,19 +4,55 @@
 
 namespace znserver {
 
+  constexpr std::chrono::milliseconds TunnelServer::PRESSURE_BACKOFF;
+  constexpr std::chrono::seconds TunnelServer::TRIM_INTERVAL;
+  constexpr std::chrono::seconds TunnelServer::NEXT_HOP_INTERVAL;
+
+  // the TCP/UDP checksums cover the addresses through the pseudo header,
+  // a UDP checksum of 0 means none and stays so
+  static void adjustTransportChecksum(Ip4& ip4, address_v4 from, address_v4 to) {
+    if (ip4.protocol() == Ip4::Protocol::TCP) {
+      Tcp tcp(ip4);
+      tcp.checksum(adjustChecksum(tcp.checksum(), from.to_uint(), to.to_uint()));
+    } else if (ip4.protocol() == Ip4::Protocol::UDP) {
+      Udp udp(ip4);
+      if (udp.checksum() != 0) {
+        auto sum = adjustChecksum(udp.checksum(), from.to_uint(), to.to_uint());
+        udp.checksum(sum == 0 ? 0xffff : sum);
+      }
+    }
+  }
+
   void TunnelServer::start() {
-    _rawSocket.onPacket = std::bind(&TunnelServer::_rawSocketPacketHandler, this, std::placeholders::_1, std::placeholders::_2);
-    _rawSocket.start(&_context, serverConfig.portFrom, serverConfig.portTo);
+    _rawSocket.onPacket = RawSocket::PacketHandler::bind<TunnelServer, &TunnelServer::_rawSocketPacketHandler>(this);
+    _tcpRelay.onPacket = libtun::TcpRelay::PacketHandler::bind<TunnelServer, &TunnelServer::_sendToClient>(this);
+    _udpRelay.onPacket = libtun::UdpRelay::PacketHandler::bind<TunnelServer, &TunnelServer::_sendToClient>(this);
 
-    auto requestBuf = _bufferPool->alloc();
-    requestBuf.moveFrontBoundary(50);
+    if (serverConfig.egress == EgressMode::KERNEL_NAT) {
+      _startKernelNat();
+    }
 
-    _socket.async_receive_from(
-      requestBuf.toMutableBuffer(),
-      _receiveEp,
-      std::bind(&TunnelServer::_onSocketReceive, this, std::placeholders::_1, std::placeholders::_2, requestBuf)
-    );
+    if (serverConfig.ioEngine == libtun::IoEngine::IO_URING) {
+      _startIoUring();
+    } else {
+      if (_needsRawSocket()) {
+        _rawSocket.start(&_context, serverConfig.portFrom, serverConfig.portTo);
+      }
+      if (serverConfig.egress == EgressMode::KERNEL_NAT) {
+        _waitTunnel();
+      }
 
+      if (serverConfig.udpOffload && _batchSocket.enableOffload(&_pools->offload())) {
+        LOG_INFO << "tunnel server socket uses UDP GSO/GRO";
+      }
+      _batchSocket.startReceive(BatchedUdpSocket::ReceiveHandler::bind<TunnelServer, &TunnelServer::_onSocketReceive>(this));
+    }
+
+    _trimPool();
+    if (_needsRawSocket()) {
+      _refreshNextHop();
+    }
+    _waitMemoryDump();
     LOG_TRACE << fmt::format("tunnel server is running on port {}", serverConfig.listenPort);
 
     _context.run();
@@ -24,51 +60,102 @@ namespace znserver {
 
   void TunnelServer::stop() {
     _rawSocket.stop();
+    _kernelNat.remove();
     _context.stop();
   }
 
-  void TunnelServer::_onSocketReceive(error_code err, std::size_t transfered, libtun::Buffer buf) {
-    if (err.failed()) {
-      _bufferPool->free(buf);
+  // relayed TCP and UDP leave nothing for the raw socket
+  bool TunnelServer::_needsRawSocket() const {
+    if (serverConfig.egress == EgressMode::KERNEL_NAT) {
+      return false;
+    }
+    return serverConfig.egress == EgressMode::RAW_NAPT || !serverConfig.udpRelay;
+  }
+
+  void TunnelServer::_startKernelNat() {
+    auto network = serverConfig.innerNetwork;
+    if (!_tunnel.open() || !_tunnel.setAddress(address_v4(network.network().to_uint() + 1), network.prefix_length())) {
+      throw libtun::Exception("kernel nat egress can not set up the tunnel");
+    }
+    _kernelNat.install(network, _tunnel.ifName());
+    LOG_INFO << fmt::format("tunnel server egresses through {} with kernel nat", _tunnel.ifName());
+  }
+
+  // the socket and the raw socket (or the kernel nat tun) are driven by the ring, no reader thread
+  void TunnelServer::_startIoUring() {
+#ifdef LIBTUN_IO_URING
+    _engine.reset(new libtun::IoUringEngine(&_context, _bufferPool));
+    if (_needsRawSocket()) {
+      _rawSocket.open(serverConfig.portFrom, serverConfig.portTo);
+      // the NAPT path is inlined into the packet loop
+      _engine->pollReadable(_rawSocket.fd(), [this]() {
+        _rawSocket.poll([this](uint8_t* data, uint32_t size) {
+          _rawSocketPacketHandler(data, size);
+        });
+      });
+    }
+    if (serverConfig.egress == EgressMode::KERNEL_NAT) {
+      _engine->read(_tunnel.fds()[0], [this](libtun::Buffer buf) {
+        _tunnelPacketHandler(buf.data(), buf.size());
+      });
+    }
+    _engine->receiveFrom(
+      _socket.native_handle(),
+      libtun::IoUringEngine::DatagramHandler::bind<TunnelServer, &TunnelServer::_onSocketReceive>(this)
+    );
+    LOG_INFO << "tunnel server uses the io_uring engine";
+#else
+    throw libtun::Exception("io_uring engine is not compiled in");
+#endif
+  }
+
+  void TunnelServer::_sendDatagram(const udp::endpoint& to, const libtun::DatagramChain& chain, libtun::PooledBuffer owner) {
+#ifdef LIBTUN_IO_URING
+    if (_engine) {
+      _engine->sendTo(_socket.native_handle(), to, chain, std::move(owner));
+      return;
+    }
+#endif
+    _batchSocket.send(to, chain, std::move(owner));
+  }
+
+  void TunnelServer::_onSocketReceive(const udp::endpoint& from, libtun::Buffer buf) {
+    if (buf.size() == 0) {
       return;
     }
 
     auto command = buf.data()[0];
-    buf.size(transfered);
     buf.moveFrontBoundary(1);
 
     if (command == Command::TRANSMIT) {
-      _processTransmit(buf);
+      _processTransmit(from, buf);
     } else if (command == Command::REPLY || command == Command::REQUEST) {
-      _rpc.feed(_receiveEp, buf);
+      _rpc.feed(from, buf);
     }
-    _bufferPool->free(buf);
-
-    auto requestBuf = _bufferPool->alloc();
-    requestBuf.moveFrontBoundary(50);
-
-    _socket.async_receive_from(
-      requestBuf.toMutableBuffer(),
-      _receiveEp,
-      std::bind(&TunnelServer::_onSocketReceive, this, std::placeholders::_1, std::placeholders::_2, requestBuf)
-    );
   }
 
-  void TunnelServer::_processTransmit(const libtun::Buffer& buf) {
+  void TunnelServer::_processTransmit(const udp::endpoint& from, const libtun::Buffer& buf) {
+    LIBTUN_DATAPATH_SCOPE;
     uint16_t clientId = endian::big_to_native(*((uint16_t*)buf.data()));
     Ip4 ip4(buf.data() + 2, buf.size() - 2);
 
-    if (
-      clientId >= sessions.size() ||
-      sessions[clientId].endpoint != _receiveEp ||
-      !sessions[clientId].isConnected() ||
-      ip4.calculateChecksum() != ip4.checksum()
-    ) {
+    auto session = sessions.connected(clientId);
+    if (!session || session->endpoint != from || ip4.calculateChecksum() != ip4.checksum()) {
       return;
     }
 
-    sessions[clientId].cryptor.decrypt(buf.data() + 2, buf.size() - 2);
-    sessions[clientId].updateTransmit(buf.size() + 1);
+    session->cryptor->decrypt(buf.data() + 2, buf.size() - 2);
+    session->updateTransmit(buf.size() + 1);
+
+    if (serverConfig.egress == EgressMode::KERNEL_NAT) {
+      return _forwardToTunnel(clientId, buf.data() + 2, buf.size() - 2);
+    }
+    if (serverConfig.egress == EgressMode::TCP_RELAY && ip4.protocol() == Ip4::Protocol::TCP) {
+      return _tcpRelay.input(clientId, buf.data() + 2, buf.size() - 2);
+    }
+    if (serverConfig.udpRelay && ip4.protocol() == Ip4::Protocol::UDP) {
+      return _udpRelay.input(clientId, buf.data() + 2, buf.size() - 2);
+    }
 
     if (ip4.protocol() == Ip4::Protocol::TCP) {
       Tcp tcp(ip4);
@@ -92,10 +179,15 @@ namespace znserver {
   }
 
   void TunnelServer::_removeSession(uint16_t id) {
-    if (id <= sessions.size()) {
-      sessions[id].status = SessionStatus::IDLE;
+    if (sessions.connected(id)) {
+      if (sessions.quota(id).refused() > 0) {
+        LOG_DEBUG << fmt::format("session {} ends with {} packets over its buffer quota", id, sessions.quota(id).refused());
+      }
+      sessions.close(id);
       tcpNapt.removeClient(id);
       udpNapt.removeClient(id);
+      _tcpRelay.removeClient(id);
+      _udpRelay.removeClient(id);
     }
   }
 
@@ -103,52 +195,50 @@ namespace znserver {
     udp::endpoint from, std::string name, std::string password
   ) {
     if (name == "zxl" && password == "457348") {
-      int16_t id = -1;
-      for (int i = 0; i < sessions.size(); i++) {
-        if (sessions[i].isIdle()) {
-          id = i;
-        }
+      // a reconnecting client starts over
+      int32_t previous = sessions.lookup(from);
+      if (previous >= 0) {
+        _removeSession(previous);
       }
 
-      if (id == -1) {
-        id = sessions.size();
-        sessions.push_back(Session());
+      int32_t id = sessions.open(from);
+      if (id < 0) {
+        return {RpcErrorType::TOO_MANY_CONNECTION, "", ""};
       }
-      sessions[id].reset(id, from);
+      sessions.quota(id).limit(serverConfig.sessionBufferQuota);
 
-      return {RpcErrorType::SUCCESS, sessions[id].cryptor.key, sessions[id].cryptor.iv};
+      return {RpcErrorType::SUCCESS, sessions.key(id), sessions.iv(id)};
     }
     return {RpcErrorType::WRONG_CREDENTIAL, "", ""};
   }
 
   RpcErrorType TunnelServer::_rpcPingHandler(udp::endpoint from) {
-    for (int i = 0; i < sessions.size(); i++) {
-      if (sessions[i].endpoint == from && sessions[i].isConnected()) {
-        sessions[i].updateTransmit(0);
-        return RpcErrorType::SUCCESS;
-      }
+    int32_t id = sessions.lookup(from);
+    if (id < 0) {
+      return RpcErrorType::NOT_CONNECTED;
     }
-    return RpcErrorType::NOT_CONNECTED;
+    sessions[id].updateTransmit(0);
+    return RpcErrorType::SUCCESS;
   }
 
   RpcErrorType TunnelServer::_rpcDisconnectHandler(udp::endpoint from) {
-    for (int i = 0; i < sessions.size(); i++) {
-      if (sessions[i].endpoint == from && sessions[i].isConnected()) {
-        sessions[i].status = SessionStatus::IDLE;
-        return RpcErrorType::SUCCESS;
-      }
+    int32_t id = sessions.lookup(from);
+    if (id < 0) {
+      return RpcErrorType::NOT_CONNECTED;
     }
-    return RpcErrorType::NOT_CONNECTED;
+    _removeSession(id);
+    return RpcErrorType::SUCCESS;
   }
 
   void TunnelServer::_rawSocketPacketHandler(uint8_t* data, uint32_t size) {
+    LIBTUN_DATAPATH_SCOPE;
     Ip4 ip(data, size);
     uint16_t clientId;
 
     if (ip.protocol() == Ip4::Protocol::TCP) {
       Tcp tcp(ip);
       auto conn = tcpNapt.find(ip.sourceIP(), tcp.sourcePort(), tcp.destPort());
-      if (!conn || !sessions[conn->clientID].isConnected()) {
+      if (!conn || !sessions.connected(conn->clientID)) {
         return;
       }
       clientId = conn->clientID;
@@ -156,7 +246,7 @@ namespace znserver {
     } else if (ip.protocol() == Ip4::Protocol::UDP) {
       Udp udp(ip);
       auto conn = udpNapt.find(ip.sourceIP(), udp.sourcePort(), udp.destPort());
-      if (!conn || !sessions[conn->clientID].isConnected()) {
+      if (!conn || !sessions.connected(conn->clientID)) {
         return;
       }
       clientId = conn->clientID;
@@ -165,17 +255,202 @@ namespace znserver {
       return;
     }
 
-    auto buf = _bufferPool->alloc();
-    buf.moveFrontBoundary(10);
-    buf.data()[0] = Command::TRANSMIT;
-    buf.size(size + 1);
+    _sendToClient(clientId, data, size);
+  }
+
+  // the session's quota, and past the soft limit of the MTU pool only the
+  // sessions holding no more than an even share of the buffers in use
+  bool TunnelServer::_admits(uint16_t clientId) {
+    auto& quota = sessions.quota(clientId);
+    if (!quota.admits()) {
+      return false;
+    }
+    if (_bufferPool->pressured() && (uint64_t)quota.inFlight() * sessions.size() > _bufferPool->consumedCount()) {
+      quota.refuse();
+      return false;
+    }
+    return true;
+  }
+
+  void TunnelServer::_sendToClient(uint16_t clientId, uint8_t* data, uint32_t size) {
+    // dropped over the session's quota, its share under pressure or at the
+    // hard limit of the class, counted against the session every time
+    auto session = sessions.connected(clientId);
+    if (!session || !_admits(clientId)) {
+      return;
+    }
+    auto& quota = sessions.quota(clientId);
+    auto buf = _pools->acquire(size);
+    if (!buf) {
+      quota.refuse();
+      return;
+    }
+    if (!buf.charge(&quota)) {
+      return;
+    }
+    buf->size(size);
+    session->cryptor->encrypt(data, buf->data(), size);
 
-    sessions[clientId].cryptor.encrypt(data, buf.data() + 1, size);
-    _socket.async_send_to(buf.toMutableBuffer(), sessions[clientId].endpoint, [&, buf](
-      const error_code& sendErr, std::size_t transfered
-    ) {
-      _bufferPool->free(buf);
+    TransmitChain chain;
+    chain.prepend(1)[0] = Command::TRANSMIT;
+    chain.append(*buf);
+    _sendDatagram(session->endpoint, chain, std::move(buf));
+  }
+
+  /* KERNEL NAT EGRESS
+  only the inner address is swapped, the session's own address on the way
+  out and back on the way in, both checksums are adjusted incrementally.
+  ports, NAPT tables and the uplink address are the kernel's business.
+  */
+
+  void TunnelServer::_forwardToTunnel(uint16_t clientId, uint8_t* data, uint32_t size) {
+    auto session = sessions.connected(clientId);
+    if (!session) {
+      return;
+    }
+
+    Ip4 ip4(data, size);
+    auto network = serverConfig.innerNetwork;
+    uint32_t inner = network.network().to_uint() + 2 + clientId;
+    if (inner >= network.broadcast().to_uint()) {
+      return;
+    }
+
+    auto source = ip4.sourceIP();
+    session->innerSource = source;
+
+    ip4.replaceSourceIP(address_v4(inner));
+    adjustTransportChecksum(ip4, source, address_v4(inner));
+    _tunnel.write(libtun::Buffer(data, size));
+  }
+
+  void TunnelServer::_waitTunnel() {
+    if (!_tunnelDescriptor.is_open()) {
+      _tunnelDescriptor.assign(::dup(_tunnel.fds()[0]));
+    }
+    _tunnelDescriptor.async_wait(boost::asio::posix::stream_descriptor::wait_read, libtun::recycled([this](const boost::system::error_code& err) {
+      if (err) {
+        return;
+      }
+
+      // backpressure, the packets wait in the tun queue until the pool drains
+      libtun::Buffer bufs[TUNNEL_BATCH];
+      uint32_t allocated = 0;
+      while (!_bufferPool->pressured() && allocated < TUNNEL_BATCH && _bufferPool->tryAlloc(bufs[allocated])) {
+        allocated++;
+      }
+      if (allocated == 0) {
+        _backoff(std::bind(&TunnelServer::_waitTunnel, this));
+        return;
+      }
+
+      uint32_t count;
+      do {
+        count = _tunnel.readBatch(bufs, allocated, 0, nullptr, false);
+        for (uint32_t i = 0; i < count; i++) {
+          _tunnelPacketHandler(bufs[i].data(), bufs[i].size());
+          bufs[i].size(bufs[i].internalSize());
+        }
+      } while (count == allocated);
+      for (uint32_t i = 0; i < allocated; i++) {
+        _bufferPool->free(bufs[i]);
+      }
+
+      _waitTunnel();
+    }));
+  }
+
+  void TunnelServer::_backoff(std::function<void()> resume) {
+    _backoffTimer.expires_after(PRESSURE_BACKOFF);
+    _backoffTimer.async_wait(libtun::recycled([resume](const boost::system::error_code& err) {
+      if (!err) {
+        resume();
+      }
+    }));
+  }
+
+  // idle chunks go back to the system, only pools with BufferPoolOptions::releaseIdle do anything
+  void TunnelServer::_trimPool() {
+    _trimTimer.expires_after(TRIM_INTERVAL);
+    _trimTimer.async_wait([this](const boost::system::error_code& err) {
+      if (err) {
+        return;
+      }
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+      _checkTripwire();
+#endif
+      auto released = _pools->trim();
+      if (released > 0) {
+        auto stats = _bufferPool->stats();
+        LOG_DEBUG << fmt::format("buffer pools released {} idle chunks, {} MTU chunks left, {} exhausted", released, stats.chunks, stats.exhausted);
+      }
+      _trimPool();
+    });
+  }
+
+  // the gateway MAC of the raw socket egress follows ARP and route changes
+  void TunnelServer::_refreshNextHop() {
+    _nextHopTimer.expires_after(NEXT_HOP_INTERVAL);
+    _nextHopTimer.async_wait([this](const boost::system::error_code& err) {
+      if (err) {
+        return;
+      }
+      _rawSocket.refreshNextHop();
+      _refreshNextHop();
+    });
+  }
+
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+  // the first trim interval is the warm-up, the pools and the handler arena
+  // are filled by then. new NAPT flows still allocate their table entries
+  void TunnelServer::_checkTripwire() {
+    if (libtun::AllocationTripwire::mode() == libtun::AllocationTripwire::OFF) {
+      libtun::AllocationTripwire::arm(libtun::AllocationTripwire::COUNT);
+      LOG_INFO << "allocation tripwire armed";
+      return;
+    }
+    auto allocations = libtun::AllocationTripwire::allocations();
+    if (allocations > _tripwireReported) {
+      LOG_WARNING << fmt::format("allocation tripwire: {} heap allocations on the packet path in the last interval", allocations - _tripwireReported);
+      _tripwireReported = allocations;
+    }
+  }
+#endif
+
+  void TunnelServer::_waitMemoryDump() {
+    _memoryDumpSignal.async_wait([this](const boost::system::error_code& err, int signal) {
+      if (err) {
+        return;
+      }
+      LOG_INFO << fmt::format(
+        "memory accounting, {} of {} sessions connected\n{}",
+        sessions.size(), sessions.capacity(), libtun::MemoryAccounting::report()
+      );
+      _waitMemoryDump();
     });
   }
 
-} // namespace znserver
\ No newline at end of file
+  void TunnelServer::_tunnelPacketHandler(uint8_t* data, uint32_t size) {
+    Ip4 ip(data, size);
+    if (size < 20 || ip.version() != 4) {
+      return;
+    }
+    uint32_t base = serverConfig.innerNetwork.network().to_uint() + 2;
+    uint32_t dest = ip.destIP().to_uint();
+    if (dest < base) {
+      return;
+    }
+
+    uint32_t clientId = dest - base;
+    auto session = sessions.connected(clientId);
+    if (!session || session->innerSource.is_unspecified()) {
+      return;
+    }
+
+    auto client = session->innerSource;
+    ip.replaceDestIP(client);
+    adjustTransportChecksum(ip, address_v4(dest), client);
+    _sendToClient(clientId, data, size);
+  }
+
+} // namespace znserver
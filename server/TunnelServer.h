@@ -2,6 +2,9 @@
 #define SERVER_TUNNEL_SERVER_INCLUDED
 
 #include <exception>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
@@ -10,7 +13,20 @@
 #include <libtun/napt.h>
 #include <libtun/protocol.h>
 #include <libtun/BufferPool.h>
+#include <libtun/BufferChain.h>
+#include <libtun/BatchedUdpSocket.h>
 #include <libtun/RawSocket.h>
+#include <libtun/Tunnel.h>
+#include <libtun/KernelNat.h>
+#include <libtun/TcpRelay.h>
+#include <libtun/UdpRelay.h>
+#include <libtun/IoEngine.h>
+#include <libtun/HandlerAllocator.h>
+#include <libtun/MemoryAccounting.h>
+#include <libtun/AllocationTripwire.h>
+#ifdef LIBTUN_IO_URING
+  #include <libtun/IoUringEngine.h>
+#endif
 
 namespace znserver {
 
@@ -18,19 +34,50 @@ namespace znserver {
   using boost::asio::ip::udp;
   using boost::asio::io_context;
   using boost::asio::ip::address_v4;
+  using boost::asio::ip::network_v4;
   using libtun::NAPT;
   using libtun::BufferPool;
+  using libtun::BatchedUdpSocket;
   using libtun::RawSocket;
+  using libtun::Tunnel;
+  using libtun::KernelNat;
   using namespace libtun::protocol;
   using namespace libtun::transmission;
 
+  // RAW_NAPT: the raw socket plus the userspace NAPT tables
+  // KERNEL_NAT: session packets go through a tun device, see libtun::KernelNat
+  // TCP_RELAY: TCP flows are terminated and relayed over kernel sockets, see
+  // libtun::TcpRelay, everything else takes the RAW_NAPT path
+  enum EgressMode {
+    RAW_NAPT,
+    KERNEL_NAT,
+    TCP_RELAY,
+  };
+
+  // the command in front of an encrypted packet toward a client
+  typedef libtun::BufferChain<1> TransmitChain;
+
   struct TunnelServerConfig {
     uint16_t listenPort;
     uint16_t portFrom;
     uint16_t portTo;
-    uint8_t maxSessions;
+    // fixed at startup, up to libtun::transmission::SessionTable::MAX_CAPACITY
+    uint32_t maxSessions;
     std::string key;
     std::string iv;
+    uint16_t ioBatchSize;
+    uint16_t ioReceiveDepth;
+    bool udpOffload;
+    libtun::IoEngine ioEngine;
+    EgressMode egress;
+    // RAW_NAPT/TCP_RELAY, UDP flows go through connected sockets, see libtun::UdpRelay
+    bool udpRelay;
+    // KERNEL_NAT only, the tun takes the first host address, session i gets the (i + 2)th
+    network_v4 innerNetwork;
+    // buffers a session may have in flight toward its client, 0 is unbounded.
+    // packets past it are shed before any work is done for them, and so are
+    // those of sessions over an even share while the MTU pool is pressured
+    uint32_t sessionBufferQuota;
   };
 
   class TunnelServer {
@@ -39,32 +86,63 @@ namespace znserver {
     TunnelServerConfig serverConfig;
     NAPT<address_v4, address_v4> tcpNapt;
     NAPT<address_v4, address_v4> udpNapt;
-    std::vector<Session> sessions;
+    SessionTable sessions;
 
-    TunnelServer(TunnelServerConfig config, BufferPool<1600>* pool):
+    // MTU buffers carry the packets, the other classes control messages and offload aggregates
+    TunnelServer(TunnelServerConfig config, libtun::SizedBufferPool* pools):
       tcpNapt(config.portFrom, config.portTo),
       udpNapt(config.portFrom, config.portTo),
       sessions(config.maxSessions),
       serverConfig(config),
-      _bufferPool(pool),
+      _pools(pools),
+      _bufferPool(&pools->mtu()),
       _socket(_context, udp::endpoint(udp::v4(), config.listenPort)),
+      _batchSocket(&_socket, _bufferPool, config.ioBatchSize),
       _cryptor(config.key, config.iv),
-      _rpc(&_context, &_socket, &_cryptor, pool) {}
+      _rpc(&_context, &_socket, &_cryptor, pools) {
+      _batchSocket.receiveDepth(config.ioReceiveDepth);
+    }
 
     void start();
     void stop();
 
   private:
+    static const uint32_t TUNNEL_BATCH = 32;
+    static constexpr std::chrono::milliseconds PRESSURE_BACKOFF{5};
+    static constexpr std::chrono::seconds TRIM_INTERVAL{1};
+    static constexpr std::chrono::seconds NEXT_HOP_INTERVAL{5};
+
     io_context _context;
+    libtun::SizedBufferPool* _pools;
     BufferPool<1600>* _bufferPool;
     udp::socket _socket;
-    udp::endpoint _receiveEp;
+    BatchedUdpSocket _batchSocket;
     RpcProtocol _rpc;
     Cryptor _cryptor;
     RawSocket _rawSocket;
+    Tunnel _tunnel;
+    KernelNat _kernelNat;
+    libtun::TcpRelay _tcpRelay{&_context};
+    libtun::UdpRelay _udpRelay{&_context, _bufferPool};
+    boost::asio::posix::stream_descriptor _tunnelDescriptor{_context};
+    boost::asio::steady_timer _backoffTimer{_context};
+    boost::asio::steady_timer _trimTimer{_context};
+    boost::asio::steady_timer _nextHopTimer{_context};
+    // SIGUSR1 logs the memory accounting
+    boost::asio::signal_set _memoryDumpSignal{_context, SIGUSR1};
+#ifdef LIBTUN_IO_URING
+    std::unique_ptr<libtun::IoUringEngine> _engine;
+#endif
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+    uint64_t _tripwireReported = 0;
+#endif
 
-    void _onSocketReceive(error_code err, std::size_t transfered, libtun::Buffer buf);
-    void _processTransmit(const libtun::Buffer& buf);
+    void _startIoUring();
+    void _startKernelNat();
+    bool _needsRawSocket() const;
+    void _sendDatagram(const udp::endpoint& to, const libtun::DatagramChain& chain, libtun::PooledBuffer owner);
+    void _onSocketReceive(const udp::endpoint& from, libtun::Buffer buf);
+    void _processTransmit(const udp::endpoint& from, const libtun::Buffer& buf);
     void _removeSession(uint16_t id);
 
     std::tuple<RpcErrorType, std::string, std::string> _rpcConnectHandler(udp::endpoint from, std::string name, std::string password);
@@ -73,6 +151,19 @@ namespace znserver {
 
     void _rawSocketLoopHandler();
     void _rawSocketPacketHandler(uint8_t* data, uint32_t size);
+    void _sendToClient(uint16_t clientId, uint8_t* data, uint32_t size);
+    bool _admits(uint16_t clientId);
+
+    void _forwardToTunnel(uint16_t clientId, uint8_t* data, uint32_t size);
+    void _waitTunnel();
+    void _backoff(std::function<void()> resume);
+    void _trimPool();
+    void _refreshNextHop();
+    void _waitMemoryDump();
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+    void _checkTripwire();
+#endif
+    void _tunnelPacketHandler(uint8_t* data, uint32_t size);
   };
 
 } // namespace znserver
@@ -1,18 +1,58 @@
+#ifdef LIBTUN_ALLOCATION_TRIPWIRE
+  // the counting operator new and malloc live in this translation unit
+  #define LIBTUN_ALLOCATION_TRIPWIRE_HOOKS
+  #include <libtun/AllocationTripwire.h>
+#endif
 #include <libtun/BufferPool.h>
 #include "TunnelServer.h"
 
 int main() {
 
-  libtun::BufferPool<1600> pool;
   znserver::TunnelServerConfig config = {
     .listenPort = 8080,
     .portFrom = 64335,
     .portTo = 64995,
-    .maxSessions = 10,
+    .maxSessions = 1024,
     .key = "1234567890123456",
     .iv = "6543210987654321",
+    .ioBatchSize = 32,
+    .ioReceiveDepth = 4,
+    .udpOffload = false,
+    .ioEngine = libtun::IoEngine::ASIO,
+    .egress = znserver::EgressMode::RAW_NAPT,
+    .udpRelay = false,
+    .innerNetwork = boost::asio::ip::make_network_v4("10.200.0.0/16"),
+    .sessionBufferQuota = 4096,
   };
-  znserver::TunnelServer server(config, &pool);
+
+  // reserved and faulted in up front so the first burst takes no page faults.
+  // bounded to ~100MB, from 3/4 of it tunnel reads back off and the sessions
+  // over an even share of the buffers in use are shed. io_uring
+  // registers the chunks with the kernel, those are never given back
+  libtun::BufferPoolOptions mtuOptions;
+  mtuOptions.buffersPerChunk = 1024;
+  mtuOptions.initialChunks = 4;
+  mtuOptions.hugePages = true;
+  mtuOptions.prefault = true;
+  mtuOptions.maxBuffers = 65536;
+  mtuOptions.softBuffers = 49152;
+  if (config.ioEngine != libtun::IoEngine::IO_URING) {
+    mtuOptions.releaseIdle = std::chrono::seconds(30);
+  }
+
+  // rpc messages and small packets
+  libtun::BufferPoolOptions smallOptions;
+  smallOptions.buffersPerChunk = 256;
+  smallOptions.releaseIdle = std::chrono::seconds(30);
+
+  // GRO aggregates, bounded to 16MB
+  libtun::BufferPoolOptions offloadOptions;
+  offloadOptions.buffersPerChunk = 4;
+  offloadOptions.maxBuffers = 256;
+  offloadOptions.releaseIdle = std::chrono::seconds(30);
+
+  libtun::SizedBufferPool pools(smallOptions, mtuOptions, offloadOptions);
+  znserver::TunnelServer server(config, &pools);
 
   try {
     server.start();